@@ -8,6 +8,69 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdatomic.h>
+
+// Applied operation IDs are kept for a week, then purged in batches
+#define OPERATION_ID_TTL (7 * 24 * 3600)
+#define OPERATION_PURGE_INTERVAL 3600
+#define OPERATION_PURGE_BATCH 1000
+
+// events.is_active states; pending events are waiting for their start_time
+#define EVENT_ENDED 0
+#define EVENT_ACTIVE 1
+#define EVENT_PENDING 2
+
+// Free pages are reclaimed in steps of VACUUM_STEP_PAGES once stdin has been
+// idle for VACUUM_IDLE_MS, so a step never delays a completion or purchase.
+#define VACUUM_STEP_PAGES 64
+#define VACUUM_IDLE_MS 500
+
+// With --in-memory, committed changes reach disk at most this many seconds
+// later unless --sync-journal is also given (see memory_checkpoint)
+#define MEMORY_CHECKPOINT_INTERVAL 5
+
+// Time allowed between a shutdown signal and the database being closed
+#define SHUTDOWN_DRAIN_SECONDS 5
+
+// Lock contention with other processes: how long SQLite may wait for a lock
+// before a statement fails with SQLITE_BUSY, and how often a whole
+// transaction is retried after that
+#define BUSY_TIMEOUT_MS 2000
+#define TRANSACTION_ATTEMPTS 5
+#define TRANSACTION_BACKOFF_MS 20
+#define TRANSACTION_BUSY -2
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+// Ended events move to the archive database in batches, at most this often
+#define ARCHIVE_INTERVAL 3600
+#define ARCHIVE_BATCH 100
+
+// Lapsed currency lots are retired at most this often, this many per transaction
+#define LOT_EXPIRY_INTERVAL 60
+#define LOT_EXPIRY_BATCH 500
+
+// Units added to the cart stay reserved this long; lapsed holds are released
+// this many per transaction
+#define STOCK_HOLD_TTL 600
+#define HOLD_RELEASE_BATCH 500
+
+#define DEADLINE_EVENT_END 0
+#define DEADLINE_EVENT_ACTIVATION 1
+#define DEADLINE_HOLD_EXPIRY 2
+
+// 2^24 bits (2 MiB) and 7 probes keep false positives around 1% at a million IDs
+#define OPERATION_BLOOM_BITS (1u << 24)
+#define OPERATION_BLOOM_PROBES 7
 
 struct currency {
     int currency_id;
@@ -34,125 +97,1031 @@ struct task {
     int is_completed;
 };
 
+// Retained copy of a store row; the strings are owned and freed by free_store_items
 struct store_item {
     int item_id;
-    char item_description[256];
+    char *item_description;
     int cost;
     int event_id;
     int stock;
-    char category[50];
+    char *category;
 };
 
-const char *sql_insert_currency = "INSERT INTO currency (currency_name, symbol, balance) VALUES (?, ?, ?);";
-sqlite3_stmt *stmt_insert_currency;
+struct task_ref {
+    int event_id;
+    int task_id;
+};
+
+struct cart_line {
+    int event_id;
+    int item_id;
+    int quantity;
+    int hold_id;
+};
+
+// Borrowed row views handed to visitors. Text points straight into the
+// statement's current row and is only valid until the visitor returns;
+// visitors that keep a row must copy what they need.
+struct task_row {
+    int event_id;
+    int task_id;
+    const char *task_description;
+    int task_description_length;
+    int currency_amount;
+    int is_completed;
+    int remaining_prereqs;
+};
+
+struct store_item_row {
+    int item_id;
+    const char *item_description;
+    int item_description_length;
+    int cost;
+    int event_id;
+    int stock;
+    const char *category;
+    int category_length;
+};
+
+// Visitors return non-zero to stop the scan after the current row
+typedef int (*task_visitor)(const struct task_row *row, void *context);
+typedef int (*store_item_visitor)(const struct store_item_row *row, void *context);
 
-const char *sql_insert_events = "INSERT INTO events (event_name, currency_id, is_time_limited, start_time, end_time, is_active) VALUES (?, ?, ?, ?, ?, ?);";
-sqlite3_stmt *stmt_insert_events;
+// IDs continue from sqlite_sequence in steps of ?5, starting at ?4 + ?5; see
+// bind_id_sequence
+const char *sql_insert_currency = "INSERT INTO currency (currency_id, currency_name, symbol, balance, lot_lifetime_days) VALUES ((SELECT coalesce(max(seq), ?4) + ?5 FROM sqlite_sequence WHERE name = 'currency'), ?1, ?2, ?3, ?6);";
+
+const char *sql_insert_events = "INSERT INTO events (event_id, event_name, currency_id, is_time_limited, start_time, end_time, is_active) VALUES ((SELECT coalesce(max(seq), ?7) + ?8 FROM sqlite_sequence WHERE name = 'events'), ?1, ?2, ?3, ?4, ?5, ?6);";
 
 const char *sql_insert_tasks = "INSERT INTO tasks (event_id, task_id, task_description, currency_amount, is_completed) VALUES (?, ?, ?, ?, ?);";
-sqlite3_stmt *stmt_insert_tasks;
 
 const char *sql_insert_store = "INSERT INTO store (item_id, item_description, cost, event_id, stock, category) VALUES (?, ?, ?, ?, ?, ?);";
-sqlite3_stmt *stmt_insert_store;
 
 const char *sql_select_currency = "SELECT * FROM currency;";
-sqlite3_stmt *stmt_select_currency;
 
-const char *sql_select_active_events = "SELECT * FROM events WHERE is_active = 1;";
-sqlite3_stmt *stmt_select_active_events;
+const char *sql_select_currency_by_id = "SELECT * FROM currency WHERE currency_id = ?;";
+
+// Changes when another connection commits to the main database
+const char *sql_select_data_version = "PRAGMA main.data_version;";
+
+const char *sql_count_own_currencies = "SELECT count(*) FROM main.currency;";
 
-const char *sql_select_incomplete_tasks_of_an_event = "SELECT * FROM tasks WHERE is_completed = 0 AND event_id = ?;";
-sqlite3_stmt *stmt_select_incomplete_tasks_of_an_event;
+// Bumped by triggers on reward_rules, so the compiled rules know when to rebuild
+const char *sql_select_reward_rules_version = "SELECT version FROM reward_rules_version;";
 
-const char *sql_update_task_completion = "UPDATE tasks SET is_completed = 1 WHERE task_id = ? AND event_id = ?;";
-sqlite3_stmt *stmt_update_task_completion;
+const char *sql_select_reward_rules = "SELECT rule_id, kind, value, event_id, currency_id, weekdays, start_time, end_time, min_streak FROM reward_rules WHERE is_enabled = 1 ORDER BY priority, rule_id;";
 
-const char *sql_update_balance = "UPDATE currency SET balance = balance + ? WHERE currency_id = ?;";
-sqlite3_stmt *stmt_update_balance;
+const char *sql_insert_reward_ledger = "INSERT INTO reward_ledger (credited_at, credited_day, event_id, task_id, currency_id, base_amount, amount, rules, rules_version) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);";
 
-const char *sql_select_store_items_of_an_event = "SELECT * FROM store WHERE event_id = ?;";
-sqlite3_stmt *stmt_select_store_items_of_an_event;
+const char *sql_insert_task_dependency = "INSERT OR IGNORE INTO task_dependencies (event_id, task_id, dependent_task_id) VALUES (?1, ?2, ?3);";
 
-const char *sql_update_store_stock = "UPDATE store SET stock = stock - 1 WHERE item_id = ? AND event_id = ? AND stock != -1;";
-sqlite3_stmt *stmt_update_store_stock;
+// Whether ?2 can be reached from ?3 along dependency edges, in which case
+// making ?2 a prerequisite of ?3 would close a cycle
+const char *sql_select_dependency_path = "WITH RECURSIVE reachable(task_id) AS (SELECT ?3 UNION SELECT d.dependent_task_id FROM task_dependencies d JOIN reachable r ON d.task_id = r.task_id WHERE d.event_id = ?1) SELECT 1 FROM reachable WHERE task_id = ?2;";
 
-const char *sql_select_all_tasks_of_an_event = "SELECT * FROM tasks WHERE event_id = ?;";
-sqlite3_stmt *stmt_select_all_tasks_of_an_event;
+const char *sql_select_active_events = "SELECT * FROM events WHERE is_active = 1;";
+
+const char *sql_select_incomplete_tasks_of_an_event = "SELECT event_id, task_id, task_description, currency_amount, is_completed, remaining_prereqs FROM tasks WHERE is_completed = 0 AND event_id = ?;";
+
+// Uses idx_tasks_available; locked tasks of a quest chain are not looked at
+const char *sql_select_available_tasks_of_an_event = "SELECT event_id, task_id, task_description, currency_amount, is_completed, remaining_prereqs FROM tasks WHERE is_completed = 0 AND remaining_prereqs = 0 AND event_id = ?;";
+
+// Completes the task only if nobody else has, returning the reward to credit
+const char *sql_update_task_completion = "UPDATE tasks SET is_completed = 1 WHERE task_id = ? AND event_id = ? AND is_completed = 0 AND remaining_prereqs = 0 RETURNING currency_amount;";
+
+const char *sql_update_balance = "UPDATE currency SET balance = balance + ? WHERE currency_id = ? RETURNING balance;";
+
+const char *sql_select_all_tasks_of_an_event = "SELECT event_id, task_id, task_description, currency_amount, is_completed, remaining_prereqs FROM tasks WHERE event_id = ?;";
 
 const char *sql_update_event_completion = "UPDATE events SET is_active = 0 WHERE event_id = ?;";
-sqlite3_stmt *stmt_update_event_completion;
 
 const char *sql_daily_missions = "SELECT * FROM events WHERE event_id = 1;";
-sqlite3_stmt *stmt_daily_missions;
 
 const char *sql_reinitialize_daily_missions_event = "UPDATE events SET start_time = ?, end_time = ?, is_active = 1 WHERE event_id = 1;";
-sqlite3_stmt *stmt_reinitialize_daily_missions_event;
 
 const char *sql_reinitialize_daily_missions_tasks = "UPDATE tasks SET is_completed = 0 WHERE event_id = 1;";
-sqlite3_stmt *stmt_reinitialize_daily_missions_tasks;
 
-void handle_sigint(int sig, siginfo_t *info, void *context) {
-    // Access the db pointer passed via the context
-    sqlite3 *db = (sqlite3 *)info->si_value.sival_ptr;
+// Writers take the write lock up front; see begin_transaction
+const char *sql_begin_transaction = "BEGIN IMMEDIATE;";
 
-    // Signal-safe message
-    const char *msg = "\nCaught SIGINT (Ctrl+C). Finalizing statements, Closing database and exiting...\n";
-    write(STDERR_FILENO, msg, strlen(msg));
+const char *sql_commit_transaction = "COMMIT;";
 
-    if (stmt_insert_currency) sqlite3_finalize(stmt_insert_currency);
-    if (stmt_insert_events) sqlite3_finalize(stmt_insert_events);
-    if (stmt_insert_tasks) sqlite3_finalize(stmt_insert_tasks);
-    if (stmt_insert_store) sqlite3_finalize(stmt_insert_store);
-
-    if (stmt_select_currency) sqlite3_finalize(stmt_select_currency);
-    if (stmt_select_active_events) sqlite3_finalize(stmt_select_active_events);
-    if (stmt_select_incomplete_tasks_of_an_event) sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-    if (stmt_update_task_completion) sqlite3_finalize(stmt_update_task_completion);
-    if (stmt_update_balance) sqlite3_finalize(stmt_update_balance);
-    if (stmt_select_store_items_of_an_event) sqlite3_finalize(stmt_select_store_items_of_an_event);
-    if (stmt_update_store_stock) sqlite3_finalize(stmt_update_store_stock);
-    if (stmt_select_all_tasks_of_an_event) sqlite3_finalize(stmt_select_all_tasks_of_an_event);
-    if (stmt_update_event_completion) sqlite3_finalize(stmt_update_event_completion);
-    if (stmt_daily_missions) sqlite3_finalize(stmt_daily_missions);
-    if (stmt_reinitialize_daily_missions_event) sqlite3_finalize(stmt_reinitialize_daily_missions_event);
-    if (stmt_reinitialize_daily_missions_tasks) sqlite3_finalize(stmt_reinitialize_daily_missions_tasks);
-
-    if (db) {
-        int rc = sqlite3_close(db);
-        if (rc != SQLITE_OK) {
-            const char *err_msg = "Failed to close database.\n";
-            write(STDERR_FILENO, err_msg, strlen(err_msg));
-        } else {
-            const char *success_msg = "Database connection closed.\n";
-            write(STDERR_FILENO, success_msg, strlen(success_msg));
-        }
-    }
+const char *sql_rollback_transaction = "ROLLBACK;";
+
+const char *sql_select_store_item_price = "SELECT s.cost, e.currency_id FROM store s JOIN events e ON e.event_id = s.event_id WHERE s.event_id = ? AND s.item_id = ? AND e.is_active = 1;";
+
+// Debits ?1 only if the balance covers it
+const char *sql_debit_balance = "UPDATE currency SET balance = balance - ?1 WHERE currency_id = ?2 AND balance >= ?1 RETURNING balance;";
+
+// A credit to an expiring currency becomes a lot that lapses lot_lifetime_days
+// later; other currencies get no lot
+const char *sql_insert_currency_lot = "INSERT INTO currency_lots (currency_id, expires_at, remaining) SELECT currency_id, ?2 + lot_lifetime_days * 86400, ?3 FROM currency WHERE currency_id = ?1 AND lot_lifetime_days IS NOT NULL AND ?3 > 0;";
+
+// Both use idx_currency_lots_currency_expiry
+const char *sql_select_oldest_currency_lot = "SELECT lot_id, remaining FROM currency_lots WHERE currency_id = ? ORDER BY expires_at, lot_id LIMIT 1;";
+
+const char *sql_select_next_lot_expiries = "SELECT currency_id, expires_at, sum(remaining) FROM currency_lots l WHERE expires_at = (SELECT min(expires_at) FROM currency_lots WHERE currency_id = l.currency_id) GROUP BY currency_id ORDER BY currency_id;";
+
+const char *sql_consume_currency_lot = "UPDATE currency_lots SET remaining = remaining - ?1 WHERE lot_id = ?2 AND remaining > ?1;";
+
+const char *sql_delete_currency_lot = "DELETE FROM currency_lots WHERE lot_id = ?;";
+
+// The oldest lapsed lots, by idx_currency_lots_expiry. Their currencies are
+// debited first, then the lots are deleted; lot_id breaks ties so both
+// statements pick the same batch.
+#define LAPSED_LOTS "(SELECT lot_id FROM currency_lots WHERE expires_at <= ?1 ORDER BY expires_at, lot_id LIMIT ?2)"
+
+const char *sql_debit_lapsed_lots = "UPDATE currency SET balance = max(0, balance - (SELECT sum(remaining) FROM currency_lots WHERE currency_id = currency.currency_id AND lot_id IN " LAPSED_LOTS ")) WHERE currency_id IN (SELECT currency_id FROM currency_lots WHERE lot_id IN " LAPSED_LOTS ");";
+
+const char *sql_delete_lapsed_lots = "DELETE FROM currency_lots WHERE lot_id IN " LAPSED_LOTS ";";
+
+// Bumped by triggers on achievements, like reward_rules_version
+const char *sql_select_achievements_version = "SELECT version FROM achievements_version;";
+
+// A currency_id of NULL, or 0 as the column defaulted to before, means any currency
+const char *sql_select_achievements = "SELECT a.achievement_id, a.name, a.metric, nullif(a.currency_id, 0), a.threshold, u.achievement_id IS NOT NULL FROM achievements a LEFT JOIN achievement_unlocks u ON u.achievement_id = a.achievement_id;";
+
+// Adds ?3 to a counter and returns its new value
+const char *sql_add_achievement_counter = "INSERT INTO achievement_counters (metric, currency_id, value, best) VALUES (?1, ?2, ?3, ?3) ON CONFLICT (metric, currency_id) DO UPDATE SET value = value + excluded.value, best = max(best, value + excluded.value) RETURNING value;";
+
+// Once every Daily Missions task is done, the streak counts the current window:
+// one more if the previous window was completed too, otherwise it restarts at
+// 1. Returns no row while missions are left.
+#define DAILY_STREAK_VALUE "CASE WHEN period = excluded.period THEN value WHEN period = excluded.period - 86400 THEN value + 1 ELSE 1 END"
+
+const char *sql_extend_daily_streak = "INSERT INTO achievement_counters (metric, currency_id, value, best, period) SELECT 'daily_streak', 0, 1, 1, start_time FROM events WHERE event_id = 1 AND NOT EXISTS (SELECT 1 FROM tasks WHERE event_id = 1 AND is_completed = 0) ON CONFLICT (metric, currency_id) DO UPDATE SET value = " DAILY_STREAK_VALUE ", best = max(best, " DAILY_STREAK_VALUE "), period = excluded.period RETURNING value;";
+
+// At the rollover to the window starting at ?1, a streak that did not count
+// the window just ended is broken
+const char *sql_break_daily_streak = "UPDATE achievement_counters SET value = 0 WHERE metric = 'daily_streak' AND currency_id = 0 AND value > 0 AND period < ?1 - 86400;";
+
+const char *sql_insert_achievement_unlock = "INSERT OR IGNORE INTO achievement_unlocks (achievement_id, unlocked_at) VALUES (?, ?);";
+
+// Progress towards an any-currency achievement is that of its furthest currency
+const char *sql_select_achievement_progress = "SELECT a.achievement_id, a.name, a.metric, nullif(a.currency_id, 0), a.threshold, coalesce((SELECT max(c.value) FROM achievement_counters c WHERE c.metric = a.metric AND (nullif(a.currency_id, 0) IS NULL OR c.currency_id = a.currency_id)), 0), u.unlocked_at FROM achievements a LEFT JOIN achievement_unlocks u ON u.achievement_id = a.achievement_id ORDER BY a.achievement_id;";
+
+const char *sql_select_daily_streak = "SELECT value, best FROM achievement_counters WHERE metric = 'daily_streak' AND currency_id = 0;";
+
+// Stock holds: store.held counts the units of live holds, so what is available
+// is stock - held without adding holds up. Reserving and confirming are each
+// guarded by a single statement.
+#define AVAILABLE_STOCK "CASE WHEN stock = -1 THEN -1 ELSE stock - held END"
+
+// Holds ?1 units only while that many are available, returning what is left
+const char *sql_reserve_stock = "UPDATE store SET held = held + ?1 WHERE item_id = ?2 AND event_id = ?3 AND (stock = -1 OR stock - held >= ?1) AND event_id IN (SELECT event_id FROM events WHERE is_active = 1) RETURNING " AVAILABLE_STOCK ";";
+
+const char *sql_insert_stock_hold = "INSERT INTO stock_holds (event_id, item_id, quantity, expires_at) VALUES (?, ?, ?, ?) RETURNING hold_id;";
+
+// Takes a hold that has not lapsed, the guard of a confirmation
+const char *sql_claim_stock_hold = "DELETE FROM stock_holds WHERE hold_id = ?1 AND event_id = ?2 AND item_id = ?3 AND expires_at > ?4 RETURNING quantity;";
+
+// Turns ?1 held units into sold ones; unlimited (-1) stock stays unlimited
+const char *sql_confirm_stock = "UPDATE store SET stock = CASE WHEN stock = -1 THEN -1 ELSE stock - ?1 END, held = held - ?1 WHERE item_id = ?2 AND event_id = ?3 AND held >= ?1 RETURNING " AVAILABLE_STOCK ";";
+
+const char *sql_delete_stock_hold = "DELETE FROM stock_holds WHERE hold_id = ? RETURNING event_id, item_id, quantity;";
+
+const char *sql_release_stock = "UPDATE store SET held = max(0, held - ?1) WHERE item_id = ?2 AND event_id = ?3 RETURNING " AVAILABLE_STOCK ";";
+
+// The oldest lapsed holds, by idx_stock_holds_expiry. Their units go back to
+// the store first, then the holds are deleted; hold_id breaks ties so both
+// statements pick the same batch.
+#define LAPSED_HOLDS "(SELECT hold_id FROM stock_holds WHERE expires_at <= ?1 ORDER BY expires_at, hold_id LIMIT ?2)"
+
+const char *sql_release_lapsed_holds = "UPDATE store SET held = max(0, held - (SELECT sum(quantity) FROM stock_holds WHERE event_id = store.event_id AND item_id = store.item_id AND hold_id IN " LAPSED_HOLDS ")) WHERE (event_id, item_id) IN (SELECT event_id, item_id FROM stock_holds WHERE hold_id IN " LAPSED_HOLDS ");";
+
+const char *sql_delete_lapsed_holds = "DELETE FROM stock_holds WHERE hold_id IN " LAPSED_HOLDS ";";
+
+const char *sql_select_next_hold_expiry = "SELECT min(expires_at) FROM stock_holds;";
+
+const char *sql_clear_bulk_task_selection = "DELETE FROM temp.bulk_task_selection;";
+
+const char *sql_insert_bulk_task_selection = "INSERT OR IGNORE INTO temp.bulk_task_selection (event_id, task_id) VALUES (?, ?);";
+
+const char *sql_complete_selected_tasks = "UPDATE tasks SET is_completed = 1 WHERE is_completed = 0 AND remaining_prereqs = 0 AND (event_id, task_id) IN (SELECT event_id, task_id FROM temp.bulk_task_selection) AND event_id IN (SELECT event_id FROM events WHERE is_active = 1) RETURNING event_id, currency_amount, task_id;";
+
+const char *sql_complete_remaining_tasks_of_an_event = "UPDATE tasks SET is_completed = 1 WHERE event_id = ? AND is_completed = 0 AND remaining_prereqs = 0 AND event_id IN (SELECT event_id FROM events WHERE is_active = 1) RETURNING event_id, currency_amount, task_id;";
+
+const char *sql_select_event_currency = "SELECT currency_id FROM events WHERE event_id = ?;";
+
+const char *sql_select_applied_operation = "SELECT result FROM applied_operations WHERE operation_id = ?;";
+
+// Records an operation ID; no row changes if it was already applied
+const char *sql_insert_applied_operation = "INSERT INTO applied_operations (operation_id, applied_at, result) VALUES (?, ?, ?) ON CONFLICT (operation_id) DO NOTHING;";
+
+const char *sql_select_all_operation_ids = "SELECT operation_id FROM applied_operations;";
+
+const char *sql_purge_expired_operations = "DELETE FROM applied_operations WHERE operation_id IN (SELECT operation_id FROM applied_operations WHERE applied_at < ? LIMIT ?);";
+
+const char *sql_select_event_deadlines = "SELECT event_id, end_time FROM events WHERE is_active = 1 AND is_time_limited = 1;";
+
+const char *sql_select_event_schedule = "SELECT event_name, end_time, is_active FROM events WHERE event_id = ?;";
+
+// Both use idx_events_pending_start, so neither looks at active or ended events
+const char *sql_select_next_activation = "SELECT start_time FROM events WHERE is_active = 2 ORDER BY start_time LIMIT 1;";
+
+const char *sql_activate_due_events = "UPDATE events SET is_active = 1 WHERE is_active = 2 AND start_time <= ? RETURNING event_id, event_name, end_time;";
+
+const char *sql_select_pending_events = "SELECT * FROM events WHERE is_active = 2 ORDER BY start_time;";
+
+// One archival batch: the oldest ended events. Daily Missions is only briefly
+// inactive while it is reset, so it is never archived.
+#define ARCHIVABLE_EVENTS "(SELECT event_id FROM main.events WHERE is_active = 0 AND event_id != 1 ORDER BY event_id LIMIT ?1)"
+
+const char *sql_archive_events = "INSERT OR REPLACE INTO archive.events (event_id, event_name, currency_id, is_time_limited, start_time, end_time, is_active, archived_at) SELECT event_id, event_name, currency_id, is_time_limited, start_time, end_time, is_active, ?2 FROM main.events WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+const char *sql_archive_tasks = "INSERT OR REPLACE INTO archive.tasks SELECT event_id, task_id, task_description, currency_amount, is_completed FROM main.tasks WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+const char *sql_archive_store = "INSERT OR REPLACE INTO archive.store SELECT item_id, item_description, cost, event_id, stock, category FROM main.store WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+const char *sql_delete_archived_tasks = "DELETE FROM main.tasks WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+// Quest chains end with their event; the edges are not archived
+const char *sql_delete_archived_task_dependencies = "DELETE FROM main.task_dependencies WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+const char *sql_delete_archived_stock_holds = "DELETE FROM main.stock_holds WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+const char *sql_delete_archived_store = "DELETE FROM main.store WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+const char *sql_delete_archived_events = "DELETE FROM main.events WHERE event_id IN " ARCHIVABLE_EVENTS ";";
+
+// Page accounting and incremental vacuum, one set per database file
+const char *sql_select_main_page_count = "PRAGMA main.page_count;";
+
+const char *sql_select_main_freelist_count = "PRAGMA main.freelist_count;";
+
+const char *sql_main_incremental_vacuum = "PRAGMA main.incremental_vacuum(" TO_STRING(VACUUM_STEP_PAGES) ");";
+
+const char *sql_select_archive_page_count = "PRAGMA archive.page_count;";
+
+const char *sql_select_archive_freelist_count = "PRAGMA archive.freelist_count;";
+
+const char *sql_archive_incremental_vacuum = "PRAGMA archive.incremental_vacuum(" TO_STRING(VACUUM_STEP_PAGES) ");";
+
+// History spans the hot tables and the archive through the temp.all_* views
+const char *sql_select_ended_events = "SELECT * FROM temp.all_events WHERE is_active = 0 ORDER BY event_id;";
+
+const char *sql_select_all_tasks_of_an_event_history = "SELECT * FROM temp.all_tasks WHERE event_id = ?;";
+
+// Task index load: sizes first, then the columns in primary key order
+const char *sql_count_tasks = "SELECT count(*), total(length(CAST(task_description AS BLOB))), (SELECT count(DISTINCT event_id) FROM tasks) FROM tasks;";
+
+const char *sql_select_task_columns = "SELECT event_id, task_id, currency_amount, is_completed, task_description FROM tasks ORDER BY event_id, task_id;";
+
+// Range scan over idx_store_event_cost, cheapest first
+// Stock here is what is left after holds
+const char *sql_select_purchasable_items_by_cost = "SELECT item_id, item_description, cost, event_id, " AVAILABLE_STOCK ", category FROM store WHERE event_id = ? AND (stock = -1 OR stock > held) ORDER BY cost, item_id;";
+
+// Likewise, so the store listing does not offer units that are already held
+const char *sql_select_store_items_of_an_event = "SELECT item_id, item_description, cost, event_id, " AVAILABLE_STOCK ", category FROM store WHERE event_id = ?;";
+
+// Statement registry. Statements are prepared on first use and finalized
+// together at exit. Ones on the completion, purchase and scheduler paths are
+// prepared with SQLITE_PREPARE_PERSISTENT since they live for the whole run;
+// setup and maintenance statements are not.
+enum statement_id {
+    STMT_INSERT_CURRENCY,
+    STMT_INSERT_EVENTS,
+    STMT_INSERT_TASKS,
+    STMT_INSERT_STORE,
+    STMT_SELECT_CURRENCY,
+    STMT_SELECT_ACTIVE_EVENTS,
+    STMT_SELECT_INCOMPLETE_TASKS_OF_AN_EVENT,
+    STMT_UPDATE_TASK_COMPLETION,
+    STMT_UPDATE_BALANCE,
+    STMT_SELECT_STORE_ITEMS_OF_AN_EVENT,
+    STMT_SELECT_ALL_TASKS_OF_AN_EVENT,
+    STMT_UPDATE_EVENT_COMPLETION,
+    STMT_DAILY_MISSIONS,
+    STMT_REINITIALIZE_DAILY_MISSIONS_EVENT,
+    STMT_REINITIALIZE_DAILY_MISSIONS_TASKS,
+    STMT_BEGIN_TRANSACTION,
+    STMT_COMMIT_TRANSACTION,
+    STMT_ROLLBACK_TRANSACTION,
+    STMT_SELECT_STORE_ITEM_PRICE,
+    STMT_DEBIT_BALANCE,
+    STMT_CLEAR_BULK_TASK_SELECTION,
+    STMT_INSERT_BULK_TASK_SELECTION,
+    STMT_COMPLETE_SELECTED_TASKS,
+    STMT_COMPLETE_REMAINING_TASKS_OF_AN_EVENT,
+    STMT_SELECT_EVENT_CURRENCY,
+    STMT_SELECT_APPLIED_OPERATION,
+    STMT_INSERT_APPLIED_OPERATION,
+    STMT_SELECT_ALL_OPERATION_IDS,
+    STMT_PURGE_EXPIRED_OPERATIONS,
+    STMT_SELECT_EVENT_DEADLINES,
+    STMT_SELECT_EVENT_SCHEDULE,
+    STMT_SELECT_NEXT_ACTIVATION,
+    STMT_ACTIVATE_DUE_EVENTS,
+    STMT_SELECT_PENDING_EVENTS,
+    STMT_ARCHIVE_EVENTS,
+    STMT_ARCHIVE_TASKS,
+    STMT_ARCHIVE_STORE,
+    STMT_DELETE_ARCHIVED_TASKS,
+    STMT_DELETE_ARCHIVED_STORE,
+    STMT_DELETE_ARCHIVED_EVENTS,
+    STMT_SELECT_MAIN_PAGE_COUNT,
+    STMT_SELECT_MAIN_FREELIST_COUNT,
+    STMT_MAIN_INCREMENTAL_VACUUM,
+    STMT_SELECT_ARCHIVE_PAGE_COUNT,
+    STMT_SELECT_ARCHIVE_FREELIST_COUNT,
+    STMT_ARCHIVE_INCREMENTAL_VACUUM,
+    STMT_SELECT_ENDED_EVENTS,
+    STMT_SELECT_ALL_TASKS_OF_AN_EVENT_HISTORY,
+    STMT_SELECT_PURCHASABLE_ITEMS_BY_COST,
+    STMT_COUNT_TASKS,
+    STMT_SELECT_TASK_COLUMNS,
+    STMT_SELECT_CURRENCY_BY_ID,
+    STMT_SELECT_DATA_VERSION,
+    STMT_COUNT_OWN_CURRENCIES,
+    STMT_SELECT_REWARD_RULES_VERSION,
+    STMT_SELECT_REWARD_RULES,
+    STMT_INSERT_REWARD_LEDGER,
+    STMT_SELECT_AVAILABLE_TASKS_OF_AN_EVENT,
+    STMT_INSERT_TASK_DEPENDENCY,
+    STMT_SELECT_DEPENDENCY_PATH,
+    STMT_DELETE_ARCHIVED_TASK_DEPENDENCIES,
+    STMT_INSERT_CURRENCY_LOT,
+    STMT_SELECT_OLDEST_CURRENCY_LOT,
+    STMT_SELECT_NEXT_LOT_EXPIRIES,
+    STMT_CONSUME_CURRENCY_LOT,
+    STMT_DELETE_CURRENCY_LOT,
+    STMT_DEBIT_LAPSED_LOTS,
+    STMT_DELETE_LAPSED_LOTS,
+    STMT_SELECT_ACHIEVEMENTS_VERSION,
+    STMT_SELECT_ACHIEVEMENTS,
+    STMT_ADD_ACHIEVEMENT_COUNTER,
+    STMT_EXTEND_DAILY_STREAK,
+    STMT_BREAK_DAILY_STREAK,
+    STMT_INSERT_ACHIEVEMENT_UNLOCK,
+    STMT_SELECT_ACHIEVEMENT_PROGRESS,
+    STMT_SELECT_DAILY_STREAK,
+    STMT_DELETE_ARCHIVED_STOCK_HOLDS,
+    STMT_RESERVE_STOCK,
+    STMT_INSERT_STOCK_HOLD,
+    STMT_CLAIM_STOCK_HOLD,
+    STMT_CONFIRM_STOCK,
+    STMT_DELETE_STOCK_HOLD,
+    STMT_RELEASE_STOCK,
+    STMT_RELEASE_LAPSED_HOLDS,
+    STMT_DELETE_LAPSED_HOLDS,
+    STMT_SELECT_NEXT_HOLD_EXPIRY,
+    STMT_COUNT
+};
+
+struct statement {
+    const char *name;
+    const char **sql;
+    unsigned int prepare_flags;
+    sqlite3_stmt *stmt;
+    unsigned long uses;
+};
+
+struct statement statements[STMT_COUNT] = {
+    [STMT_INSERT_CURRENCY] = { "insert_currency", &sql_insert_currency, 0 },
+    [STMT_INSERT_EVENTS] = { "insert_events", &sql_insert_events, 0 },
+    [STMT_INSERT_TASKS] = { "insert_tasks", &sql_insert_tasks, 0 },
+    [STMT_INSERT_STORE] = { "insert_store", &sql_insert_store, 0 },
+    [STMT_SELECT_CURRENCY] = { "select_currency", &sql_select_currency, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_ACTIVE_EVENTS] = { "select_active_events", &sql_select_active_events, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_INCOMPLETE_TASKS_OF_AN_EVENT] = { "select_incomplete_tasks_of_an_event", &sql_select_incomplete_tasks_of_an_event, SQLITE_PREPARE_PERSISTENT },
+    [STMT_UPDATE_TASK_COMPLETION] = { "update_task_completion", &sql_update_task_completion, SQLITE_PREPARE_PERSISTENT },
+    [STMT_UPDATE_BALANCE] = { "update_balance", &sql_update_balance, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_STORE_ITEMS_OF_AN_EVENT] = { "select_store_items_of_an_event", &sql_select_store_items_of_an_event, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_ALL_TASKS_OF_AN_EVENT] = { "select_all_tasks_of_an_event", &sql_select_all_tasks_of_an_event, SQLITE_PREPARE_PERSISTENT },
+    [STMT_UPDATE_EVENT_COMPLETION] = { "update_event_completion", &sql_update_event_completion, SQLITE_PREPARE_PERSISTENT },
+    [STMT_DAILY_MISSIONS] = { "daily_missions", &sql_daily_missions, 0 },
+    [STMT_REINITIALIZE_DAILY_MISSIONS_EVENT] = { "reinitialize_daily_missions_event", &sql_reinitialize_daily_missions_event, 0 },
+    [STMT_REINITIALIZE_DAILY_MISSIONS_TASKS] = { "reinitialize_daily_missions_tasks", &sql_reinitialize_daily_missions_tasks, 0 },
+    [STMT_BEGIN_TRANSACTION] = { "begin_transaction", &sql_begin_transaction, SQLITE_PREPARE_PERSISTENT },
+    [STMT_COMMIT_TRANSACTION] = { "commit_transaction", &sql_commit_transaction, SQLITE_PREPARE_PERSISTENT },
+    [STMT_ROLLBACK_TRANSACTION] = { "rollback_transaction", &sql_rollback_transaction, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_STORE_ITEM_PRICE] = { "select_store_item_price", &sql_select_store_item_price, SQLITE_PREPARE_PERSISTENT },
+    [STMT_DEBIT_BALANCE] = { "debit_balance", &sql_debit_balance, SQLITE_PREPARE_PERSISTENT },
+    [STMT_CLEAR_BULK_TASK_SELECTION] = { "clear_bulk_task_selection", &sql_clear_bulk_task_selection, SQLITE_PREPARE_PERSISTENT },
+    [STMT_INSERT_BULK_TASK_SELECTION] = { "insert_bulk_task_selection", &sql_insert_bulk_task_selection, SQLITE_PREPARE_PERSISTENT },
+    [STMT_COMPLETE_SELECTED_TASKS] = { "complete_selected_tasks", &sql_complete_selected_tasks, SQLITE_PREPARE_PERSISTENT },
+    [STMT_COMPLETE_REMAINING_TASKS_OF_AN_EVENT] = { "complete_remaining_tasks_of_an_event", &sql_complete_remaining_tasks_of_an_event, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_EVENT_CURRENCY] = { "select_event_currency", &sql_select_event_currency, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_APPLIED_OPERATION] = { "select_applied_operation", &sql_select_applied_operation, SQLITE_PREPARE_PERSISTENT },
+    [STMT_INSERT_APPLIED_OPERATION] = { "insert_applied_operation", &sql_insert_applied_operation, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_ALL_OPERATION_IDS] = { "select_all_operation_ids", &sql_select_all_operation_ids, 0 },
+    [STMT_PURGE_EXPIRED_OPERATIONS] = { "purge_expired_operations", &sql_purge_expired_operations, 0 },
+    [STMT_SELECT_EVENT_DEADLINES] = { "select_event_deadlines", &sql_select_event_deadlines, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_EVENT_SCHEDULE] = { "select_event_schedule", &sql_select_event_schedule, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_NEXT_ACTIVATION] = { "select_next_activation", &sql_select_next_activation, SQLITE_PREPARE_PERSISTENT },
+    [STMT_ACTIVATE_DUE_EVENTS] = { "activate_due_events", &sql_activate_due_events, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_PENDING_EVENTS] = { "select_pending_events", &sql_select_pending_events, SQLITE_PREPARE_PERSISTENT },
+    [STMT_ARCHIVE_EVENTS] = { "archive_events", &sql_archive_events, 0 },
+    [STMT_ARCHIVE_TASKS] = { "archive_tasks", &sql_archive_tasks, 0 },
+    [STMT_ARCHIVE_STORE] = { "archive_store", &sql_archive_store, 0 },
+    [STMT_DELETE_ARCHIVED_TASKS] = { "delete_archived_tasks", &sql_delete_archived_tasks, 0 },
+    [STMT_DELETE_ARCHIVED_STORE] = { "delete_archived_store", &sql_delete_archived_store, 0 },
+    [STMT_DELETE_ARCHIVED_EVENTS] = { "delete_archived_events", &sql_delete_archived_events, 0 },
+    [STMT_SELECT_MAIN_PAGE_COUNT] = { "select_main_page_count", &sql_select_main_page_count, 0 },
+    [STMT_SELECT_MAIN_FREELIST_COUNT] = { "select_main_freelist_count", &sql_select_main_freelist_count, 0 },
+    [STMT_MAIN_INCREMENTAL_VACUUM] = { "main_incremental_vacuum", &sql_main_incremental_vacuum, 0 },
+    [STMT_SELECT_ARCHIVE_PAGE_COUNT] = { "select_archive_page_count", &sql_select_archive_page_count, 0 },
+    [STMT_SELECT_ARCHIVE_FREELIST_COUNT] = { "select_archive_freelist_count", &sql_select_archive_freelist_count, 0 },
+    [STMT_ARCHIVE_INCREMENTAL_VACUUM] = { "archive_incremental_vacuum", &sql_archive_incremental_vacuum, 0 },
+    [STMT_SELECT_ENDED_EVENTS] = { "select_ended_events", &sql_select_ended_events, 0 },
+    [STMT_SELECT_ALL_TASKS_OF_AN_EVENT_HISTORY] = { "select_all_tasks_of_an_event_history", &sql_select_all_tasks_of_an_event_history, 0 },
+    [STMT_SELECT_PURCHASABLE_ITEMS_BY_COST] = { "select_purchasable_items_by_cost", &sql_select_purchasable_items_by_cost, SQLITE_PREPARE_PERSISTENT },
+    [STMT_COUNT_TASKS] = { "count_tasks", &sql_count_tasks, 0 },
+    [STMT_SELECT_TASK_COLUMNS] = { "select_task_columns", &sql_select_task_columns, 0 },
+    [STMT_SELECT_CURRENCY_BY_ID] = { "select_currency_by_id", &sql_select_currency_by_id, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_DATA_VERSION] = { "select_data_version", &sql_select_data_version, SQLITE_PREPARE_PERSISTENT },
+    [STMT_COUNT_OWN_CURRENCIES] = { "count_own_currencies", &sql_count_own_currencies, 0 },
+    [STMT_SELECT_REWARD_RULES_VERSION] = { "select_reward_rules_version", &sql_select_reward_rules_version, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_REWARD_RULES] = { "select_reward_rules", &sql_select_reward_rules, 0 },
+    [STMT_INSERT_REWARD_LEDGER] = { "insert_reward_ledger", &sql_insert_reward_ledger, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_AVAILABLE_TASKS_OF_AN_EVENT] = { "select_available_tasks_of_an_event", &sql_select_available_tasks_of_an_event, SQLITE_PREPARE_PERSISTENT },
+    [STMT_INSERT_TASK_DEPENDENCY] = { "insert_task_dependency", &sql_insert_task_dependency, 0 },
+    [STMT_SELECT_DEPENDENCY_PATH] = { "select_dependency_path", &sql_select_dependency_path, 0 },
+    [STMT_DELETE_ARCHIVED_TASK_DEPENDENCIES] = { "delete_archived_task_dependencies", &sql_delete_archived_task_dependencies, 0 },
+    [STMT_INSERT_CURRENCY_LOT] = { "insert_currency_lot", &sql_insert_currency_lot, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_OLDEST_CURRENCY_LOT] = { "select_oldest_currency_lot", &sql_select_oldest_currency_lot, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_NEXT_LOT_EXPIRIES] = { "select_next_lot_expiries", &sql_select_next_lot_expiries, 0 },
+    [STMT_CONSUME_CURRENCY_LOT] = { "consume_currency_lot", &sql_consume_currency_lot, SQLITE_PREPARE_PERSISTENT },
+    [STMT_DELETE_CURRENCY_LOT] = { "delete_currency_lot", &sql_delete_currency_lot, SQLITE_PREPARE_PERSISTENT },
+    [STMT_DEBIT_LAPSED_LOTS] = { "debit_lapsed_lots", &sql_debit_lapsed_lots, 0 },
+    [STMT_DELETE_LAPSED_LOTS] = { "delete_lapsed_lots", &sql_delete_lapsed_lots, 0 },
+    [STMT_SELECT_ACHIEVEMENTS_VERSION] = { "select_achievements_version", &sql_select_achievements_version, SQLITE_PREPARE_PERSISTENT },
+    [STMT_SELECT_ACHIEVEMENTS] = { "select_achievements", &sql_select_achievements, 0 },
+    [STMT_ADD_ACHIEVEMENT_COUNTER] = { "add_achievement_counter", &sql_add_achievement_counter, SQLITE_PREPARE_PERSISTENT },
+    [STMT_EXTEND_DAILY_STREAK] = { "extend_daily_streak", &sql_extend_daily_streak, 0 },
+    [STMT_BREAK_DAILY_STREAK] = { "break_daily_streak", &sql_break_daily_streak, 0 },
+    [STMT_INSERT_ACHIEVEMENT_UNLOCK] = { "insert_achievement_unlock", &sql_insert_achievement_unlock, 0 },
+    [STMT_SELECT_ACHIEVEMENT_PROGRESS] = { "select_achievement_progress", &sql_select_achievement_progress, 0 },
+    [STMT_SELECT_DAILY_STREAK] = { "select_daily_streak", &sql_select_daily_streak, 0 },
+    [STMT_DELETE_ARCHIVED_STOCK_HOLDS] = { "delete_archived_stock_holds", &sql_delete_archived_stock_holds, 0 },
+    [STMT_RESERVE_STOCK] = { "reserve_stock", &sql_reserve_stock, SQLITE_PREPARE_PERSISTENT },
+    [STMT_INSERT_STOCK_HOLD] = { "insert_stock_hold", &sql_insert_stock_hold, SQLITE_PREPARE_PERSISTENT },
+    [STMT_CLAIM_STOCK_HOLD] = { "claim_stock_hold", &sql_claim_stock_hold, SQLITE_PREPARE_PERSISTENT },
+    [STMT_CONFIRM_STOCK] = { "confirm_stock", &sql_confirm_stock, SQLITE_PREPARE_PERSISTENT },
+    [STMT_DELETE_STOCK_HOLD] = { "delete_stock_hold", &sql_delete_stock_hold, 0 },
+    [STMT_RELEASE_STOCK] = { "release_stock", &sql_release_stock, 0 },
+    [STMT_RELEASE_LAPSED_HOLDS] = { "release_lapsed_holds", &sql_release_lapsed_holds, 0 },
+    [STMT_DELETE_LAPSED_HOLDS] = { "delete_lapsed_holds", &sql_delete_lapsed_holds, 0 },
+    [STMT_SELECT_NEXT_HOLD_EXPIRY] = { "select_next_hold_expiry", &sql_select_next_hold_expiry, 0 },
+};
+
+// Currency sharding (--shards=N): every currency, with its events, tasks and
+// store items, lives in one of N shard files written through its own
+// connection, so writes to different shards take different locks. Shard k
+// hands out currency and event IDs k+1, k+1+N, k+1+2N, ..., which makes
+// routing a modulo. The main connection attaches the shards and reads them
+// through TEMP views that shadow the sharded tables.
+#define MAX_SHARDS 8
+
+const char *sharded_tables[] = { "currency", "events", "tasks", "store", "applied_operations", "reward_ledger", "task_dependencies", "currency_lots", "achievement_counters", "achievement_unlocks", "stock_holds" };
+
+struct shard {
+    sqlite3 *db;
+    struct statement statements[STMT_COUNT];
+};
+
+struct shard shards[MAX_SHARDS];
+int shard_count;
+
+// Reward rules compiled into a decision table: each row holds the conditions it
+// tests as a bit mask and its operands as integers, in application order.
+// reward_rules_load rebuilds it only when reward_rules_version moves.
+enum reward_rule_kind { REWARD_RULE_MULTIPLY, REWARD_RULE_BONUS };
+
+#define REWARD_MATCH_EVENT 0x01
+#define REWARD_MATCH_CURRENCY 0x02
+#define REWARD_MATCH_WEEKDAYS 0x04
+#define REWARD_MATCH_START 0x08
+#define REWARD_MATCH_END 0x10
+#define REWARD_MATCH_STREAK 0x20
+
+struct reward_rule {
+    int rule_id;
+    unsigned char kind;
+    unsigned char match;
+    unsigned char weekdays;
+    int value;
+    int event_id;
+    int currency_id;
+    int min_streak;
+    time_t start_time;
+    time_t end_time;
+};
+
+struct reward_rules {
+    struct reward_rule *rules;
+    int count;
+    int version;
+    int is_compiled;
+    int needs_streak;
+};
+
+struct reward_rules reward_rules;
+
+// What a completion is matched against. Fixed for a whole operation, so
+// retries and bulk completions see the same time and streak.
+struct reward_context {
+    int event_id;
+    int task_id;
+    int currency_id;
+    time_t now;
+    int weekday;
+    int day;
+    int streak;
+};
+
+// Achievements compiled for unlock checks, sorted by (metric, currency,
+// threshold) with first[m] the start of metric m's run; any-currency entries
+// lead each run. A counter update only walks those and its own currency up to
+// the new value, so its cost does not grow with history. Unlocks written by a
+// transaction wait in pending until it commits.
+enum achievement_metric { METRIC_TASKS_COMPLETED, METRIC_EARNED, METRIC_SPENT, METRIC_ITEMS_BOUGHT, METRIC_DAILY_STREAK, METRIC_COUNT };
+
+const char *achievement_metrics[METRIC_COUNT] = { "tasks_completed", "earned", "spent", "items_bought", "daily_streak" };
+
+// Sorts before every real currency ID within a metric's run
+#define ACHIEVEMENT_ANY_CURRENCY -1
+
+struct achievement {
+    int achievement_id;
+    int currency_id;
+    sqlite3_int64 threshold;
+    char name[64];
+    unsigned char metric;
+    unsigned char is_unlocked;
+};
+
+struct achievements {
+    struct achievement *items;
+    int count;
+    int first[METRIC_COUNT + 1];
+    int version;
+    int is_compiled;
+    int *pending;
+    int pending_count;
+    int pending_capacity;
+    int pending_unlisted;
+};
+
+struct achievements achievements;
+
+// Affordability index: per active event, its in-stock store items sorted by cost,
+// alongside the cached balance of every currency. An event's affordable items are
+// the prefix of its array with cost <= balance, so balance changes only update a
+// cached number and never trigger a reload.
+struct afford_event {
+    int event_id;
+    int currency_id;
+    struct store_item *items;
+    int item_count;
+};
+
+struct affordability_index {
+    int is_loaded;
+    int data_version;
+    struct afford_event *events;
+    int event_count;
+    struct currency *currencies;
+    int currency_count;
+};
+
+struct affordability_index afford_index;
+
+// Columnar task index, loaded on first use. Tasks are sorted by (event_id,
+// task_id) so each event owns a contiguous range, and aggregates over a range
+// stream through the amount and completion columns only. Completion is one
+// byte per task rather than a packed bit so the kernels stay branch-free.
+struct task_index {
+    int is_loaded;
+    int data_version;
+    int task_count;
+    int *event_ids;
+    int *task_ids;
+    int *currency_amounts;
+    uint8_t *completed;
+    uint32_t *description_offsets;
+    char *descriptions;
+
+    // Event e covers tasks [range_starts[e], range_starts[e + 1])
+    int range_count;
+    int *range_event_ids;
+    int *range_starts;
+};
+
+struct task_index task_idx;
+
+struct task_totals {
+    int task_count;
+    int completed_count;
+    sqlite3_int64 total_reward;
+    sqlite3_int64 earned_reward;
+};
+
+// Min-heap of upcoming event start and end times and stock hold expiries.
+// Entries are never removed when an event or hold changes; a popped entry that
+// no longer matches the database is simply dropped.
+struct deadline {
+    time_t when;
+    int event_id;
+    int kind;
+};
+
+struct deadline_heap {
+    struct deadline *entries;
+    int count;
+    int capacity;
+};
+
+struct deadline_heap deadlines;
+int scheduler_timer_fd = -1;
+
+// Start time of the activation entry in the heap, 0 if none. Only the next
+// pending event is ever scheduled; the rest wait in idx_events_pending_start.
+time_t scheduled_activation;
+
+// Likewise the earliest stock hold expiry, the rest wait in idx_stock_holds_expiry
+time_t scheduled_hold_expiry;
+
+// Bloom filter over applied operation IDs, loaded on first use. A miss proves an
+// ID is new and skips the dedup lookup; a hit falls back to the indexed table.
+unsigned char operation_bloom[OPERATION_BLOOM_BITS / 8];
+int operation_bloom_loaded;
+time_t last_operation_purge;
+time_t last_archive_run;
+time_t last_lot_expiry;
+
+// In-memory mode: the working database lives in memory_db and is copied to
+// disk_db by memory_checkpoint. Both are NULL when running from disk.
+sqlite3 *memory_db;
+sqlite3 *disk_db;
+int memory_checkpoint_interval = MEMORY_CHECKPOINT_INTERVAL;
+time_t last_memory_checkpoint;
+int checkpointed_changes;
+
+// Statement journal for --sync-journal: the write statements of each
+// transaction are appended and fsync'd before the in-memory commit completes.
+int journal_fd = -1;
+char *journal_buffer;
+size_t journal_length;
+size_t journal_capacity;
+int journal_paused;
+
+// Change feed: row changes reported by the update hook are buffered until the
+// transaction ends and published to the subscribers only if it commits. Only
+// the tables of the main database that caches depend on are tracked.
+enum change_table { CHANGE_CURRENCY, CHANGE_EVENTS, CHANGE_TASKS, CHANGE_STORE, CHANGE_TABLE_COUNT };
+
+const char *change_table_names[CHANGE_TABLE_COUNT] = { "currency", "events", "tasks", "store" };
+
+struct row_change {
+    int op;
+    int table;
+    sqlite3_int64 rowid;
+};
+
+typedef void (*change_subscriber)(const struct row_change *changes, int count);
+
+#define CHANGE_MAX_SUBSCRIBERS 8
+
+struct change_feed {
+    struct row_change *changes;
+    int count;
+    int capacity;
+    int overflowed;
+    change_subscriber subscribers[CHANGE_MAX_SUBSCRIBERS];
+    int subscriber_count;
+    unsigned long long sequence;
+    unsigned long long published_changes;
+    unsigned long long dropped;
+
+    // Local consumers read committed changes from a FIFO; see change_feed_write
+    const char *fifo_path;
+    int fifo_fd;
+    char *line_buffer;
+    size_t line_capacity;
+};
+
+struct change_feed change_feed = { .fifo_fd = -1 };
+
+// Currencies as last read. Rows this connection changes are re-read one by
+// one; a commit by another connection reloads them all.
+struct currency_cache {
+    int is_loaded;
+    int needs_reload;
+    int data_version;
+    struct currency *currencies;
+    char *is_stale;
+    int currency_count;
+};
+
+struct currency_cache currency_cache;
+
+// Balance view: balances and active-event progress published to a shared file
+// for other local processes, guarded by a seqlock. The sequence is odd while a
+// snapshot is being written; readers copy the snapshot and retry if the
+// sequence was odd or moved meanwhile. The seqlock allows one writer, so the
+// publishing process holds an exclusive flock on the file and any other
+// instance on the same database leaves the view alone.
+#define BALANCE_VIEW_MAGIC 0x56425352
+#define BALANCE_VIEW_MAX_CURRENCIES 64
+#define BALANCE_VIEW_MAX_EVENTS 128
+#define BALANCE_VIEW_READ_ATTEMPTS 1000
+
+struct balance_view_currency {
+    int32_t currency_id;
+    int32_t balance;
+    char currency_name[50];
+    char symbol[10];
+};
+
+struct balance_view_event {
+    int32_t event_id;
+    int32_t currency_id;
+    int64_t end_time;
+    int32_t task_count;
+    int32_t completed_count;
+    char event_name[100];
+};
+
+struct balance_snapshot {
+    uint64_t version;
+    int64_t published_at;
+    int32_t currency_count;
+    int32_t event_count;
+    // Rows past the limits above, left out of the snapshot
+    int32_t currencies_omitted;
+    int32_t events_omitted;
+    struct balance_view_currency currencies[BALANCE_VIEW_MAX_CURRENCIES];
+    struct balance_view_event events[BALANCE_VIEW_MAX_EVENTS];
+};
+
+struct balance_view {
+    uint32_t magic;
+    uint32_t size;
+    int32_t owner_pid;
+    _Atomic uint64_t sequence;
+    struct balance_snapshot snapshot;
+};
+
+const char *balance_view_file = "reward_system.db-balances";
+struct balance_view *balance_view;
+int balance_view_fd = -1;
+int balance_view_dirty = 1;
+int balance_view_data_version;
+
+struct contention_stats {
+    unsigned long busy_events;
+    unsigned long busy_sleeps;
+    unsigned long busy_wait_ms;
+    unsigned long busy_timeouts;
+    unsigned long retries;
+    unsigned long retries_exhausted;
+};
+
+struct contention_stats contention;
+int busy_timeout_ms = BUSY_TIMEOUT_MS;
+
+int shutdown_pipe[2] = { -1, -1 };
+volatile sig_atomic_t shutdown_requested;
+
+// Timestamp rendering, set with --utc and --timestamps=
+enum timestamp_zone { TIMESTAMP_LOCAL, TIMESTAMP_UTC };
+enum timestamp_style { TIMESTAMP_DISPLAY, TIMESTAMP_ISO8601, TIMESTAMP_EPOCH };
+
+enum timestamp_zone timestamp_zone = TIMESTAMP_LOCAL;
+enum timestamp_style timestamp_style = TIMESTAMP_DISPLAY;
+
+// Fits "YYYY-MM-DDThh:mm:ss+hh:mm"
+#define TIMESTAMP_SIZE 32
 
-    exit(0);
+// Listings in a machine-readable format, set with --format=. Rows are written
+// field by field straight into one reusable buffer that is flushed to stdout
+// whenever it fills, so an export runs in constant memory.
+enum output_format { OUTPUT_TABLE, OUTPUT_JSON, OUTPUT_NDJSON, OUTPUT_TSV };
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+struct output_writer {
+    enum output_format format;
+    char buffer[OUTPUT_BUFFER_SIZE];
+    size_t length;
+    const char *table;
+    const char *const *columns;
+    int rows;
+    int fields;
+};
+
+struct output_writer output = { OUTPUT_TABLE };
+
+// The calendar days last formatted in each zone, per thread. Listings format
+// an event's start and end back to back, so one day per zone is not enough;
+// slots are reused round robin.
+#define TIMESTAMP_CACHED_DAYS 4
+
+struct timestamp_day {
+    int is_valid;
+    time_t start;
+    time_t end;
+    char date[24];
+    char offset[16];
+};
+
+_Thread_local struct timestamp_day timestamp_days[2][TIMESTAMP_CACHED_DAYS];
+_Thread_local int timestamp_next_day[2];
+
+// Signals only record the request and wake poll() through the self-pipe; the
+// menu loop then finishes the current operation and shuts down normally. A
+// second signal, or a drain longer than SHUTDOWN_DRAIN_SECONDS, exits at once
+// and leaves recovery of any open transaction to SQLite's journal.
+void handle_shutdown_signal(int sig) {
+    if (shutdown_requested) _exit(128 + sig);
+    shutdown_requested = sig;
+
+    int saved_errno = errno;
+    const char *msg = "\nShutting down...\n";
+    write(STDERR_FILENO, msg, strlen(msg));
+    write(shutdown_pipe[1], "x", 1);
+    alarm(SHUTDOWN_DRAIN_SECONDS);
+    errno = saved_errno;
+}
+
+void handle_drain_timeout(int sig) {
+    const char *msg = "Shutdown deadline exceeded, exiting without a clean close.\n";
+    write(STDERR_FILENO, msg, strlen(msg));
+    _exit(1);
 }
 
+// Stops early once a shutdown signal interrupted the read, rather than block
+// in read() again until the drain deadline
 void flush_input_buffer() {
     int c;
-    while ((c = getchar()) != '\n' && c != EOF);
+    while (!shutdown_requested && !ferror(stdin) && (c = getchar()) != '\n' && c != EOF);
+}
+
+// Reads a number answered at a prompt and discards the rest of its line.
+// Returns 1 if a number was read, 0 if the line held none, and -1 if input
+// ended or a shutdown signal interrupted the prompt, in which case the caller
+// abandons its operation.
+int read_int(int *value) {
+    int rc = scanf("%d", value);
+    if (rc == EOF || shutdown_requested) return -1;
+    flush_input_buffer();
+    if (ferror(stdin) || shutdown_requested) return -1;
+    return rc;
+}
+
+// Reads a line answered at a prompt, without its newline. Returns 0, or -1
+// like read_int.
+int read_line(char *line, int size) {
+    if (!fgets(line, size, stdin) || shutdown_requested) return -1;
+    line[strcspn(line, "\n")] = 0;
+    return 0;
 }
 
 // Function prototypes
 int file_exists(const char *filename);
 void create_tables(sqlite3 *db);
-int prepare_statements(sqlite3 *db);
+int attach_archive(sqlite3 *db, const char *archive_file);
+int shutdown_init(void);
+int step_transaction_statement(sqlite3 *db, sqlite3_stmt *stmt);
+int copy_database(sqlite3 *dest, sqlite3 *src);
+int memory_load(sqlite3 **db);
+int select_checkpoint_generation(sqlite3 *db);
+int memory_checkpoint(sqlite3 *db);
+void memory_checkpoint_if_due(sqlite3 *db);
+int journal_open(sqlite3 *db, const char *journal_file);
+int journal_replay(sqlite3 *db, const char *journal_file);
+void journal_close(void);
+int update_schema(sqlite3 *db);
+int enable_incremental_vacuum(sqlite3 *db, const char *schema);
+int select_pragma_int(sqlite3_stmt *stmt);
+int vacuum_step(sqlite3 *db, int with_archive);
+double leaf_fragmentation(sqlite3 *db, const char *schema);
+void print_storage_stats(sqlite3 *db);
+sqlite3_stmt *statement(sqlite3 *db, int id);
+void statements_finalize(void);
+void print_statement_stats(void);
+void print_change_feed_stats(void);
+void print_contention_stats(void);
+void contention_init(sqlite3 *db);
 void initialize_daily_missions(sqlite3 *db);
 void display_menu();
 void handle_inactive_or_complete_events(sqlite3 *db);
 void add_event(sqlite3 *db);
 void mark_task_done(sqlite3 *db);
+void mark_tasks_done_in_bulk(sqlite3 *db);
 void buy_item(sqlite3 *db);
 void list_events_and_tasks(sqlite3 *db);
 void list_stats(sqlite3 *db);
-
-int main() {
+void list_affordable_items(sqlite3 *db);
+void purge_expired_operations(sqlite3 *db);
+void archive_inactive_events(sqlite3 *db);
+void expire_currency_lots(sqlite3 *db);
+void expire_stock_holds(sqlite3 *db);
+void archive_events_of(sqlite3 *db, time_t now);
+void list_event_history(sqlite3 *db);
+int scheduler_init(sqlite3 *db);
+void scheduler_add_event(int event_id, time_t start_time, time_t end_time);
+void scheduler_add_hold(time_t expires_at);
+int scheduler_schedule_next_hold_expiry(sqlite3 *db);
+void scheduler_run_due(sqlite3 *db);
+void scheduler_shutdown();
+void wait_for_input(sqlite3 *db);
+void affordability_invalidate();
+void task_index_invalidate();
+void task_index_set_completed(int event_id, int task_id);
+void print_task_progress(sqlite3 *db);
+void affordability_set_balance(int currency_id, int balance);
+void affordability_set_stock(int event_id, int item_id, int stock);
+int change_feed_init(sqlite3 *db, const char *fifo_path);
+void change_feed_attach(sqlite3 *db);
+int shards_open(sqlite3 *db, const char *db_file, const char *archive_file, int requested);
+void shards_close(void);
+sqlite3 *shard_for_id(sqlite3 *db, int id);
+int writer_count(void);
+sqlite3 *writer(sqlite3 *db, int i);
+void bind_id_sequence(sqlite3 *db, sqlite3_stmt *stmt, int start_param);
+void change_feed_close(void);
+void currency_cache_on_changes(const struct row_change *changes, int count);
+void currency_cache_invalidate(void);
+void reward_rules_free(void);
+void achievements_free(void);
+void affordability_on_changes(const struct row_change *changes, int count);
+void task_index_on_changes(const struct row_change *changes, int count);
+int balance_view_open(const char *path);
+void balance_view_on_changes(const struct row_change *changes, int count);
+void balance_view_update(sqlite3 *db);
+void balance_view_close(void);
+int balance_view_show(const char *path);
+
+int main(int argc, char *argv[]) {
     sqlite3 *db;
     int rc;
     const char* db_file = "reward_system.db";
+    const char* archive_file = "reward_system_archive.db";
+    const char* journal_file = "reward_system.db-journal.sql";
+    int in_memory = 0;
+    int sync_journal = 0;
+    const char *change_feed_fifo = NULL;
+    int show_balances = 0;
+    int requested_shards = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--in-memory") == 0) {
+            in_memory = 1;
+        } else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0) {
+            memory_checkpoint_interval = atoi(argv[i] + 22);
+            if (memory_checkpoint_interval <= 0) memory_checkpoint_interval = MEMORY_CHECKPOINT_INTERVAL;
+        } else if (strcmp(argv[i], "--sync-journal") == 0) {
+            sync_journal = 1;
+        } else if (strcmp(argv[i], "--utc") == 0) {
+            timestamp_zone = TIMESTAMP_UTC;
+        } else if (strcmp(argv[i], "--timestamps=iso8601") == 0) {
+            timestamp_style = TIMESTAMP_ISO8601;
+        } else if (strcmp(argv[i], "--timestamps=epoch") == 0) {
+            timestamp_style = TIMESTAMP_EPOCH;
+        } else if (strcmp(argv[i], "--timestamps=display") == 0) {
+            timestamp_style = TIMESTAMP_DISPLAY;
+        } else if (strncmp(argv[i], "--change-feed=", 14) == 0 && argv[i][14]) {
+            change_feed_fifo = argv[i] + 14;
+        } else if (strncmp(argv[i], "--busy-timeout=", 15) == 0) {
+            busy_timeout_ms = atoi(argv[i] + 15);
+            if (busy_timeout_ms < 0) busy_timeout_ms = BUSY_TIMEOUT_MS;
+        } else if (strcmp(argv[i], "--format=table") == 0) {
+            output.format = OUTPUT_TABLE;
+        } else if (strcmp(argv[i], "--format=json") == 0) {
+            output.format = OUTPUT_JSON;
+        } else if (strcmp(argv[i], "--format=ndjson") == 0) {
+            output.format = OUTPUT_NDJSON;
+        } else if (strcmp(argv[i], "--format=tsv") == 0) {
+            output.format = OUTPUT_TSV;
+        } else if (strcmp(argv[i], "--show-balances") == 0) {
+            show_balances = 1;
+        } else if (strncmp(argv[i], "--shards=", 9) == 0) {
+            requested_shards = atoi(argv[i] + 9);
+            if (requested_shards < 2 || requested_shards > MAX_SHARDS) {
+                fprintf(stderr, "The number of shards must be between 2 and %d.\n", MAX_SHARDS);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--in-memory [--checkpoint-interval=SECONDS] [--sync-journal]] [--utc] [--timestamps=display|iso8601|epoch] [--format=table|json|ndjson|tsv] [--change-feed=FIFO] [--busy-timeout=MS] [--show-balances] [--shards=N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Checkpoints copy the main file only
+    if (in_memory && requested_shards) {
+        fprintf(stderr, "--shards cannot be combined with --in-memory.\n");
+        return 1;
+    }
+
+    // Only the in-memory database has commits the journal would need to replay
+    if (sync_journal && !in_memory) {
+        fprintf(stderr, "--sync-journal requires --in-memory.\n");
+        return 1;
+    }
+
+    if (show_balances) return balance_view_show(balance_view_file);
 
     if (!file_exists(db_file)) {
         printf("Configuration data does not exist...\n");
@@ -175,32 +1144,87 @@ int main() {
         
     }
 
-    // Prepare all statements
-    rc = prepare_statements(db);
+    // Before memory_load, so it also covers the disk connection checkpoints write to
+    contention_init(db);
+
+    if (in_memory && memory_load(&db) != SQLITE_OK) {
+        fprintf(stderr, "Failed to load database into memory. Exiting...\n");
+        sqlite3_close(db);
+        return 1;
+    }
+
+    rc = attach_archive(db, archive_file);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statements. Exiting...\n");
+        fprintf(stderr, "Failed to attach archive database. Exiting...\n");
         sqlite3_close(db);
         return 1;
     }
 
-    // Signal handler for Ctrl + C - SIGINT
-    struct sigaction sa;
-    sa.sa_sigaction = handle_sigint;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_SIGINFO;
+    if (enable_incremental_vacuum(db, "main") != SQLITE_OK || enable_incremental_vacuum(db, "archive") != SQLITE_OK) {
+        fprintf(stderr, "Failed to enable incremental vacuum. Exiting...\n");
+        sqlite3_close(db);
+        return 1;
+    }
+
+    rc = update_schema(db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to update schema. Exiting...\n");
+        sqlite3_close(db);
+        return 1;
+    }
 
-    union sigval value;
-    value.sival_ptr = db;
-    sigaction(SIGINT, &sa, NULL);
+    if (!in_memory && shards_open(db, db_file, archive_file, requested_shards) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open the shards. Exiting...\n");
+        shards_close();
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (in_memory && sync_journal && journal_open(db, journal_file) != 0) {
+        fprintf(stderr, "Failed to open statement journal. Exiting...\n");
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (change_feed_init(db, change_feed_fifo) != 0) {
+        fprintf(stderr, "Failed to set up the change feed. Exiting...\n");
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (shutdown_init() != 0) {
+        fprintf(stderr, "Failed to install signal handlers. Exiting...\n");
+        sqlite3_close(db);
+        return 1;
+    }
+
+    initialize_daily_missions(shard_for_id(db, 1));
 
-    initialize_daily_missions(db);
+    if (balance_view_open(balance_view_file) == -1) {
+        fprintf(stderr, "Balance view unavailable, other processes have to read the database.\n");
+    }
+
+    // Unbuffered stdin keeps poll() on the descriptor in sync with what scanf
+    // has not consumed yet, so the scheduler can wait on both.
+    setvbuf(stdin, NULL, _IONBF, 0);
+    if (scheduler_init(db) != 0) {
+        fprintf(stderr, "Event scheduler unavailable, expiry is only checked between menu choices.\n");
+    }
 
     int choice;
     do {
+        scheduler_run_due(db);
         handle_inactive_or_complete_events(db);
+        purge_expired_operations(db);
+        expire_currency_lots(db);
+        archive_inactive_events(db);
+        memory_checkpoint_if_due(db);
+        balance_view_update(db);
         display_menu();
-        scanf("%d", &choice);
-        flush_input_buffer(); 
+        wait_for_input(db);
+        if (shutdown_requested) break;
+        choice = 0;
+        if (read_int(&choice) == -1) break;
 
         switch (choice) {
             case 1:
@@ -219,44 +1243,81 @@ int main() {
                 list_stats(db);
                 break;
             case 6:
+                list_affordable_items(db);
+                break;
+            case 7:
+                mark_tasks_done_in_bulk(db);
+                break;
+            case 8:
+                list_event_history(db);
+                break;
+            case 9:
                 printf("Exiting...\n");
                 break;
             default:
                 printf("Invalid choice. Please try again.\n");
         }
-    } while (choice != 6);
-
-    // Finalize all statements
-    sqlite3_finalize(stmt_insert_currency);
-    sqlite3_finalize(stmt_insert_events);
-    sqlite3_finalize(stmt_insert_tasks);
-    sqlite3_finalize(stmt_insert_store);
-
-    sqlite3_finalize(stmt_select_currency);
-    sqlite3_finalize(stmt_select_active_events);
-    sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-    sqlite3_finalize(stmt_update_task_completion);
-    sqlite3_finalize(stmt_update_balance);
-    sqlite3_finalize(stmt_select_store_items_of_an_event);
-    sqlite3_finalize(stmt_update_store_stock);
-    sqlite3_finalize(stmt_select_all_tasks_of_an_event);
-    sqlite3_finalize(stmt_update_event_completion);
-    sqlite3_finalize(stmt_daily_missions);
-    sqlite3_finalize(stmt_reinitialize_daily_missions_event);
-    sqlite3_finalize(stmt_reinitialize_daily_missions_tasks);
-
-    sqlite3_close(db);
-    return 0;
-}
+    } while (choice != 9 && !shutdown_requested);
 
-int file_exists(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file) {
-        fclose(file);
-        return 1;
-    }
-    return 0;
-}
+    affordability_invalidate();
+    task_index_invalidate();
+    currency_cache_invalidate();
+    reward_rules_free();
+    achievements_free();
+    scheduler_shutdown();
+
+    // Operations never wait for input inside a transaction, but roll back
+    // anything a failed operation may have left open before persisting
+    if (!sqlite3_get_autocommit(db)) step_transaction_statement(db, statement(db, STMT_ROLLBACK_TRANSACTION));
+    memory_checkpoint(db);
+    sqlite3_wal_checkpoint_v2(disk_db ? disk_db : db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+
+    statements_finalize();
+    shards_close();
+
+    rc = sqlite3_close(db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to close database: %s\n", sqlite3_errmsg(db));
+    }
+    journal_close();
+    change_feed_close();
+    balance_view_close();
+    if (disk_db) sqlite3_close(disk_db);
+
+    if (shutdown_requested) printf("Database connection closed.\n");
+    return rc == SQLITE_OK ? 0 : 1;
+}
+
+int shutdown_init(void) {
+    if (pipe(shutdown_pipe) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(shutdown_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(shutdown_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // No SA_RESTART: a prompt blocked in read() returns early so the current
+    // operation can wind down instead of waiting for more input
+    struct sigaction sa;
+    sa.sa_handler = handle_shutdown_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGINT, &sa, NULL) != 0 || sigaction(SIGTERM, &sa, NULL) != 0) return -1;
+
+    sa.sa_handler = handle_drain_timeout;
+    return sigaction(SIGALRM, &sa, NULL);
+}
+
+int file_exists(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file) {
+        fclose(file);
+        return 1;
+    }
+    return 0;
+}
 
 void create_tables(sqlite3 *db) {
     char *err_msg = 0;
@@ -303,8 +1364,16 @@ void create_tables(sqlite3 *db) {
         ");"
     };
 
+    // Must be set before the first table exists to take effect without a VACUUM
+    int rc = sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;", 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to enable incremental vacuum: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+
     // Enable foreign key constraints
-    int rc = sqlite3_exec(db, "PRAGMA foreign_keys = ON;", 0, 0, &err_msg);
+    rc = sqlite3_exec(db, "PRAGMA foreign_keys = ON;", 0, 0, &err_msg);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "Failed to enable foreign keys: %s\n", err_msg);
         sqlite3_free(err_msg);
@@ -323,1428 +1392,5452 @@ void create_tables(sqlite3 *db) {
     printf("Tables created successfully.\n");
 }
 
-int prepare_statements(sqlite3 *db) {
-    int rc;
-
-    rc = sqlite3_prepare_v2(db, sql_insert_currency, -1, &stmt_insert_currency, NULL);
+// Ended events, with their tasks and store items, are moved into a separate
+// database so the hot tables only hold live data.
+int attach_archive(sqlite3 *db, const char *archive_file) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "ATTACH DATABASE ? AS archive;", -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
         return rc;
     }
 
-    rc = sqlite3_prepare_v2(db, sql_insert_events, -1, &stmt_insert_events, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
+    sqlite3_bind_text(stmt, 1, archive_file, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Cannot attach %s: %s\n", archive_file, sqlite3_errmsg(db));
         return rc;
     }
 
-    rc = sqlite3_prepare_v2(db, sql_insert_tasks, -1, &stmt_insert_tasks, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        return rc;
-    }
+    return SQLITE_OK;
+}
 
-    rc = sqlite3_prepare_v2(db, sql_insert_store, -1, &stmt_insert_store, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        return rc;
+// Copies the whole of one database into another. Memory to memory and memory
+// to disk copies are fast enough to run in a single step.
+int copy_database(sqlite3 *dest, sqlite3 *src) {
+    sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+    if (!backup) {
+        fprintf(stderr, "Failed to start backup: %s\n", sqlite3_errmsg(dest));
+        return SQLITE_ERROR;
     }
 
-    rc = sqlite3_prepare_v2(db, sql_select_currency, -1, &stmt_select_currency, NULL);
+    sqlite3_backup_step(backup, -1);
+    int rc = sqlite3_backup_finish(backup);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        return rc;
+        fprintf(stderr, "Backup failed: %s\n", sqlite3_errmsg(dest));
     }
 
-    rc = sqlite3_prepare_v2(db, sql_select_active_events, -1, &stmt_select_active_events, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        return rc;
-    }
+    return rc;
+}
 
-    rc = sqlite3_prepare_v2(db, sql_select_incomplete_tasks_of_an_event, -1, &stmt_select_incomplete_tasks_of_an_event, NULL);
+// Replaces *db with an in-memory copy of it. The file stays open as disk_db
+// and is only written by memory_checkpoint.
+int memory_load(sqlite3 **db) {
+    sqlite3 *mem;
+    int rc = sqlite3_open(":memory:", &mem);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
+        fprintf(stderr, "Cannot open in-memory database: %s\n", sqlite3_errmsg(mem));
+        sqlite3_close(mem);
         return rc;
     }
 
-    rc = sqlite3_prepare_v2(db, sql_update_task_completion, -1, &stmt_update_task_completion, NULL);
+    rc = copy_database(mem, *db);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
+        sqlite3_close(mem);
         return rc;
     }
 
-    rc = sqlite3_prepare_v2(db, sql_update_balance, -1, &stmt_update_balance, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        return rc;
-    }
+    sqlite3_exec(mem, "PRAGMA foreign_keys = ON;", 0, 0, NULL);
 
-    rc = sqlite3_prepare_v2(db, sql_select_store_items_of_an_event, -1, &stmt_select_store_items_of_an_event, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        return rc;
-    }
+    disk_db = *db;
+    memory_db = mem;
+    *db = mem;
+    last_memory_checkpoint = time(NULL);
 
-    rc = sqlite3_prepare_v2(db, sql_update_store_stock, -1, &stmt_update_store_stock, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        sqlite3_finalize(stmt_select_store_items_of_an_event);
-        return rc;
-    }
+    printf("Running from memory, checkpointing to disk every %d seconds.\n", memory_checkpoint_interval);
+    return SQLITE_OK;
+}
 
-    rc = sqlite3_prepare_v2(db, sql_select_all_tasks_of_an_event, -1, &stmt_select_all_tasks_of_an_event, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        sqlite3_finalize(stmt_select_store_items_of_an_event);
-        sqlite3_finalize(stmt_update_store_stock);
-        return rc;
-    }
+int select_checkpoint_generation(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT generation FROM main.memory_checkpoint WHERE id = 1;", -1, &stmt, NULL) != SQLITE_OK) return -1;
 
-    rc = sqlite3_prepare_v2(db, sql_update_event_completion, -1, &stmt_update_event_completion, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        sqlite3_finalize(stmt_select_store_items_of_an_event);
-        sqlite3_finalize(stmt_update_store_stock);
-        sqlite3_finalize(stmt_select_all_tasks_of_an_event);
-        return rc;
-    }
+    int generation = select_pragma_int(stmt);
+    sqlite3_finalize(stmt);
+    return generation;
+}
 
-    rc = sqlite3_prepare_v2(db, sql_daily_missions, -1, &stmt_daily_missions, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        sqlite3_finalize(stmt_select_store_items_of_an_event);
-        sqlite3_finalize(stmt_update_store_stock);
-        sqlite3_finalize(stmt_select_all_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_event_completion);
-        return rc;
-    }
+// Starts a fresh journal for the given checkpoint generation.
+int journal_reset(int generation) {
+    char header[64];
+    int length = snprintf(header, sizeof(header), "-- generation %d\n", generation);
 
-    rc = sqlite3_prepare_v2(db, sql_reinitialize_daily_missions_event, -1, &stmt_reinitialize_daily_missions_event, NULL);
+    if (ftruncate(journal_fd, 0) != 0) return -1;
+    if (pwrite(journal_fd, header, length, 0) != length) return -1;
+    if (lseek(journal_fd, 0, SEEK_END) == -1) return -1;
+    return fdatasync(journal_fd);
+}
+
+// Writes the in-memory database to disk. Without --sync-journal, anything
+// committed since the previous checkpoint (at most memory_checkpoint_interval
+// seconds of work) is lost if the process dies without reaching this.
+int memory_checkpoint(sqlite3 *db) {
+    if (!disk_db) return 0;
+
+    // The generation is bumped in the copy being written, so after a crash
+    // between the backup and the journal reset the stale journal is ignored
+    journal_paused = 1;
+    int rc = sqlite3_exec(db, "UPDATE main.memory_checkpoint SET generation = generation + 1 WHERE id = 1;", 0, 0, NULL);
+    journal_paused = 0;
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        sqlite3_finalize(stmt_select_store_items_of_an_event);
-        sqlite3_finalize(stmt_update_store_stock);
-        sqlite3_finalize(stmt_select_all_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_event_completion);
-        sqlite3_finalize(stmt_daily_missions);
-        return rc;
+        fprintf(stderr, "Failed to start checkpoint: %s\n", sqlite3_errmsg(db));
+        return -1;
     }
 
-    rc = sqlite3_prepare_v2(db, sql_reinitialize_daily_missions_tasks, -1, &stmt_reinitialize_daily_missions_tasks, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt_insert_currency);
-        sqlite3_finalize(stmt_insert_events);
-        sqlite3_finalize(stmt_insert_tasks);
-        sqlite3_finalize(stmt_insert_store);
-        sqlite3_finalize(stmt_select_currency);
-        sqlite3_finalize(stmt_select_active_events);
-        sqlite3_finalize(stmt_select_incomplete_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_task_completion);
-        sqlite3_finalize(stmt_update_balance);
-        sqlite3_finalize(stmt_select_store_items_of_an_event);
-        sqlite3_finalize(stmt_update_store_stock);
-        sqlite3_finalize(stmt_select_all_tasks_of_an_event);
-        sqlite3_finalize(stmt_update_event_completion);
-        sqlite3_finalize(stmt_daily_missions);
-        sqlite3_finalize(stmt_reinitialize_daily_missions_event);
-        return rc;
+    if (copy_database(disk_db, db) != SQLITE_OK) return -1;
+
+    if (journal_fd != -1 && journal_reset(select_checkpoint_generation(db)) != 0) {
+        fprintf(stderr, "Failed to reset statement journal.\n");
+        return -1;
     }
 
-    printf("All statements prepared successfully.\n");
-    return SQLITE_OK;
+    last_memory_checkpoint = time(NULL);
+    checkpointed_changes = sqlite3_total_changes(db);
+    return 0;
 }
 
-void display_menu() {
-    printf("\n--- Reward System Menu ---\n");
-    printf("1. Add an Event\n");
-    printf("2. Mark a Task as Done\n");
-    printf("3. Buy an Item from the Store\n");
-    printf("4. List All Events and Their Tasks\n");
-    printf("5. List My Stats\n");
-    printf("6. Exit\n");
-    printf("Enter your choice: ");
+void memory_checkpoint_if_due(sqlite3 *db) {
+    if (!disk_db) return;
+    if (sqlite3_total_changes(db) == checkpointed_changes) return;
+    if (time(NULL) - last_memory_checkpoint < memory_checkpoint_interval) return;
+
+    memory_checkpoint(db);
 }
 
-void print_top_border(int num_columns, ...) {
-    va_list args;
-    va_start(args, num_columns);
+int journal_trace(unsigned type, void *context, void *p, void *x) {
+    sqlite3_stmt *stmt = p;
+    const char *sql = x;
 
-    printf("┌─");
-    for (int i = 0; i < num_columns; ++i) {
-        int column_width = va_arg(args, int);
-        for (int j = 0; j < column_width; ++j) printf("─");
-        if (i < num_columns - 1) printf("─┬─");
+    // Trigger bodies are reported as "-- name" and replay with their statement
+    if (journal_paused || sqlite3_stmt_readonly(stmt) || strncmp(sql, "--", 2) == 0) return 0;
+
+    char *expanded = sqlite3_expanded_sql(stmt);
+    if (!expanded) return 0;
+
+    size_t length = strlen(expanded);
+    while (length > 0 && (expanded[length - 1] == ';' || expanded[length - 1] == ' ' || expanded[length - 1] == '\n')) length--;
+
+    if (journal_length + length + 3 > journal_capacity) {
+        size_t capacity = journal_capacity ? journal_capacity : 4096;
+        while (journal_length + length + 3 > capacity) capacity *= 2;
+
+        char *buffer = realloc(journal_buffer, capacity);
+        if (!buffer) {
+            sqlite3_free(expanded);
+            return 0;
+        }
+        journal_buffer = buffer;
+        journal_capacity = capacity;
     }
-    printf("─┐\n");
 
-    va_end(args);
+    memcpy(journal_buffer + journal_length, expanded, length);
+    memcpy(journal_buffer + journal_length + length, ";\n", 2);
+    journal_length += length + 2;
+
+    sqlite3_free(expanded);
+    return 0;
 }
 
-void print_row_separator(int num_columns, ...) {
-    va_list args;
-    va_start(args, num_columns);
+// A non-zero return turns the commit into a rollback, so nothing commits in
+// memory that is not already on disk.
+int journal_commit(void *context) {
+    if (journal_length == 0) return 0;
 
-    printf("├─");
-    for (int i = 0; i < num_columns; ++i) {
-        int column_width = va_arg(args, int);
-        for (int j = 0; j < column_width; ++j) printf("─");
-        if (i < num_columns - 1) printf("─┼─");
+    size_t written = 0;
+    while (written < journal_length) {
+        ssize_t n = write(journal_fd, journal_buffer + written, journal_length - written);
+        if (n == -1) return 1;
+        written += n;
     }
-    printf("─┤\n");
+    journal_length = 0;
 
-    va_end(args);
+    return fdatasync(journal_fd) != 0;
 }
 
-void print_bottom_border(int num_columns, ...) {
-    va_list args;
-    va_start(args, num_columns);
+void journal_rollback(void *context) {
+    journal_length = 0;
+}
 
-    printf("└─");
-    for (int i = 0; i < num_columns; ++i) {
-        int column_width = va_arg(args, int);
-        for (int j = 0; j < column_width; ++j) printf("─");
-        if (i < num_columns - 1) printf("─┴─");
+// Re-applies a journal left behind by a crash, if the file on disk predates it.
+int journal_replay(sqlite3 *db, const char *journal_file) {
+    FILE *file = fopen(journal_file, "r");
+    if (!file) return 0;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char *sql = malloc(size + 1);
+    if (!sql) {
+        fclose(file);
+        return -1;
+    }
+    size_t length = fread(sql, 1, size, file);
+    sql[length] = '\0';
+    fclose(file);
+
+    int generation;
+    if (sscanf(sql, "-- generation %d", &generation) != 1 || generation != select_checkpoint_generation(db)) {
+        free(sql);
+        return 0;
     }
-    printf("─┘\n");
 
-    va_end(args);
-}
+    int replayed = 0;
+    const char *tail = sql;
+    while (*tail) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail) != SQLITE_OK) break;
+        if (!stmt) continue;
 
-void print_table_row(int num_columns, ...) {
-    va_list args;
-    va_start(args, num_columns);
+        while (sqlite3_step(stmt) == SQLITE_ROW);
+        sqlite3_finalize(stmt);
+        replayed++;
+    }
+    free(sql);
 
-    printf("│");
+    if (replayed > 0) printf("Replayed %d journaled statement(s).\n", replayed);
+    return replayed;
+}
 
-    for (int i = 0; i < num_columns; i++) {
-        const char *column_value = va_arg(args, const char *);  
-        int column_width = va_arg(args, int);                  
+int journal_open(sqlite3 *db, const char *journal_file) {
+    if (journal_replay(db, journal_file) < 0) return -1;
 
-        printf(" %-*s │", column_width, column_value);
+    journal_fd = open(journal_file, O_RDWR | O_CREAT, 0644);
+    if (journal_fd == -1) {
+        perror("open");
+        return -1;
     }
-    printf("\n");
 
-    va_end(args);
+    // Folds any replayed statements into the file and starts an empty journal
+    if (memory_checkpoint(db) != 0) return -1;
+
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT, journal_trace, NULL);
+    return 0;
 }
 
+void journal_close(void) {
+    if (journal_fd == -1) return;
 
-void initialize_daily_missions(sqlite3 *db) {
-    if (sqlite3_step(stmt_daily_missions) != SQLITE_ROW) {
-        printf("Daily Missions data does not exist.\n");
-        int rc;
+    close(journal_fd);
+    journal_fd = -1;
+    free(journal_buffer);
+    journal_buffer = NULL;
+    journal_length = journal_capacity = 0;
+}
 
-        struct currency new_currency;
-        strncpy(new_currency.currency_name, "Universal Coin", 49);
-        strncpy(new_currency.symbol, "UC", 9);
-        new_currency.balance = 0;
+void change_feed_record(void *context, int op, const char *database, const char *table, sqlite3_int64 rowid) {
+    if (strcmp(database, "main") != 0 || change_feed.overflowed) return;
 
-        sqlite3_bind_text(stmt_insert_currency, 1, new_currency.currency_name, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt_insert_currency, 2, new_currency.symbol, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt_insert_currency, 3, new_currency.balance);
+    int t = 0;
+    while (t < CHANGE_TABLE_COUNT && strcmp(table, change_table_names[t]) != 0) t++;
+    if (t == CHANGE_TABLE_COUNT) return;
 
-        rc = sqlite3_step(stmt_insert_currency);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Failed to insert currency: %s\n", sqlite3_errmsg(db));
-            sqlite3_reset(stmt_insert_currency);
+    if (change_feed.count == change_feed.capacity) {
+        int capacity = change_feed.capacity ? change_feed.capacity * 2 : 64;
+        struct row_change *changes = realloc(change_feed.changes, capacity * sizeof(struct row_change));
+        if (!changes) {
+            // The commit is then published as "anything may have changed"
+            change_feed.overflowed = 1;
             return;
         }
+        change_feed.changes = changes;
+        change_feed.capacity = capacity;
+    }
 
-        sqlite3_reset(stmt_insert_currency);
-        printf("Created Universal Coin(UC).\n");
+    change_feed.changes[change_feed.count++] = (struct row_change){ op, t, rowid };
+}
 
-        struct event new_event;
-        new_event.event_id = 1;
-        strncpy(new_event.event_name, "Daily Missions", 99);
-        new_event.currency_id = 1;
-        new_event.is_time_limited = 1;
-        new_event.start_time = time(NULL);
-        new_event.end_time = new_event.start_time + 24 * 3600;
-        new_event.is_active = 1;
+void change_feed_discard(void) {
+    change_feed.count = 0;
+    change_feed.overflowed = 0;
+}
 
-        sqlite3_bind_text(stmt_insert_events, 1, new_event.event_name, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt_insert_events, 2, new_event.currency_id);
-        sqlite3_bind_int(stmt_insert_events, 3, new_event.is_time_limited);
-        sqlite3_bind_int64(stmt_insert_events, 4, new_event.start_time);
-        sqlite3_bind_int64(stmt_insert_events, 5, new_event.end_time);
-        sqlite3_bind_int(stmt_insert_events, 6, 1);
+// Fits "<sequence> <operation> <table> <rowid>\n"
+#define CHANGE_LINE_SIZE 80
+
+// A commit is written as one "<sequence> insert|update|delete <table> <rowid>"
+// line per change and a closing "<sequence> commit <count>", or as
+// "<sequence> reset" when its changes were not captured. Writes never block the
+// menu: without a reader the commit is skipped, and one that does not fit in
+// the pipe is dropped, which the reader sees as a gap in the sequence. A commit
+// cut off part way closes the FIFO so the reader gets end-of-file instead.
+void change_feed_write(const struct row_change *changes, int count) {
+    if (change_feed.fifo_fd == -1) {
+        change_feed.fifo_fd = open(change_feed.fifo_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (change_feed.fifo_fd == -1) return;
+    }
 
-        rc = sqlite3_step(stmt_insert_events);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Error adding event: %s\n", sqlite3_errmsg(db));
-            sqlite3_reset(stmt_insert_events);
+    size_t needed = (size_t)(changes ? count + 1 : 1) * CHANGE_LINE_SIZE;
+    if (needed > change_feed.line_capacity) {
+        char *buffer = realloc(change_feed.line_buffer, needed);
+        if (!buffer) {
+            change_feed.dropped++;
             return;
         }
+        change_feed.line_buffer = buffer;
+        change_feed.line_capacity = needed;
+    }
 
-        sqlite3_reset(stmt_insert_events);
-        printf("Daily Missions Event added successfully\n");
+    static const char *op_names[] = { [SQLITE_INSERT] = "insert", [SQLITE_UPDATE] = "update", [SQLITE_DELETE] = "delete" };
+    char *line = change_feed.line_buffer;
+    size_t length = 0;
+    if (changes) {
+        for (int i = 0; i < count; i++) {
+            length += snprintf(line + length, CHANGE_LINE_SIZE, "%llu %s %s %lld\n", change_feed.sequence,
+                op_names[changes[i].op], change_table_names[changes[i].table], (long long)changes[i].rowid);
+        }
+        length += snprintf(line + length, CHANGE_LINE_SIZE, "%llu commit %d\n", change_feed.sequence, count);
+    } else {
+        length += snprintf(line + length, CHANGE_LINE_SIZE, "%llu reset\n", change_feed.sequence);
+    }
 
-        printf("Enter the number of tasks for Event %s: ", new_event.event_name);
-        int num_tasks;
-        scanf("%d", &num_tasks);
-        flush_input_buffer();
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(change_feed.fifo_fd, line + written, length - written);
+        if (n == -1) {
+            change_feed.dropped++;
+            if (written > 0 || errno != EAGAIN) {
+                close(change_feed.fifo_fd);
+                change_feed.fifo_fd = -1;
+            }
+            return;
+        }
+        written += n;
+    }
+}
 
-        for (int i = 1; i <= num_tasks; ++i) {
-            struct task new_task;
+// Called from the commit hook, before SQLite finishes the commit. A COMMIT that
+// still fails after it, on a busy lock, publishes changes that are then rolled
+// back, so subscribers treat each change as a reason to re-read the row, never
+// as its new value.
+void change_feed_publish(void) {
+    if (change_feed.count == 0 && !change_feed.overflowed) return;
+
+    const struct row_change *changes = change_feed.overflowed ? NULL : change_feed.changes;
+    change_feed.sequence++;
+    for (int i = 0; i < change_feed.subscriber_count; i++) {
+        change_feed.subscribers[i](changes, change_feed.count);
+    }
+    if (change_feed.fifo_path) change_feed_write(changes, change_feed.count);
 
-            new_task.event_id = new_event.event_id;
-            new_task.task_id = i;
+    change_feed.published_changes += change_feed.count;
+    change_feed_discard();
+}
 
-            printf("Enter task description: ");
-            fgets(new_task.task_description, sizeof(new_task.task_description), stdin);
-            new_task.task_description[strcspn(new_task.task_description, "\n")] = 0;
+void change_feed_subscribe(change_subscriber subscriber) {
+    if (change_feed.subscriber_count < CHANGE_MAX_SUBSCRIBERS) {
+        change_feed.subscribers[change_feed.subscriber_count++] = subscriber;
+    }
+}
 
-            printf("Enter the currency amount rewarded upon completion: ");
-            scanf("%d", &new_task.currency_amount);
-            flush_input_buffer();
+// SQLite keeps one commit and one rollback hook per connection, shared by the
+// statement journal and the change feed. A failed journal write turns the
+// commit into a rollback before anything is published.
+int commit_hook(void *context) {
+    if (journal_commit(context) != 0) return 1;
+    change_feed_publish();
+    return 0;
+}
 
-            new_task.is_completed = 0;
+void rollback_hook(void *context) {
+    journal_rollback(context);
+    change_feed_discard();
+}
 
-            sqlite3_bind_int(stmt_insert_tasks, 1, new_task.event_id);
-            sqlite3_bind_int(stmt_insert_tasks, 2, new_task.task_id);
-            sqlite3_bind_text(stmt_insert_tasks, 3, new_task.task_description, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(stmt_insert_tasks, 4, new_task.currency_amount);
-            sqlite3_bind_int(stmt_insert_tasks, 5, new_task.is_completed);
+int change_feed_init(sqlite3 *db, const char *fifo_path) {
+    if (fifo_path) {
+        struct stat st;
+        if (mkfifo(fifo_path, 0600) != 0 && (errno != EEXIST || stat(fifo_path, &st) != 0 || !S_ISFIFO(st.st_mode))) {
+            fprintf(stderr, "%s is not a FIFO.\n", fifo_path);
+            return -1;
+        }
 
-            rc = sqlite3_step(stmt_insert_tasks);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "Error adding task: %s\n", sqlite3_errmsg(db));
-                sqlite3_reset(stmt_insert_tasks);
-                return;
-            }
+        // A reader that goes away is noticed as EPIPE on the next write
+        struct sigaction sa;
+        sa.sa_handler = SIG_IGN;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        if (sigaction(SIGPIPE, &sa, NULL) != 0) return -1;
+        change_feed.fifo_path = fifo_path;
+    }
 
-            sqlite3_reset(stmt_insert_tasks);
-            printf("Task %d added successfully\n", i);
-        }
+    change_feed_subscribe(currency_cache_on_changes);
+    change_feed_subscribe(affordability_on_changes);
+    change_feed_subscribe(task_index_on_changes);
+    change_feed_subscribe(balance_view_on_changes);
 
-        printf("Enter the number of store items associated with this event: ");
-        int num_items;
-        scanf("%d", &num_items);
-        flush_input_buffer();
+    change_feed_attach(db);
+    for (int k = 0; k < shard_count; k++) change_feed_attach(shards[k].db);
+    return 0;
+}
 
-        for (int i = 1; i <= num_items; ++i) {
-            struct store_item new_store_item;
+// Every connection that writes feeds the same buffer; only one of them is in
+// a transaction at a time.
+void change_feed_attach(sqlite3 *db) {
+    sqlite3_update_hook(db, change_feed_record, NULL);
+    sqlite3_commit_hook(db, commit_hook, NULL);
+    sqlite3_rollback_hook(db, rollback_hook, NULL);
+}
 
-            new_store_item.item_id = i;
+void change_feed_close(void) {
+    if (change_feed.fifo_fd != -1) close(change_feed.fifo_fd);
+    change_feed.fifo_fd = -1;
+    free(change_feed.changes);
+    free(change_feed.line_buffer);
+    change_feed.changes = NULL;
+    change_feed.line_buffer = NULL;
+    change_feed.count = change_feed.capacity = 0;
+    change_feed.line_capacity = 0;
+}
 
-            printf("Enter item description: ");
-            fgets(new_store_item.item_description, sizeof(new_store_item.item_description), stdin);
-            new_store_item.item_description[strcspn(new_store_item.item_description, "\n")] = 0;
+// Databases created before auto_vacuum was set are converted once; changing
+// the mode on an existing file only takes effect after a full VACUUM.
+int enable_incremental_vacuum(sqlite3 *db, const char *schema) {
+    char sql[128];
+    sqlite3_stmt *stmt;
 
-            printf("Enter cost of the item: ");
-            scanf("%d", &new_store_item.cost);
-            flush_input_buffer();
+    snprintf(sql, sizeof(sql), "PRAGMA %s.auto_vacuum;", schema);
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+        return rc;
+    }
 
-            new_store_item.event_id = new_event.event_id;
+    int mode = select_pragma_int(stmt);
+    sqlite3_finalize(stmt);
+    if (mode == -1) return SQLITE_ERROR;
 
-            printf("Enter item stock(-1 for infinity): ");
-            scanf("%d", &new_store_item.stock);
-            flush_input_buffer();
+    // 2 = INCREMENTAL
+    if (mode == 2) return SQLITE_OK;
 
-            printf("Enter category: ");
-            fgets(new_store_item.category, sizeof(new_store_item.category), stdin);
-            new_store_item.category[strcspn(new_store_item.category, "\n")] = 0;
+    printf("Converting %s database to incremental vacuum...\n", schema);
 
-            sqlite3_bind_int(stmt_insert_store, 1, new_store_item.item_id);
-            sqlite3_bind_text(stmt_insert_store, 2, new_store_item.item_description, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(stmt_insert_store, 3, new_store_item.cost);
-            sqlite3_bind_int(stmt_insert_store, 4, new_store_item.event_id);
-            sqlite3_bind_int(stmt_insert_store, 5, new_store_item.stock);
+    char *err_msg = 0;
+    snprintf(sql, sizeof(sql), "PRAGMA %s.auto_vacuum = INCREMENTAL; VACUUM %s;", schema, schema);
+    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to convert %s database: %s\n", schema, err_msg);
+        sqlite3_free(err_msg);
+        return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+// Schema objects added after the initial tables. Runs on every startup so that
+// existing databases pick them up as well.
+int update_schema(sqlite3 *db) {
+    char *err_msg = 0;
+
+    // Columns added to existing tables, which have no IF NOT EXISTS
+    const char *sql_columns[][3] = {
+        { "tasks", "remaining_prereqs", "ALTER TABLE main.tasks ADD COLUMN remaining_prereqs INTEGER NOT NULL DEFAULT 0;" },
+        // NULL for currencies that never expire
+        { "currency", "lot_lifetime_days", "ALTER TABLE main.currency ADD COLUMN lot_lifetime_days INTEGER;" },
+        // Units under live stock holds
+        { "store", "held", "ALTER TABLE main.store ADD COLUMN held INTEGER NOT NULL DEFAULT 0;" },
+    };
+
+    for (int i = 0; i < sizeof(sql_columns) / sizeof(sql_columns[0]); i++) {
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?, 'main') WHERE name = ?;", -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+            return rc;
+        }
+        sqlite3_bind_text(stmt, 1, sql_columns[i][0], -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, sql_columns[i][1], -1, SQLITE_STATIC);
+        int exists = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+        if (exists) continue;
+
+        rc = sqlite3_exec(db, sql_columns[i][2], 0, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Failed to update schema: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            return rc;
+        }
+    }
+
+    const char* sql_statements[] = {
+        // Store items of an event ordered by cost
+        "CREATE INDEX IF NOT EXISTS idx_store_event_cost ON store (event_id, cost, item_id);",
+
+        // Operation IDs already applied, with the result reported to the client
+        "CREATE TABLE IF NOT EXISTS applied_operations ("
+        "operation_id TEXT PRIMARY KEY,"
+        "applied_at INTEGER NOT NULL,"
+        "result TEXT NOT NULL"
+        ") WITHOUT ROWID;",
+
+        "CREATE INDEX IF NOT EXISTS idx_applied_operations_applied_at ON applied_operations (applied_at);",
+
+        // Activation queue: pending events ordered by start time
+        "CREATE INDEX IF NOT EXISTS idx_events_pending_start ON events (start_time) WHERE is_active = 2;",
+
+        // Events created before activation was scheduled were made active even
+        // when they had not started yet
+        "UPDATE events SET is_active = 2 WHERE is_active = 1 AND is_time_limited = 1 AND start_time > CAST(strftime('%s', 'now') AS INTEGER);",
+
+        // Archive of ended events, their tasks and their store items
+        "CREATE TABLE IF NOT EXISTS archive.events ("
+        "event_id INTEGER PRIMARY KEY,"
+        "event_name TEXT NOT NULL,"
+        "currency_id INTEGER,"
+        "is_time_limited BOOLEAN NOT NULL,"
+        "start_time TIMESTAMP,"
+        "end_time TIMESTAMP,"
+        "is_active BOOLEAN NOT NULL,"
+        "archived_at INTEGER NOT NULL"
+        ");",
+
+        "CREATE TABLE IF NOT EXISTS archive.tasks ("
+        "event_id INTEGER NOT NULL,"
+        "task_id INTEGER NOT NULL,"
+        "task_description TEXT NOT NULL,"
+        "currency_amount INTEGER NOT NULL,"
+        "is_completed BOOLEAN NOT NULL,"
+        "PRIMARY KEY (event_id, task_id)"
+        ") WITHOUT ROWID;",
+
+        "CREATE TABLE IF NOT EXISTS archive.store ("
+        "item_id INTEGER NOT NULL,"
+        "item_description TEXT NOT NULL,"
+        "cost INTEGER NOT NULL,"
+        "event_id INTEGER NOT NULL,"
+        "stock INTEGER NOT NULL,"
+        "category TEXT,"
+        "PRIMARY KEY (event_id, item_id)"
+        ") WITHOUT ROWID;",
+
+        // Bumped on every in-memory checkpoint to tell which journal entries
+        // the file on disk already contains
+        "CREATE TABLE IF NOT EXISTS memory_checkpoint ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "generation INTEGER NOT NULL"
+        ");",
+
+        "INSERT OR IGNORE INTO memory_checkpoint VALUES (1, 0);",
+
+        // Number of shard files, fixed when the first shard is created
+        "CREATE TABLE IF NOT EXISTS shard_config ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "shard_count INTEGER NOT NULL"
+        ");",
+
+        // Unqualified, so that with shards they read the shard views below
+
+        "CREATE TEMP VIEW IF NOT EXISTS all_events AS "
+        "SELECT * FROM events UNION ALL "
+        "SELECT event_id, event_name, currency_id, is_time_limited, start_time, end_time, is_active FROM archive.events;",
+
+        "CREATE TEMP VIEW IF NOT EXISTS all_tasks AS "
+        "SELECT event_id, task_id, task_description, currency_amount, is_completed FROM tasks UNION ALL SELECT * FROM archive.tasks;",
+
+        "CREATE TEMP VIEW IF NOT EXISTS all_store AS "
+        "SELECT item_id, item_description, cost, event_id, stock, category FROM store UNION ALL SELECT * FROM archive.store;",
+
+        // Reward rules, applied in priority order to what a task completion
+        // credits. kind 'multiply' scales the amount by value percent, 'bonus'
+        // adds value. A NULL condition matches anything; weekdays is a bit
+        // mask with bit 0 for Sunday, and min_streak is checked against the
+        // daily_streak achievement counter.
+        "CREATE TABLE IF NOT EXISTS reward_rules ("
+        "rule_id INTEGER PRIMARY KEY,"
+        "kind TEXT NOT NULL CHECK (kind IN ('multiply', 'bonus')),"
+        "value INTEGER NOT NULL,"
+        "event_id INTEGER,"
+        "currency_id INTEGER,"
+        "weekdays INTEGER,"
+        "start_time INTEGER,"
+        "end_time INTEGER,"
+        "min_streak INTEGER,"
+        "priority INTEGER NOT NULL DEFAULT 0,"
+        "is_enabled BOOLEAN NOT NULL DEFAULT 1"
+        ");",
+
+        "CREATE TABLE IF NOT EXISTS reward_rules_version ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "version INTEGER NOT NULL"
+        ");",
+
+        "INSERT OR IGNORE INTO reward_rules_version VALUES (1, 0);",
+
+        "CREATE TRIGGER IF NOT EXISTS reward_rules_inserted AFTER INSERT ON reward_rules "
+        "BEGIN UPDATE reward_rules_version SET version = version + 1; END;",
+
+        "CREATE TRIGGER IF NOT EXISTS reward_rules_updated AFTER UPDATE ON reward_rules "
+        "BEGIN UPDATE reward_rules_version SET version = version + 1; END;",
+
+        "CREATE TRIGGER IF NOT EXISTS reward_rules_deleted AFTER DELETE ON reward_rules "
+        "BEGIN UPDATE reward_rules_version SET version = version + 1; END;",
+
+        // Every credit of a task completion, with the rules that shaped it
+        "CREATE TABLE IF NOT EXISTS reward_ledger ("
+        "entry_id INTEGER PRIMARY KEY,"
+        "credited_at INTEGER NOT NULL,"
+        "credited_day INTEGER NOT NULL,"
+        "event_id INTEGER NOT NULL,"
+        "task_id INTEGER NOT NULL,"
+        "currency_id INTEGER NOT NULL,"
+        "base_amount INTEGER NOT NULL,"
+        "amount INTEGER NOT NULL,"
+        "rules TEXT NOT NULL,"
+        "rules_version INTEGER NOT NULL"
+        ");",
+
+        // Quest chains: task_id has to be completed before dependent_task_id
+        // of the same event. Keyed by the prerequisite, so a completion finds
+        // its direct dependents without a scan.
+        "CREATE TABLE IF NOT EXISTS task_dependencies ("
+        "event_id INTEGER NOT NULL,"
+        "task_id INTEGER NOT NULL,"
+        "dependent_task_id INTEGER NOT NULL,"
+        "PRIMARY KEY (event_id, task_id, dependent_task_id)"
+        ") WITHOUT ROWID;",
+
+        // tasks.remaining_prereqs counts incomplete prerequisites; the triggers
+        // keep it up to date as edges are added and tasks change state
+        "CREATE TRIGGER IF NOT EXISTS task_dependency_added AFTER INSERT ON task_dependencies "
+        "BEGIN UPDATE tasks SET remaining_prereqs = remaining_prereqs + 1 "
+        "WHERE event_id = NEW.event_id AND task_id = NEW.dependent_task_id "
+        "AND EXISTS (SELECT 1 FROM tasks WHERE event_id = NEW.event_id AND task_id = NEW.task_id AND is_completed = 0); END;",
+
+        "CREATE TRIGGER IF NOT EXISTS task_completion_changed AFTER UPDATE OF is_completed ON tasks "
+        "WHEN NEW.is_completed != OLD.is_completed "
+        "BEGIN UPDATE tasks SET remaining_prereqs = remaining_prereqs + CASE WHEN NEW.is_completed THEN -1 ELSE 1 END "
+        "WHERE event_id = NEW.event_id AND task_id IN "
+        "(SELECT dependent_task_id FROM task_dependencies WHERE event_id = NEW.event_id AND task_id = NEW.task_id); END;",
+
+        "CREATE INDEX IF NOT EXISTS idx_tasks_available ON tasks (event_id, task_id) WHERE is_completed = 0 AND remaining_prereqs = 0;",
+
+        // Unspent credits of expiring currencies. currency.balance stays their
+        // running sum, so reading a balance never adds lots up.
+        "CREATE TABLE IF NOT EXISTS currency_lots ("
+        "lot_id INTEGER PRIMARY KEY,"
+        "currency_id INTEGER NOT NULL,"
+        "expires_at INTEGER NOT NULL,"
+        "remaining INTEGER NOT NULL"
+        ");",
+
+        "CREATE INDEX IF NOT EXISTS idx_currency_lots_currency_expiry ON currency_lots (currency_id, expires_at, lot_id);",
+
+        "CREATE INDEX IF NOT EXISTS idx_currency_lots_expiry ON currency_lots (expires_at);",
+
+        // Achievements unlock once the counter named by metric reaches
+        // threshold. Counters are per currency, except daily_streak (currency
+        // 0), the run of consecutive Daily Missions windows with every
+        // mission done. A NULL currency_id matches the counter of any currency.
+        "CREATE TABLE IF NOT EXISTS achievements ("
+        "achievement_id INTEGER PRIMARY KEY,"
+        "name TEXT NOT NULL,"
+        "metric TEXT NOT NULL CHECK (metric IN ('tasks_completed', 'earned', 'spent', 'items_bought', 'daily_streak')),"
+        "currency_id INTEGER,"
+        "threshold INTEGER NOT NULL CHECK (threshold > 0)"
+        ");",
+
+        "CREATE TABLE IF NOT EXISTS achievements_version ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "version INTEGER NOT NULL"
+        ");",
+
+        "INSERT OR IGNORE INTO achievements_version VALUES (1, 0);",
+
+        "CREATE TRIGGER IF NOT EXISTS achievements_inserted AFTER INSERT ON achievements "
+        "BEGIN UPDATE achievements_version SET version = version + 1; END;",
+
+        "CREATE TRIGGER IF NOT EXISTS achievements_updated AFTER UPDATE ON achievements "
+        "BEGIN UPDATE achievements_version SET version = version + 1; END;",
+
+        "CREATE TRIGGER IF NOT EXISTS achievements_deleted AFTER DELETE ON achievements "
+        "BEGIN UPDATE achievements_version SET version = version + 1; END;",
+
+        // Running totals, moved in the same transaction as the completion or
+        // purchase they count. best is the high-water mark, period the Daily
+        // Missions start_time the streak last counted.
+        "CREATE TABLE IF NOT EXISTS achievement_counters ("
+        "metric TEXT NOT NULL,"
+        "currency_id INTEGER NOT NULL,"
+        "value INTEGER NOT NULL,"
+        "best INTEGER NOT NULL,"
+        "period INTEGER,"
+        "PRIMARY KEY (metric, currency_id)"
+        ") WITHOUT ROWID;",
+
+        "CREATE TABLE IF NOT EXISTS achievement_unlocks ("
+        "achievement_id INTEGER PRIMARY KEY,"
+        "unlocked_at INTEGER NOT NULL"
+        ");",
+
+        // Units set aside for a cart until they are bought or expires_at passes
+        "CREATE TABLE IF NOT EXISTS stock_holds ("
+        "hold_id INTEGER PRIMARY KEY,"
+        "event_id INTEGER NOT NULL,"
+        "item_id INTEGER NOT NULL,"
+        "quantity INTEGER NOT NULL CHECK (quantity > 0),"
+        "expires_at INTEGER NOT NULL"
+        ");",
+
+        "CREATE INDEX IF NOT EXISTS idx_stock_holds_expiry ON stock_holds (expires_at);",
+
+        // Per-connection set of tasks picked for a bulk completion
+        "CREATE TEMP TABLE IF NOT EXISTS bulk_task_selection ("
+        "event_id INTEGER NOT NULL,"
+        "task_id INTEGER NOT NULL,"
+        "PRIMARY KEY (event_id, task_id)"
+        ");"
+    };
+
+    for (int i = 0; i < sizeof(sql_statements) / sizeof(sql_statements[0]); i++) {
+        int rc = sqlite3_exec(db, sql_statements[i], 0, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Failed to update schema: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            return rc;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+// Opens the writer connection of every shard and attaches the shards to db,
+// where TEMP views named after the sharded tables union them for reading.
+// Writes through db fail on those views, so every write has to be routed to
+// a shard connection. requested is the --shards count or 0 to use the one
+// the database was created with.
+int shards_open(sqlite3 *db, const char *db_file, const char *archive_file, int requested) {
+    sqlite3_stmt *stmt;
+    int configured = 0;
+    int currencies = 0;
+
+    int rc = sqlite3_prepare_v2(db, "SELECT (SELECT shard_count FROM main.shard_config), (SELECT count(*) FROM main.currency);", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+        return rc;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        configured = sqlite3_column_int(stmt, 0);
+        currencies = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+
+    if (configured == 0 && requested == 0) return SQLITE_OK;
+    if (configured && requested && configured != requested) {
+        fprintf(stderr, "The database was created with %d shards, not %d.\n", configured, requested);
+        return SQLITE_ERROR;
+    }
+    if (configured == 0) {
+        // Existing currencies would keep IDs that do not route to their shard
+        if (currencies > 0) {
+            fprintf(stderr, "Sharding can only be enabled on a database without currencies.\n");
+            return SQLITE_ERROR;
+        }
+
+        char sql[96];
+        snprintf(sql, sizeof(sql), "INSERT INTO main.shard_config VALUES (1, %d);", requested);
+        char *err_msg = 0;
+        if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "Failed to record the shard count: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            return SQLITE_ERROR;
+        }
+        configured = requested;
+    }
+
+    for (int k = 0; k < configured; k++) {
+        char shard_file[256];
+        snprintf(shard_file, sizeof(shard_file), "%s-shard%d", db_file, k);
+        int is_new = !file_exists(shard_file);
+
+        sqlite3 *shard;
+        rc = sqlite3_open(shard_file, &shard);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Cannot open shard %s: %s\n", shard_file, sqlite3_errmsg(shard));
+            sqlite3_close(shard);
+            return rc;
+        }
+
+        shards[k].db = shard;
+        memcpy(shards[k].statements, statements, sizeof(statements));
+        for (int i = 0; i < STMT_COUNT; i++) {
+            shards[k].statements[i].stmt = NULL;
+            shards[k].statements[i].uses = 0;
+        }
+        shard_count = k + 1;
+
+        if (is_new) create_tables(shard);
+        contention_init(shard);
+
+        rc = attach_archive(shard, archive_file);
+        if (rc == SQLITE_OK) rc = enable_incremental_vacuum(shard, "main");
+        if (rc == SQLITE_OK) rc = update_schema(shard);
+        if (rc != SQLITE_OK) return rc;
+
+        char sql[320];
+        snprintf(sql, sizeof(sql), "ATTACH DATABASE '%s' AS shard%d;", shard_file, k);
+        char *err_msg = 0;
+        if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "Cannot attach %s: %s\n", shard_file, err_msg);
+            sqlite3_free(err_msg);
+            return SQLITE_ERROR;
+        }
+    }
+
+    for (int t = 0; t < sizeof(sharded_tables) / sizeof(sharded_tables[0]); t++) {
+        char sql[1024];
+        int length = snprintf(sql, sizeof(sql), "CREATE TEMP VIEW %s AS ", sharded_tables[t]);
+        for (int k = 0; k < shard_count; k++) {
+            length += snprintf(sql + length, sizeof(sql) - length, "%sSELECT * FROM shard%d.%s", k ? " UNION ALL " : "", k, sharded_tables[t]);
+        }
+        snprintf(sql + length, sizeof(sql) - length, ";");
+
+        char *err_msg = 0;
+        if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "Failed to create the %s shard view: %s\n", sharded_tables[t], err_msg);
+            sqlite3_free(err_msg);
+            return SQLITE_ERROR;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+void shards_close(void) {
+    for (int k = 0; k < shard_count; k++) {
+        for (int i = 0; i < STMT_COUNT; i++) sqlite3_finalize(shards[k].statements[i].stmt);
+        if (sqlite3_close(shards[k].db) != SQLITE_OK) {
+            fprintf(stderr, "Failed to close shard %d: %s\n", k, sqlite3_errmsg(shards[k].db));
+        }
+        shards[k].db = NULL;
+    }
+    shard_count = 0;
+}
+
+// Currency and event IDs both encode their shard
+sqlite3 *shard_for_id(sqlite3 *db, int id) {
+    return shard_count && id > 0 ? shards[(id - 1) % shard_count].db : db;
+}
+
+// The connections that own rows: the shards, or db itself without sharding
+int writer_count(void) {
+    return shard_count ? shard_count : 1;
+}
+
+sqlite3 *writer(sqlite3 *db, int i) {
+    return shard_count ? shards[i].db : db;
+}
+
+// Shard k continues its sequences at k+1, k+1+N, ...; without shards IDs
+// count up by one as AUTOINCREMENT would
+void bind_id_sequence(sqlite3 *db, sqlite3_stmt *stmt, int start_param) {
+    int k = -1;
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].db == db) k = i;
+    }
+    sqlite3_bind_int(stmt, start_param, k == -1 ? 0 : k + 1 - shard_count);
+    sqlite3_bind_int(stmt, start_param + 1, k == -1 ? 1 : shard_count);
+}
+
+// With --format= other than table, the menu goes to stderr so record sets
+// on stdout always start on a line of their own
+FILE *menu_stream(void) {
+    return output.format == OUTPUT_TABLE ? stdout : stderr;
+}
+
+void display_menu() {
+    FILE *menu = menu_stream();
+    fprintf(menu, "\n--- Reward System Menu ---\n");
+    fprintf(menu, "1. Add an Event\n");
+    fprintf(menu, "2. Mark a Task as Done\n");
+    fprintf(menu, "3. Buy an Item from the Store\n");
+    fprintf(menu, "4. List All Events and Their Tasks\n");
+    fprintf(menu, "5. List My Stats\n");
+    fprintf(menu, "6. What Can I Afford\n");
+    fprintf(menu, "7. Mark Tasks as Done in Bulk\n");
+    fprintf(menu, "8. List Event History\n");
+    fprintf(menu, "9. Exit\n");
+    fprintf(menu, "Enter your choice: ");
+}
+
+void print_top_border(int num_columns, ...) {
+    va_list args;
+    va_start(args, num_columns);
+
+    printf("┌─");
+    for (int i = 0; i < num_columns; ++i) {
+        int column_width = va_arg(args, int);
+        for (int j = 0; j < column_width; ++j) printf("─");
+        if (i < num_columns - 1) printf("─┬─");
+    }
+    printf("─┐\n");
+
+    va_end(args);
+}
+
+void print_row_separator(int num_columns, ...) {
+    va_list args;
+    va_start(args, num_columns);
+
+    printf("├─");
+    for (int i = 0; i < num_columns; ++i) {
+        int column_width = va_arg(args, int);
+        for (int j = 0; j < column_width; ++j) printf("─");
+        if (i < num_columns - 1) printf("─┼─");
+    }
+    printf("─┤\n");
+
+    va_end(args);
+}
+
+void print_bottom_border(int num_columns, ...) {
+    va_list args;
+    va_start(args, num_columns);
+
+    printf("└─");
+    for (int i = 0; i < num_columns; ++i) {
+        int column_width = va_arg(args, int);
+        for (int j = 0; j < column_width; ++j) printf("─");
+        if (i < num_columns - 1) printf("─┴─");
+    }
+    printf("─┘\n");
+
+    va_end(args);
+}
+
+void print_table_row(int num_columns, ...) {
+    va_list args;
+    va_start(args, num_columns);
+
+    printf("│");
+
+    for (int i = 0; i < num_columns; i++) {
+        const char *column_value = va_arg(args, const char *);  
+        int column_width = va_arg(args, int);                  
+
+        printf(" %-*s │", column_width, column_value);
+    }
+    printf("\n");
+
+    va_end(args);
+}
+
+
+void initialize_daily_missions(sqlite3 *db) {
+    sqlite3_stmt *stmt_daily_missions = statement(db, STMT_DAILY_MISSIONS);
+    int exists = sqlite3_step(stmt_daily_missions) == SQLITE_ROW;
+
+    // A statement left mid-result holds a read transaction open, which stops
+    // other processes from committing and SQLite from calling the busy handler
+    sqlite3_reset(stmt_daily_missions);
+    if (!exists) {
+        printf("Daily Missions data does not exist.\n");
+        int rc;
+
+        struct currency new_currency;
+        strncpy(new_currency.currency_name, "Universal Coin", 49);
+        strncpy(new_currency.symbol, "UC", 9);
+        new_currency.balance = 0;
+
+        sqlite3_stmt *stmt_insert_currency = statement(db, STMT_INSERT_CURRENCY);
+        sqlite3_bind_text(stmt_insert_currency, 1, new_currency.currency_name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt_insert_currency, 2, new_currency.symbol, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt_insert_currency, 3, new_currency.balance);
+        bind_id_sequence(db, stmt_insert_currency, 4);
+        sqlite3_bind_null(stmt_insert_currency, 6);
+
+        rc = sqlite3_step(stmt_insert_currency);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Failed to insert currency: %s\n", sqlite3_errmsg(db));
+            sqlite3_reset(stmt_insert_currency);
+            return;
+        }
+
+        sqlite3_reset(stmt_insert_currency);
+        printf("Created Universal Coin(UC).\n");
+
+        struct event new_event;
+        new_event.event_id = 1;
+        strncpy(new_event.event_name, "Daily Missions", 99);
+        new_event.currency_id = 1;
+        new_event.is_time_limited = 1;
+        new_event.start_time = time(NULL);
+        new_event.end_time = new_event.start_time + 24 * 3600;
+        new_event.is_active = 1;
+
+        sqlite3_stmt *stmt_insert_events = statement(db, STMT_INSERT_EVENTS);
+        sqlite3_bind_text(stmt_insert_events, 1, new_event.event_name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt_insert_events, 2, new_event.currency_id);
+        sqlite3_bind_int(stmt_insert_events, 3, new_event.is_time_limited);
+        sqlite3_bind_int64(stmt_insert_events, 4, new_event.start_time);
+        sqlite3_bind_int64(stmt_insert_events, 5, new_event.end_time);
+        sqlite3_bind_int(stmt_insert_events, 6, 1);
+        bind_id_sequence(db, stmt_insert_events, 7);
+
+        rc = sqlite3_step(stmt_insert_events);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error adding event: %s\n", sqlite3_errmsg(db));
+            sqlite3_reset(stmt_insert_events);
+            return;
+        }
+
+        sqlite3_reset(stmt_insert_events);
+        printf("Daily Missions Event added successfully\n");
+
+        printf("Enter the number of tasks for Event %s: ", new_event.event_name);
+        int num_tasks = 0;
+        if (read_int(&num_tasks) == -1) return;
+
+        for (int i = 1; i <= num_tasks; ++i) {
+            struct task new_task;
+
+            new_task.event_id = new_event.event_id;
+            new_task.task_id = i;
+
+            printf("Enter task description: ");
+            if (read_line(new_task.task_description, sizeof(new_task.task_description)) == -1) return;
+
+            printf("Enter the currency amount rewarded upon completion: ");
+            if (read_int(&new_task.currency_amount) == -1) return;
+
+            new_task.is_completed = 0;
+
+            sqlite3_stmt *stmt_insert_tasks = statement(db, STMT_INSERT_TASKS);
+            sqlite3_bind_int(stmt_insert_tasks, 1, new_task.event_id);
+            sqlite3_bind_int(stmt_insert_tasks, 2, new_task.task_id);
+            sqlite3_bind_text(stmt_insert_tasks, 3, new_task.task_description, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt_insert_tasks, 4, new_task.currency_amount);
+            sqlite3_bind_int(stmt_insert_tasks, 5, new_task.is_completed);
+
+            rc = sqlite3_step(stmt_insert_tasks);
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "Error adding task: %s\n", sqlite3_errmsg(db));
+                sqlite3_reset(stmt_insert_tasks);
+                return;
+            }
+
+            sqlite3_reset(stmt_insert_tasks);
+            printf("Task %d added successfully\n", i);
+        }
+
+        printf("Enter the number of store items associated with this event: ");
+        int num_items = 0;
+        if (read_int(&num_items) == -1) return;
+
+        for (int i = 1; i <= num_items; ++i) {
+            struct store_item new_store_item;
+            char item_description[256];
+            char category[50];
+            new_store_item.item_description = item_description;
+            new_store_item.category = category;
+
+            new_store_item.item_id = i;
+
+            printf("Enter item description: ");
+            if (read_line(item_description, sizeof(item_description)) == -1) return;
+
+            printf("Enter cost of the item: ");
+            if (read_int(&new_store_item.cost) == -1) return;
+
+            new_store_item.event_id = new_event.event_id;
+
+            printf("Enter item stock(-1 for infinity): ");
+            if (read_int(&new_store_item.stock) == -1) return;
+
+            printf("Enter category: ");
+            if (read_line(category, sizeof(category)) == -1) return;
+
+            sqlite3_stmt *stmt_insert_store = statement(db, STMT_INSERT_STORE);
+            sqlite3_bind_int(stmt_insert_store, 1, new_store_item.item_id);
+            sqlite3_bind_text(stmt_insert_store, 2, new_store_item.item_description, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt_insert_store, 3, new_store_item.cost);
+            sqlite3_bind_int(stmt_insert_store, 4, new_store_item.event_id);
+            sqlite3_bind_int(stmt_insert_store, 5, new_store_item.stock);
             sqlite3_bind_text(stmt_insert_store, 6, new_store_item.category, -1, SQLITE_TRANSIENT);
 
-            rc = sqlite3_step(stmt_insert_store);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "Error adding item: %s\n", sqlite3_errmsg(db));
-                sqlite3_reset(stmt_insert_store);
+            rc = sqlite3_step(stmt_insert_store);
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "Error adding item: %s\n", sqlite3_errmsg(db));
+                sqlite3_reset(stmt_insert_store);
+                return;
+            }
+
+            sqlite3_reset(stmt_insert_store);
+            printf("Item %d added successfully\n", i);
+        }
+    }
+}
+
+int create_new_currency(sqlite3 *db) {
+    struct currency new_currency;
+
+    printf("Enter currency name: ");
+    if (read_line(new_currency.currency_name, sizeof(new_currency.currency_name)) == -1) return -1;
+
+    printf("Enter currency symbol: ");
+    if (read_line(new_currency.symbol, sizeof(new_currency.symbol)) == -1) return -1;
+
+    new_currency.balance = 0;
+
+    printf("Enter the number of days earned points stay valid (0 for no expiry): ");
+    int lifetime_days = 0;
+    if (read_int(&lifetime_days) == -1) return -1;
+
+    // New currencies go to the shard holding the fewest
+    sqlite3 *shard = writer(db, 0);
+    int fewest = -1;
+    for (int i = 0; shard_count && i < writer_count(); i++) {
+        int count = select_pragma_int(statement(writer(db, i), STMT_COUNT_OWN_CURRENCIES));
+        if (count != -1 && (fewest == -1 || count < fewest)) {
+            fewest = count;
+            shard = writer(db, i);
+        }
+    }
+
+    sqlite3_stmt *stmt_insert_currency = statement(shard, STMT_INSERT_CURRENCY);
+    sqlite3_bind_text(stmt_insert_currency, 1, new_currency.currency_name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt_insert_currency, 2, new_currency.symbol, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt_insert_currency, 3, new_currency.balance);
+    bind_id_sequence(shard, stmt_insert_currency, 4);
+    if (lifetime_days > 0) sqlite3_bind_int(stmt_insert_currency, 6, lifetime_days);
+    else sqlite3_bind_null(stmt_insert_currency, 6);
+
+    int rc = sqlite3_step(stmt_insert_currency);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Failed to insert currency: %s\n", sqlite3_errmsg(shard));
+        sqlite3_reset(stmt_insert_currency);
+        return -1;
+    }
+
+    sqlite3_reset(stmt_insert_currency);
+
+    return sqlite3_last_insert_rowid(shard);
+}
+
+// Reads quest chain edges for the tasks 1..task_count of a new event. An edge
+// that would close a cycle is refused; the others are kept.
+void add_task_dependencies(sqlite3 *db, int event_id, int task_count) {
+    printf("Enter prerequisites as TASK:PREREQUISITE pairs separated by spaces (leave blank for none): ");
+    char line[1024];
+    if (read_line(line, sizeof(line)) == -1) return;
+
+    char *save_ptr;
+    for (char *token = strtok_r(line, " \t", &save_ptr); token; token = strtok_r(NULL, " \t", &save_ptr)) {
+        int task_id, prerequisite_id;
+        if (sscanf(token, "%d:%d", &task_id, &prerequisite_id) != 2 ||
+            task_id < 1 || task_id > task_count || prerequisite_id < 1 || prerequisite_id > task_count) {
+            fprintf(stderr, "Invalid prerequisite '%s'.\n", token);
+            continue;
+        }
+
+        sqlite3_stmt *stmt_select_dependency_path = statement(db, STMT_SELECT_DEPENDENCY_PATH);
+        sqlite3_bind_int(stmt_select_dependency_path, 1, event_id);
+        sqlite3_bind_int(stmt_select_dependency_path, 2, prerequisite_id);
+        sqlite3_bind_int(stmt_select_dependency_path, 3, task_id);
+        int rc = sqlite3_step(stmt_select_dependency_path);
+        sqlite3_reset(stmt_select_dependency_path);
+        if (rc == SQLITE_ROW) {
+            fprintf(stderr, "Task %d already leads to task %d, making it a prerequisite would create a cycle.\n", task_id, prerequisite_id);
+            continue;
+        }
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error checking prerequisites: %s\n", sqlite3_errmsg(db));
+            return;
+        }
+
+        sqlite3_stmt *stmt_insert_task_dependency = statement(db, STMT_INSERT_TASK_DEPENDENCY);
+        sqlite3_bind_int(stmt_insert_task_dependency, 1, event_id);
+        sqlite3_bind_int(stmt_insert_task_dependency, 2, prerequisite_id);
+        sqlite3_bind_int(stmt_insert_task_dependency, 3, task_id);
+        rc = sqlite3_step(stmt_insert_task_dependency);
+        sqlite3_reset(stmt_insert_task_dependency);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error adding prerequisite: %s\n", sqlite3_errmsg(db));
+            return;
+        }
+        printf("Task %d now unlocks after task %d\n", task_id, prerequisite_id);
+    }
+}
+
+void add_event(sqlite3 *db) {
+    struct event new_event;
+    int rc;
+
+    // Event name
+    printf("Enter event name: ");
+    if (read_line(new_event.event_name, sizeof(new_event.event_name)) == -1) return;
+
+    printf("Existing currencies\n");
+    int id_width = 10;
+    int name_width = 20;
+    int symbol_width = 10;
+    print_top_border(3, id_width, name_width, symbol_width);
+    print_table_row(3, "ID", id_width, "Name", name_width, "Symbol", symbol_width);
+    print_row_separator(3, id_width, name_width, symbol_width);
+    
+    // Currency ID
+    int currency_count = 0;
+    sqlite3_stmt *stmt_select_currency = statement(db, STMT_SELECT_CURRENCY);
+    while ((rc = sqlite3_step(stmt_select_currency)) == SQLITE_ROW) {
+        int currency_id = sqlite3_column_int(stmt_select_currency, 0);
+        const char *currency_name = (const char *)sqlite3_column_text(stmt_select_currency, 1);
+        const char *symbol = (const char *)sqlite3_column_text(stmt_select_currency, 2);
+        int balance = sqlite3_column_int(stmt_select_currency, 3);
+
+        char id_str[10];
+        snprintf(id_str, sizeof(id_str), "%d", currency_id);
+
+        print_table_row(3, id_str, id_width, currency_name, name_width, symbol, symbol_width);
+        currency_count++;
+    }
+
+    print_bottom_border(3, id_width, name_width, symbol_width);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Failed to fetch currencies: %s\n", sqlite3_errmsg(db));
+        return;
+    }
+    
+    sqlite3_reset(stmt_select_currency);
+
+    if (currency_count == 0) {
+        printf("There are no currencies available, make one.\n");
+        new_event.currency_id = create_new_currency(db);
+        if (new_event.currency_id == -1) {
+            fprintf(stderr, "Failed to create new currency.\n");
+            return;
+        }
+        printf("New currency created with ID: %d\n", new_event.currency_id);
+    } else {
+        printf("\nChoose an existing currency or create a new one(0): ");
+        if (read_int(&new_event.currency_id) == -1) return;
+
+        if (new_event.currency_id == 0) {
+            new_event.currency_id = create_new_currency(db);
+            if (new_event.currency_id == -1) {
+                fprintf(stderr, "Failed to create new currency.\n");
+                return;
+            }
+            printf("New currency created with ID: %d\n", new_event.currency_id);
+        }
+    }
+
+    // Is time limited
+    printf("Is this event time-limited? (1 for Yes, 0 for No): ");
+    if (read_int(&new_event.is_time_limited) == -1) return;
+
+    if (new_event.is_time_limited) {
+        printf("Enter start time (YYYY-MM-DD HH:MM:SS): ");
+        char start_time_str[21];
+        if (read_line(start_time_str, sizeof(start_time_str)) == -1) return;
+
+
+        printf("Enter end time (YYYY-MM-DD HH:MM:SS): ");
+        char end_time_str[21];
+        if (read_line(end_time_str, sizeof(end_time_str)) == -1) return;
+
+        struct tm tm = {0};
+        
+        strptime(start_time_str, "%Y-%m-%d %H:%M:%S", &tm);
+        new_event.start_time = mktime(&tm);
+
+        strptime(end_time_str, "%Y-%m-%d %H:%M:%S", &tm);
+        new_event.end_time = mktime(&tm);
+    } else {
+        new_event.start_time = 0;
+        new_event.end_time = 0;
+    }
+
+    // The event, its tasks and its store items live with its currency
+    sqlite3 *shard = shard_for_id(db, new_event.currency_id);
+    sqlite3_stmt *stmt_insert_events = statement(shard, STMT_INSERT_EVENTS);
+    sqlite3_bind_text(stmt_insert_events, 1, new_event.event_name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt_insert_events, 2, new_event.currency_id);
+    sqlite3_bind_int(stmt_insert_events, 3, new_event.is_time_limited);
+    if (new_event.is_time_limited) {
+        sqlite3_bind_int64(stmt_insert_events, 4, new_event.start_time);
+        sqlite3_bind_int64(stmt_insert_events, 5, new_event.end_time);
+    } else {
+        sqlite3_bind_null(stmt_insert_events, 4);
+        sqlite3_bind_null(stmt_insert_events, 5);
+    }
+    new_event.is_active = new_event.is_time_limited && new_event.start_time > time(NULL) ? EVENT_PENDING : EVENT_ACTIVE;
+    sqlite3_bind_int(stmt_insert_events, 6, new_event.is_active);
+    bind_id_sequence(shard, stmt_insert_events, 7);
+
+    rc = sqlite3_step(stmt_insert_events);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error adding event: %s\n", sqlite3_errmsg(shard));
+        sqlite3_reset(stmt_insert_events);
+        return;
+    }
+
+    sqlite3_reset(stmt_insert_events);
+    if (new_event.is_active == EVENT_PENDING) printf("Event added successfully, it will become active at its start time\n");
+    else printf("Event added successfully\n");
+    new_event.event_id = sqlite3_last_insert_rowid(shard);
+    if (new_event.is_time_limited) {
+        scheduler_add_event(new_event.event_id, new_event.start_time, new_event.end_time);
+    }
+
+    printf("Enter the number of tasks for Event %s: ", new_event.event_name);
+    int num_tasks = 0;
+    if (read_int(&num_tasks) == -1) return;
+
+    for (int i = 1; i <= num_tasks; ++i) {
+        struct task new_task;
+
+        new_task.event_id = new_event.event_id;
+        new_task.task_id = i;
+
+        printf("Enter task description: ");
+        if (read_line(new_task.task_description, sizeof(new_task.task_description)) == -1) return;
+
+        printf("Enter the currency amount rewarded upon completion: ");
+        if (read_int(&new_task.currency_amount) == -1) return;
+
+        new_task.is_completed = 0;
+
+        sqlite3_stmt *stmt_insert_tasks = statement(shard, STMT_INSERT_TASKS);
+        sqlite3_bind_int(stmt_insert_tasks, 1, new_task.event_id);
+        sqlite3_bind_int(stmt_insert_tasks, 2, new_task.task_id);
+        sqlite3_bind_text(stmt_insert_tasks, 3, new_task.task_description, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt_insert_tasks, 4, new_task.currency_amount);
+        sqlite3_bind_int(stmt_insert_tasks, 5, new_task.is_completed);
+
+        rc = sqlite3_step(stmt_insert_tasks);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error adding task: %s\n", sqlite3_errmsg(shard));
+            sqlite3_reset(stmt_insert_tasks);
+            return;
+        }
+
+        sqlite3_reset(stmt_insert_tasks);
+        printf("Task %d added successfully\n", i);
+    }
+
+    if (num_tasks > 1) add_task_dependencies(shard, new_event.event_id, num_tasks);
+
+    printf("Enter the number of store items associated with this event: ");
+    int num_items = 0;
+    if (read_int(&num_items) == -1) return;
+
+    for (int i = 1; i <= num_items; ++i) {
+        struct store_item new_store_item;
+        char item_description[256];
+        char category[50];
+        new_store_item.item_description = item_description;
+        new_store_item.category = category;
+
+        new_store_item.item_id = i;
+
+        printf("Enter item description: ");
+        if (read_line(item_description, sizeof(item_description)) == -1) return;
+
+        printf("Enter cost of the item: ");
+        if (read_int(&new_store_item.cost) == -1) return;
+
+        new_store_item.event_id = new_event.event_id;
+
+        printf("Enter item stock(-1 for infinity): ");
+        if (read_int(&new_store_item.stock) == -1) return;
+
+        printf("Enter category: ");
+        if (read_line(category, sizeof(category)) == -1) return;
+
+        sqlite3_stmt *stmt_insert_store = statement(shard, STMT_INSERT_STORE);
+        sqlite3_bind_int(stmt_insert_store, 1, new_store_item.item_id);
+        sqlite3_bind_text(stmt_insert_store, 2, new_store_item.item_description, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt_insert_store, 3, new_store_item.cost);
+        sqlite3_bind_int(stmt_insert_store, 4, new_store_item.event_id);
+        sqlite3_bind_int(stmt_insert_store, 5, new_store_item.stock);
+        sqlite3_bind_text(stmt_insert_store, 6, new_store_item.category, -1, SQLITE_TRANSIENT);
+
+        rc = sqlite3_step(stmt_insert_store);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error adding item: %s\n", sqlite3_errmsg(shard));
+            sqlite3_reset(stmt_insert_store);
+            return;
+        }
+
+        sqlite3_reset(stmt_insert_store);
+        printf("Item %d added successfully\n", i);
+    }
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date (Howard Hinnant's algorithm)
+long days_from_civil(long year, int month, int day) {
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long year_of_era = year - era * 400;
+    long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+void put_two_digits(char *out, int value) {
+    out[0] = '0' + value / 10;
+    out[1] = '0' + value % 10;
+}
+
+int timestamp_broken_down(time_t t, struct tm *tm) {
+    return (timestamp_zone == TIMESTAMP_UTC ? gmtime_r(&t, tm) : localtime_r(&t, tm)) ? 0 : -1;
+}
+
+// Fills the calendar day containing t, and tm with t broken down. Returns 0,
+// 1 if the UTC offset changes during that day (a DST transition), in which
+// case only the offset is right for t and the day must not be cached, or -1
+// if t cannot be broken down.
+int timestamp_load_day(struct timestamp_day *day, time_t t, struct tm *tm_out) {
+    struct tm tm;
+    if (timestamp_broken_down(t, &tm) != 0) return -1;
+    *tm_out = tm;
+
+    long seconds_into_day = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+    long local_seconds = days_from_civil(tm.tm_year + 1900L, tm.tm_mon + 1, tm.tm_mday) * 86400 + seconds_into_day;
+    long utc_offset = local_seconds - (long)t;
+
+    day->start = t - seconds_into_day;
+    day->end = day->start + 24 * 3600;
+    strftime(day->date, sizeof(day->date), "%Y-%m-%d", &tm);
+
+    int offset_minutes = (utc_offset < 0 ? -utc_offset : utc_offset) / 60 % (24 * 60);
+    if (timestamp_zone == TIMESTAMP_UTC) snprintf(day->offset, sizeof(day->offset), "Z");
+    else snprintf(day->offset, sizeof(day->offset), "%c%02d:%02d", utc_offset < 0 ? '-' : '+', offset_minutes / 60, offset_minutes % 60);
+
+    // Midnight to midnight must be exactly 24 hours of wall clock
+    struct tm first_tm, last_tm;
+    if (timestamp_broken_down(day->start, &first_tm) != 0 || timestamp_broken_down(day->end - 1, &last_tm) != 0) return 1;
+    if (first_tm.tm_hour != 0 || first_tm.tm_min != 0 || first_tm.tm_sec != 0) return 1;
+    return last_tm.tm_hour == 23 && last_tm.tm_min == 59 && last_tm.tm_sec == 59 ? 0 : 1;
+}
+
+// Formats t in the configured zone and style. The date, and the day's UTC
+// offset, are cached per thread for the last few days formatted and the time
+// of day is computed from the offset into that day, so rendering timestamps
+// from the same few days does not go back to the timezone database.
+const char * format_timestamp(time_t t, char *buffer, size_t size) {
+    if (timestamp_style == TIMESTAMP_EPOCH) {
+        snprintf(buffer, size, "%lld", (long long)t);
+        return buffer;
+    }
+
+    struct timestamp_day *days = timestamp_days[timestamp_zone];
+    struct timestamp_day *day = NULL;
+    for (int i = 0; i < TIMESTAMP_CACHED_DAYS && !day; i++) {
+        if (days[i].is_valid && t >= days[i].start && t < days[i].end) day = &days[i];
+    }
+
+    if (!day) {
+        struct timestamp_day loaded;
+        struct tm tm;
+        int rc = timestamp_load_day(&loaded, t, &tm);
+        if (rc == -1) {
+            snprintf(buffer, size, "N/A");
+            return buffer;
+        }
+
+        if (rc == 1) {
+            // Offset taken from t itself, so it is right on either side of the change
+            const char *format = timestamp_style == TIMESTAMP_ISO8601 ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S";
+            size_t length = strftime(buffer, size, format, &tm);
+            if (timestamp_style == TIMESTAMP_ISO8601) snprintf(buffer + length, size - length, "%s", loaded.offset);
+            return buffer;
+        }
+
+        int *next = &timestamp_next_day[timestamp_zone];
+        day = &days[*next];
+        *next = (*next + 1) % TIMESTAMP_CACHED_DAYS;
+        *day = loaded;
+        day->is_valid = 1;
+    }
+
+    // "YYYY-MM-DD hh:mm:ss", plus the offset in ISO-8601
+    char formatted[TIMESTAMP_SIZE];
+    long seconds = t - day->start;
+    memcpy(formatted, day->date, 10);
+    formatted[10] = timestamp_style == TIMESTAMP_ISO8601 ? 'T' : ' ';
+    put_two_digits(formatted + 11, seconds / 3600);
+    formatted[13] = ':';
+    put_two_digits(formatted + 14, seconds / 60 % 60);
+    formatted[16] = ':';
+    put_two_digits(formatted + 17, seconds % 60);
+    formatted[19] = '\0';
+    if (timestamp_style == TIMESTAMP_ISO8601) strcat(formatted, day->offset);
+
+    size_t length = strlen(formatted);
+    if (length >= size) length = size - 1;
+    memcpy(buffer, formatted, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+void output_flush(void) {
+    if (output.length > 0) fwrite(output.buffer, 1, output.length, stdout);
+    output.length = 0;
+}
+
+static inline void output_byte(char c) {
+    if (output.length == OUTPUT_BUFFER_SIZE) output_flush();
+    output.buffer[output.length++] = c;
+}
+
+void output_bytes(const char *bytes, size_t length) {
+    if (output.length + length > OUTPUT_BUFFER_SIZE) output_flush();
+    if (length > OUTPUT_BUFFER_SIZE) {
+        fwrite(bytes, 1, length, stdout);
+        return;
+    }
+    memcpy(output.buffer + output.length, bytes, length);
+    output.length += length;
+}
+
+void output_literal(const char *text) {
+    output_bytes(text, strlen(text));
+}
+
+// Writes text as a JSON string body: quotes, backslashes and control
+// characters are escaped, everything else, UTF-8 included, passes through
+void output_json_escaped(const char *text, int length) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (int i = 0; i < length; ++i) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            output_byte('\\');
+            output_byte(c);
+        } else if (c == '\n') {
+            output_bytes("\\n", 2);
+        } else if (c == '\t') {
+            output_bytes("\\t", 2);
+        } else if (c == '\r') {
+            output_bytes("\\r", 2);
+        } else if (c < 0x20 || c == 0x7f) {
+            output_bytes("\\u00", 4);
+            output_byte(hex[c >> 4]);
+            output_byte(hex[c & 0xf]);
+        } else {
+            output_byte(c);
+        }
+    }
+}
+
+// TSV fields cannot hold tabs or line breaks, so those and the backslash are
+// written as escape sequences
+void output_tsv_escaped(const char *text, int length) {
+    for (int i = 0; i < length; ++i) {
+        char c = text[i];
+        if (c == '\t') output_bytes("\\t", 2);
+        else if (c == '\n') output_bytes("\\n", 2);
+        else if (c == '\r') output_bytes("\\r", 2);
+        else if (c == '\\') output_bytes("\\\\", 2);
+        else output_byte(c);
+    }
+}
+
+// Starts a record set named table whose rows have the given columns, which
+// must stay valid until output_end
+void output_begin(const char *table, const char *const *columns, int column_count) {
+    output.table = table;
+    output.columns = columns;
+    output.rows = 0;
+
+    if (output.format == OUTPUT_JSON) {
+        output_literal("{\"table\":\"");
+        output_literal(table);
+        output_literal("\",\"rows\":[");
+    } else if (output.format == OUTPUT_TSV) {
+        for (int i = 0; i < column_count; ++i) {
+            if (i > 0) output_byte('\t');
+            output_literal(columns[i]);
+        }
+        output_byte('\n');
+    }
+}
+
+void output_row_begin(void) {
+    output.fields = 0;
+
+    if (output.format == OUTPUT_JSON) {
+        if (output.rows > 0) output_byte(',');
+        output_byte('{');
+    } else if (output.format == OUTPUT_NDJSON) {
+        output_literal("{\"table\":\"");
+        output_literal(output.table);
+        output_byte('"');
+    }
+}
+
+// Separator and, in JSON, the key of the next field
+void output_field(void) {
+    if (output.format == OUTPUT_TSV) {
+        if (output.fields > 0) output_byte('\t');
+    } else {
+        if (output.fields > 0 || output.format == OUTPUT_NDJSON) output_byte(',');
+        output_byte('"');
+        output_literal(output.columns[output.fields]);
+        output_bytes("\":", 2);
+    }
+    output.fields++;
+}
+
+void output_int(sqlite3_int64 value) {
+    char digits[24];
+    output_field();
+    output_bytes(digits, snprintf(digits, sizeof(digits), "%lld", (long long)value));
+}
+
+void output_null(void) {
+    output_field();
+    if (output.format != OUTPUT_TSV) output_bytes("null", 4);
+}
+
+// length -1 writes up to the terminating NUL
+void output_text(const char *text, int length) {
+    if (!text) {
+        output_null();
+        return;
+    }
+    if (length < 0) length = strlen(text);
+
+    output_field();
+    if (output.format == OUTPUT_TSV) {
+        output_tsv_escaped(text, length);
+    } else {
+        output_byte('"');
+        output_json_escaped(text, length);
+        output_byte('"');
+    }
+}
+
+// Follows --timestamps: epoch seconds as a number, otherwise the formatted
+// text. -1, an event without a time limit, is null.
+void output_time(time_t t) {
+    if (t == -1) {
+        output_null();
+    } else if (timestamp_style == TIMESTAMP_EPOCH) {
+        output_int(t);
+    } else {
+        char time_str[TIMESTAMP_SIZE];
+        output_text(format_timestamp(t, time_str, sizeof(time_str)), -1);
+    }
+}
+
+void output_row_end(void) {
+    if (output.format == OUTPUT_JSON) {
+        output_byte('}');
+    } else {
+        if (output.format == OUTPUT_NDJSON) output_byte('}');
+        output_byte('\n');
+    }
+    output.rows++;
+}
+
+// Ends the record set and flushes it, so it never interleaves with prompts
+void output_end(void) {
+    if (output.format == OUTPUT_JSON) output_literal("]}\n");
+    else if (output.format == OUTPUT_TSV) output_byte('\n');
+    output_flush();
+    fflush(stdout);
+}
+
+void print_events_table(struct event *events, int event_count) {
+    if (output.format != OUTPUT_TABLE) {
+        static const char *const columns[] = { "event_id", "event_name", "currency_id", "is_time_limited", "start_time", "end_time", "is_active" };
+        output_begin("events", columns, sizeof(columns) / sizeof(columns[0]));
+        for (int i = 0; i < event_count; ++i) {
+            output_row_begin();
+            output_int(events[i].event_id);
+            output_text(events[i].event_name, -1);
+            output_int(events[i].currency_id);
+            output_int(events[i].is_time_limited);
+            output_time(events[i].start_time);
+            output_time(events[i].end_time);
+            output_int(events[i].is_active);
+            output_row_end();
+        }
+        output_end();
+        return;
+    }
+
+    int id_width = 10;
+    int name_width = 30;
+    int time_width = 30;
+
+    print_top_border(4, id_width, name_width, time_width, time_width);
+    print_table_row(4, "ID", id_width, "Name", name_width, "Start Time", time_width, "End Time", time_width);
+    print_row_separator(4, id_width, name_width, time_width, time_width);
+
+    for (int i = 0; i < event_count; ++i) {
+        char start_time_str[TIMESTAMP_SIZE] = "N/A";
+        char end_time_str[TIMESTAMP_SIZE] = "N/A";
+
+        if (events[i].start_time != -1 && events[i].end_time != -1) {
+            format_timestamp(events[i].start_time, start_time_str, sizeof(start_time_str));
+            format_timestamp(events[i].end_time, end_time_str, sizeof(end_time_str));
+        }
+
+        char id_str[10];
+        snprintf(id_str, sizeof(id_str), "%d", events[i].event_id);
+
+        print_table_row(4, id_str, id_width, events[i].event_name, name_width, start_time_str, time_width, end_time_str, time_width);
+
+        // if (i < event_count - 1) {
+        //     print_row_separator(4, id_width, name_width, time_width, time_width);
+        // }
+    }
+
+    print_bottom_border(4, id_width, name_width, time_width, time_width);
+}
+
+struct event * fetch_events(sqlite3 *db, sqlite3_stmt *stmt, int *event_count) {
+    int rc;
+    struct event *events = NULL;
+    *event_count = 0;
+    int event_capacity = 10;
+    events = malloc(event_capacity * sizeof(struct event));
+    if (!events) {
+        fprintf(stderr, "Unable to allocate memory for events.\n");
+        return NULL;
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (*event_count >= event_capacity) {
+            event_capacity *= 2;
+            struct event *new_events = realloc(events, event_capacity * sizeof(struct event));
+            if (!new_events) {
+                fprintf(stderr, "Unable to reallocate events.\n");
+                free(events);
+                return NULL;
+            }
+            events = new_events;
+        }
+
+        events[*event_count].event_id = sqlite3_column_int(stmt, 0);
+        const char *event_name = (const char *)sqlite3_column_text(stmt, 1);
+        strncpy(events[*event_count].event_name, event_name, sizeof(events[*event_count].event_name) - 1);
+        events[*event_count].event_name[sizeof(events[*event_count].event_name) - 1] = '\0';
+        events[*event_count].currency_id = sqlite3_column_int(stmt, 2);
+        events[*event_count].is_time_limited = sqlite3_column_int(stmt, 3);
+
+        if (sqlite3_column_type(stmt, 4) == SQLITE_NULL) {
+            events[*event_count].start_time = -1;
+        } else {
+            events[*event_count].start_time = sqlite3_column_int64(stmt, 4);
+        }
+
+        if (sqlite3_column_type(stmt, 5) == SQLITE_NULL) {
+            events[*event_count].end_time = -1;
+        } else {
+            events[*event_count].end_time = sqlite3_column_int64(stmt, 5);
+        }
+        
+        events[*event_count].is_active = sqlite3_column_int(stmt, 6);
+
+        (*event_count)++;
+    }
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error fetching active rows: %s\n", sqlite3_errmsg(db));
+        free(events);
+        sqlite3_reset(stmt);
+        return NULL;
+    }
+
+    sqlite3_reset(stmt);
+    return events;
+}
+
+struct event * get_active_events(sqlite3 *db, int *event_count) {
+    return fetch_events(db, statement(db, STMT_SELECT_ACTIVE_EVENTS), event_count);
+}
+
+struct event * get_pending_events(sqlite3 *db, int *event_count) {
+    return fetch_events(db, statement(db, STMT_SELECT_PENDING_EVENTS), event_count);
+}
+
+// Steps stmt for event_id and hands each row to visit without copying it.
+// Returns the number of rows visited, or -1 on error. A NULL visitor counts.
+int visit_tasks(sqlite3 *db, sqlite3_stmt *stmt, int event_id, task_visitor visit, void *context) {
+    int rc;
+    int visited = 0;
+
+    sqlite3_bind_int(stmt, 1, event_id);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct task_row row = {
+            .event_id = sqlite3_column_int(stmt, 0),
+            .task_id = sqlite3_column_int(stmt, 1),
+            .task_description = (const char *)sqlite3_column_text(stmt, 2),
+            .task_description_length = sqlite3_column_bytes(stmt, 2),
+            .currency_amount = sqlite3_column_int(stmt, 3),
+            .is_completed = sqlite3_column_int(stmt, 4),
+            // Archived tasks have no dependencies left
+            .remaining_prereqs = sqlite3_column_count(stmt) > 5 ? sqlite3_column_int(stmt, 5) : 0,
+        };
+
+        visited++;
+        if (visit && visit(&row, context)) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error fetching tasks: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    return visited;
+}
+
+int stop_at_first_task(const struct task_row *row, void *context) {
+    return 1;
+}
+
+struct task_lookup {
+    int task_id;
+    int currency_amount;
+};
+
+// Finds lookup->task_id among the visited rows; context is a task_lookup
+int find_task(const struct task_row *row, void *context) {
+    struct task_lookup *lookup = context;
+    if (row->task_id != lookup->task_id) return 0;
+
+    lookup->currency_amount = row->currency_amount;
+    return 1;
+}
+
+int print_task_row(const struct task_row *row, void *context) {
+    int *rows_printed = context;
+    int id_width = 10;
+    int desc_width = 100;
+    int amount_width = 20;
+
+    if ((*rows_printed)++ == 0) {
+        print_top_border(3, id_width, desc_width, amount_width);
+        print_table_row(3, "ID", id_width, "Task Description", desc_width, "Amount", amount_width);
+        print_row_separator(3, id_width, desc_width, amount_width);
+    }
+
+    char id_str[10];
+    snprintf(id_str, sizeof(id_str), "%d", row->task_id);
+
+    char amount_str[10];
+    snprintf(amount_str, sizeof(amount_str), "%d", row->currency_amount);
+
+    print_table_row(3, id_str, id_width, row->task_description, desc_width, amount_str, amount_width);
+    return 0;
+}
+
+const char *const task_columns[] = { "event_id", "task_id", "task_description", "currency_amount", "is_completed", "remaining_prereqs" };
+
+#define TASK_COLUMN_COUNT (sizeof(task_columns) / sizeof(task_columns[0]))
+
+int write_task_row(const struct task_row *row, void *context) {
+    output_row_begin();
+    output_int(row->event_id);
+    output_int(row->task_id);
+    output_text(row->task_description, row->task_description_length);
+    output_int(row->currency_amount);
+    output_int(row->is_completed);
+    output_int(row->remaining_prereqs);
+    output_row_end();
+    return 0;
+}
+
+// Prints the tasks stmt yields for event_id straight from the result rows,
+// and nothing at all when there are none. Returns the row count or -1.
+int print_tasks_table(sqlite3 *db, sqlite3_stmt *stmt, int event_id) {
+    if (output.format != OUTPUT_TABLE) {
+        output_begin("tasks", task_columns, TASK_COLUMN_COUNT);
+        int task_count = visit_tasks(db, stmt, event_id, write_task_row, NULL);
+        output_end();
+        return task_count;
+    }
+
+    int rows_printed = 0;
+    int task_count = visit_tasks(db, stmt, event_id, print_task_row, &rows_printed);
+
+    if (rows_printed > 0) print_bottom_border(3, 10, 100, 20);
+    return task_count;
+}
+
+struct currency * fetch_currencies(sqlite3 *db, int *currency_count) {
+    int rc;
+    struct currency *currencies;
+    *currency_count = 0;
+    int currency_capacity = 10;
+    currencies = malloc(currency_capacity * sizeof(struct currency));
+    if (!currencies) {
+        fprintf(stderr, "Failed to allocated memory for currencies.\n");
+        return NULL;
+    }
+
+    sqlite3_stmt *stmt_select_currency = statement(db, STMT_SELECT_CURRENCY);
+    while ((rc = sqlite3_step(stmt_select_currency)) == SQLITE_ROW) {
+        if (*currency_count >= currency_capacity) {
+            currency_capacity *= 2;
+            struct currency *new_currencies = realloc(currencies, currency_capacity * sizeof(struct currency));
+            if (!new_currencies) {
+                fprintf(stderr, "Failed to reallocate currencies.\n");
+                sqlite3_reset(stmt_select_currency);
+                free(currencies);
+                return NULL;
+            }
+            currencies = new_currencies;
+        }
+
+        currencies[*currency_count].currency_id = sqlite3_column_int(stmt_select_currency, 0);
+        const char *currency_name = (const char *)sqlite3_column_text(stmt_select_currency, 1);
+        strncpy(currencies[*currency_count].currency_name, currency_name, sizeof(currencies[*currency_count].currency_name) - 1);
+        currencies[*currency_count].currency_name[sizeof(currencies[*currency_count]) - 1] = '\0';
+        const char *symbol = (const char *)sqlite3_column_text(stmt_select_currency, 2);
+        strncpy(currencies[*currency_count].symbol, symbol, sizeof(currencies[*currency_count].symbol) - 1);
+        currencies[*currency_count].symbol[sizeof(currencies[*currency_count].symbol) - 1] = '\0';
+        currencies[*currency_count].balance = sqlite3_column_int(stmt_select_currency, 3);
+
+        (*currency_count)++;
+    }
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error fetching currencies: %s\n", sqlite3_errmsg(db));
+        free(currencies);
+        sqlite3_reset(statement(db, STMT_SELECT_INCOMPLETE_TASKS_OF_AN_EVENT));
+        return NULL;
+    }
+
+    sqlite3_reset(stmt_select_currency);
+    return currencies;
+}
+
+int currency_cache_find(int currency_id) {
+    for (int i = 0; i < currency_cache.currency_count; ++i) {
+        if (currency_cache.currencies[i].currency_id == currency_id) return i;
+    }
+    return -1;
+}
+
+void currency_cache_invalidate(void) {
+    free(currency_cache.currencies);
+    free(currency_cache.is_stale);
+    memset(&currency_cache, 0, sizeof(currency_cache));
+}
+
+void currency_cache_on_changes(const struct row_change *changes, int count) {
+    if (!currency_cache.is_loaded) return;
+    if (!changes) {
+        currency_cache.needs_reload = 1;
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (changes[i].table != CHANGE_CURRENCY) continue;
+
+        // The rowid of the currency table is its currency_id
+        int idx = changes[i].op == SQLITE_UPDATE ? currency_cache_find(changes[i].rowid) : -1;
+        if (idx == -1) {
+            currency_cache.needs_reload = 1;
+            return;
+        }
+        currency_cache.is_stale[idx] = 1;
+    }
+}
+
+// Sum of the writers' data_version; each only counts commits made through
+// other connections
+int writers_data_version(sqlite3 *db) {
+    int data_version = 0;
+    for (int i = 0; i < writer_count(); i++) data_version += select_pragma_int(statement(writer(db, i), STMT_SELECT_DATA_VERSION));
+    return data_version;
+}
+
+int currency_cache_reload(sqlite3 *db) {
+    int data_version = writers_data_version(db);
+    if (currency_cache.is_loaded && !currency_cache.needs_reload && data_version == currency_cache.data_version) return 0;
+
+    currency_cache_invalidate();
+    currency_cache.currencies = fetch_currencies(db, &currency_cache.currency_count);
+    if (!currency_cache.currencies) return -1;
+
+    currency_cache.is_stale = calloc(currency_cache.currency_count > 0 ? currency_cache.currency_count : 1, 1);
+    if (!currency_cache.is_stale) {
+        currency_cache_invalidate();
+        return -1;
+    }
+    currency_cache.data_version = data_version;
+    currency_cache.is_loaded = 1;
+    return 0;
+}
+
+int currency_cache_refresh_row(sqlite3 *db, struct currency *currency) {
+    sqlite3_stmt *stmt_select_currency_by_id = statement(db, STMT_SELECT_CURRENCY_BY_ID);
+    sqlite3_bind_int(stmt_select_currency_by_id, 1, currency->currency_id);
+
+    int rc = sqlite3_step(stmt_select_currency_by_id);
+    if (rc == SQLITE_ROW) {
+        const char *currency_name = (const char *)sqlite3_column_text(stmt_select_currency_by_id, 1);
+        snprintf(currency->currency_name, sizeof(currency->currency_name), "%s", currency_name);
+        const char *symbol = (const char *)sqlite3_column_text(stmt_select_currency_by_id, 2);
+        snprintf(currency->symbol, sizeof(currency->symbol), "%s", symbol);
+        currency->balance = sqlite3_column_int(stmt_select_currency_by_id, 3);
+    }
+    sqlite3_reset(stmt_select_currency_by_id);
+    return rc == SQLITE_ROW ? 0 : -1;
+}
+
+// Returns a copy of the currencies for the caller to free. Inside a transaction
+// with uncommitted changes the cache cannot be trusted and the table is read.
+struct currency * get_currencies(sqlite3 *db, int *currency_count) {
+    if (!sqlite3_get_autocommit(db) && change_feed.count > 0) return fetch_currencies(db, currency_count);
+
+    *currency_count = 0;
+    if (currency_cache_reload(db) != 0) return NULL;
+
+    for (int i = 0; i < currency_cache.currency_count; ++i) {
+        if (!currency_cache.is_stale[i]) continue;
+        if (currency_cache_refresh_row(db, &currency_cache.currencies[i]) != 0) {
+            // Gone or unreadable: start over on the next call
+            currency_cache.needs_reload = 1;
+            return fetch_currencies(db, currency_count);
+        }
+        currency_cache.is_stale[i] = 0;
+    }
+
+    size_t size = currency_cache.currency_count * sizeof(struct currency);
+    struct currency *currencies = malloc(size > 0 ? size : 1);
+    if (!currencies) {
+        fprintf(stderr, "Failed to allocated memory for currencies.\n");
+        return NULL;
+    }
+    memcpy(currencies, currency_cache.currencies, size);
+    *currency_count = currency_cache.currency_count;
+    return currencies;
+}
+
+void print_currency_table(struct currency *currencies, int currency_count) {
+    if (output.format != OUTPUT_TABLE) {
+        static const char *const columns[] = { "currency_id", "currency_name", "symbol", "balance" };
+        output_begin("currencies", columns, sizeof(columns) / sizeof(columns[0]));
+        for (int i = 0; i < currency_count; ++i) {
+            output_row_begin();
+            output_int(currencies[i].currency_id);
+            output_text(currencies[i].currency_name, -1);
+            output_text(currencies[i].symbol, -1);
+            output_int(currencies[i].balance);
+            output_row_end();
+        }
+        output_end();
+        return;
+    }
+
+    int id_width = 10;
+    int name_width = 20;
+    int symbol_width = 10;
+    int balance_width = 20;
+
+    print_top_border(4, id_width, name_width, symbol_width, balance_width);
+    print_table_row(4, "ID", id_width, "Name", name_width, "Symbol", symbol_width, "Balance", balance_width);
+    print_row_separator(4, id_width, name_width, symbol_width, balance_width);
+
+    for (int i = 0; i < currency_count; ++i) {
+        char id_str[10];
+        snprintf(id_str, sizeof(id_str), "%d", currencies[i].currency_id);
+
+        char bal_str[10];
+        snprintf(bal_str, sizeof(bal_str), "%d", currencies[i].balance);
+
+        print_table_row(4, id_str, id_width, currencies[i].currency_name, name_width, currencies[i].symbol, symbol_width, bal_str, balance_width);
+    }
+
+    print_bottom_border(4, id_width, name_width, symbol_width, balance_width);
+}
+
+// Returns the prepared statement for id, preparing it on first use. NULL on a
+// prepare error, which the sqlite3_* calls it is passed to reject as misuse.
+// Each shard connection has a registry of its own
+struct statement *statement_table(sqlite3 *db) {
+    for (int k = 0; k < shard_count; k++) {
+        if (shards[k].db == db) return shards[k].statements;
+    }
+    return statements;
+}
+
+sqlite3_stmt *statement(sqlite3 *db, int id) {
+    struct statement *entry = &statement_table(db)[id];
+
+    if (!entry->stmt) {
+        int rc = sqlite3_prepare_v3(db, *entry->sql, -1, entry->prepare_flags, &entry->stmt, NULL);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Failed to prepare statement %s: %s\n", entry->name, sqlite3_errmsg(db));
+            return NULL;
+        }
+    }
+
+    entry->uses++;
+    return entry->stmt;
+}
+
+void print_change_feed_stats(void) {
+    int count_width = 14;
+    int fifo_width = 30;
+
+    char commits_str[24];
+    snprintf(commits_str, sizeof(commits_str), "%llu", change_feed.sequence);
+
+    char changes_str[24];
+    snprintf(changes_str, sizeof(changes_str), "%llu", change_feed.published_changes);
+
+    char dropped_str[24];
+    snprintf(dropped_str, sizeof(dropped_str), "%llu", change_feed.dropped);
+
+    const char *fifo = !change_feed.fifo_path ? "-" : change_feed.fifo_fd != -1 ? "connected" : "no reader";
+
+    printf("Change feed\n");
+    print_top_border(4, count_width, count_width, count_width, fifo_width);
+    print_table_row(4, "Commits", count_width, "Row changes", count_width, "Dropped", count_width, "FIFO", fifo_width);
+    print_row_separator(4, count_width, count_width, count_width, fifo_width);
+    print_table_row(4, commits_str, count_width, changes_str, count_width, dropped_str, count_width, fifo, fifo_width);
+    print_bottom_border(4, count_width, count_width, count_width, fifo_width);
+}
+
+void statements_finalize(void) {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(statements[i].stmt);
+        statements[i].stmt = NULL;
+    }
+}
+
+void print_statement_stats(void) {
+    int name_width = 40;
+    int uses_width = 12;
+
+    printf("Statements\n");
+    print_top_border(2, name_width, uses_width);
+    print_table_row(2, "Statement", name_width, "Uses", uses_width);
+    print_row_separator(2, name_width, uses_width);
+
+    for (int i = 0; i < STMT_COUNT; i++) {
+        unsigned long uses = statements[i].uses;
+        for (int k = 0; k < shard_count; k++) uses += shards[k].statements[i].uses;
+        if (!uses) continue;
+
+        char uses_str[24];
+        snprintf(uses_str, sizeof(uses_str), "%lu", uses);
+
+        print_table_row(2, statements[i].name, name_width, uses_str, uses_width);
+    }
+
+    print_bottom_border(2, name_width, uses_width);
+}
+
+int step_transaction_statement(sqlite3 *db, sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Transaction error: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+void sleep_ms(int ms) {
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&delay, NULL);
+}
+
+// Called by SQLite while another connection holds a conflicting lock. Sleeps in
+// growing steps until busy_timeout_ms have passed, then lets the statement
+// fail with SQLITE_BUSY. A pending shutdown stops the wait early.
+int busy_handler(void *context, int count) {
+    static const int delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+    int steps = sizeof(delays) / sizeof(delays[0]);
+
+    if (count == 0) contention.busy_events++;
+
+    int waited = 0;
+    for (int i = 0; i < count; i++) waited += delays[i < steps ? i : steps - 1];
+    int delay = delays[count < steps ? count : steps - 1];
+    if (waited + delay > busy_timeout_ms) delay = busy_timeout_ms - waited;
+
+    if (delay <= 0 || shutdown_requested) {
+        contention.busy_timeouts++;
+        return 0;
+    }
+
+    sleep_ms(delay);
+    contention.busy_sleeps++;
+    contention.busy_wait_ms += delay;
+    return 1;
+}
+
+void contention_init(sqlite3 *db) {
+    sqlite3_busy_handler(db, busy_handler, NULL);
+    srandom(time(NULL) ^ getpid());
+}
+
+// A deferred BEGIN that reads first and upgrades to a write lock later can
+// deadlock with another writer, and SQLite fails one of them without waiting.
+// BEGIN IMMEDIATE waits in the busy handler instead. Returns 0, -1 on error or
+// TRANSACTION_BUSY if the lock could not be had in time.
+int begin_transaction(sqlite3 *db) {
+    if (step_transaction_statement(db, statement(db, STMT_BEGIN_TRANSACTION)) == 0) return 0;
+    return sqlite3_errcode(db) == SQLITE_BUSY ? TRANSACTION_BUSY : -1;
+}
+
+// Rolls back after a failed statement. Returns TRANSACTION_BUSY if that
+// statement was refused a lock, so the caller can retry the transaction, and
+// -1 otherwise.
+int rollback_transaction(sqlite3 *db) {
+    int busy = sqlite3_errcode(db) == SQLITE_BUSY;
+    step_transaction_statement(db, statement(db, STMT_ROLLBACK_TRANSACTION));
+    return busy ? TRANSACTION_BUSY : -1;
+}
+
+// Sleeps before the next attempt of a transaction that failed with
+// TRANSACTION_BUSY: exponential backoff with jitter, so writers that collided
+// do not retry in lockstep. Returns 0 once the attempts are used up.
+int transaction_backoff(int *attempt) {
+    if (++*attempt >= TRANSACTION_ATTEMPTS || shutdown_requested) {
+        contention.retries_exhausted++;
+        fprintf(stderr, "Database still busy after %d attempts, giving up.\n", *attempt);
+        return 0;
+    }
+
+    int delay = TRANSACTION_BACKOFF_MS << (*attempt - 1);
+    delay = delay / 2 + random() % (delay / 2 + 1);
+    contention.retries++;
+    fprintf(stderr, "Database busy, retrying in %d ms.\n", delay);
+    sleep_ms(delay);
+    return 1;
+}
+
+void print_contention_stats(void) {
+    int count_width = 12;
+    unsigned long counts[] = {
+        contention.busy_events, contention.busy_sleeps, contention.busy_wait_ms,
+        contention.busy_timeouts, contention.retries, contention.retries_exhausted
+    };
+    char count_strs[6][24];
+    for (int i = 0; i < 6; i++) snprintf(count_strs[i], sizeof(count_strs[i]), "%lu", counts[i]);
+
+    printf("Contention\n");
+    print_top_border(6, count_width, count_width, count_width, count_width, count_width, count_width);
+    print_table_row(6, "Busy", count_width, "Waits", count_width, "Waited ms", count_width, "Timeouts", count_width, "Retries", count_width, "Gave up", count_width);
+    print_row_separator(6, count_width, count_width, count_width, count_width, count_width, count_width);
+    print_table_row(6, count_strs[0], count_width, count_strs[1], count_width, count_strs[2], count_width, count_strs[3], count_width, count_strs[4], count_width, count_strs[5], count_width);
+    print_bottom_border(6, count_width, count_width, count_width, count_width, count_width, count_width);
+}
+
+// Steps a guarded single-row UPDATE ... RETURNING, where the guard and the write
+// happen in the same statement. Returns 1 and sets *value if the guard matched,
+// 0 if no row qualified and -1 on error.
+int step_returning_int(sqlite3_stmt *stmt, int *value) {
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *value = sqlite3_column_int(stmt, 0);
+        sqlite3_reset(stmt);
+        return 1;
+    }
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+uint64_t operation_id_hash(const char *operation_id) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)operation_id; *c; ++c) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void operation_bloom_add(const char *operation_id) {
+    uint64_t hash = operation_id_hash(operation_id);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+    for (uint32_t i = 0; i < OPERATION_BLOOM_PROBES; ++i) {
+        uint32_t bit = (h1 + i * h2) % OPERATION_BLOOM_BITS;
+        operation_bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+int operation_bloom_may_contain(const char *operation_id) {
+    uint64_t hash = operation_id_hash(operation_id);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+    for (uint32_t i = 0; i < OPERATION_BLOOM_PROBES; ++i) {
+        uint32_t bit = (h1 + i * h2) % OPERATION_BLOOM_BITS;
+        if (!(operation_bloom[bit / 8] & (1 << (bit % 8)))) return 0;
+    }
+    return 1;
+}
+
+int operation_bloom_load(sqlite3 *db) {
+    if (operation_bloom_loaded) return 0;
+
+    int rc;
+    sqlite3_stmt *stmt_select_all_operation_ids = statement(db, STMT_SELECT_ALL_OPERATION_IDS);
+    while ((rc = sqlite3_step(stmt_select_all_operation_ids)) == SQLITE_ROW) {
+        operation_bloom_add((const char *)sqlite3_column_text(stmt_select_all_operation_ids, 0));
+    }
+    sqlite3_reset(stmt_select_all_operation_ids);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error loading operation IDs: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    operation_bloom_loaded = 1;
+    return 0;
+}
+
+// Asks for an optional client operation ID. Returns 1 if one was entered, 0 if
+// not and -1 if the prompt was interrupted.
+int read_operation_id(char *operation_id, int size) {
+    printf("Enter operation ID (leave blank for none): ");
+    if (read_line(operation_id, size) == -1) {
+        operation_id[0] = '\0';
+        return -1;
+    }
+    return operation_id[0] != '\0';
+}
+
+// Prints the stored result of an applied operation. Returns 1 if it was found,
+// 0 if not and -1 on error.
+int lookup_applied_operation(sqlite3 *db, const char *operation_id) {
+    sqlite3_stmt *stmt_select_applied_operation = statement(db, STMT_SELECT_APPLIED_OPERATION);
+    sqlite3_bind_text(stmt_select_applied_operation, 1, operation_id, -1, SQLITE_TRANSIENT);
+
+    int rc = sqlite3_step(stmt_select_applied_operation);
+    if (rc == SQLITE_ROW) {
+        printf("Operation %s was already applied: %s\n", operation_id, (const char *)sqlite3_column_text(stmt_select_applied_operation, 0));
+        sqlite3_reset(stmt_select_applied_operation);
+        return 1;
+    }
+    sqlite3_reset(stmt_select_applied_operation);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error looking up operation %s: %s\n", operation_id, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+// Same as lookup_applied_operation, but answers "not applied" from the bloom
+// filter when it can. Another process may have applied the ID after the filter
+// was loaded; commit_operation still catches that case.
+int operation_already_applied(sqlite3 *db, const char *operation_id) {
+    if (operation_bloom_load(db) != 0) return -1;
+    if (!operation_bloom_may_contain(operation_id)) return 0;
+    return lookup_applied_operation(db, operation_id);
+}
+
+// Records the operation inside the caller's transaction. Returns 1 if recorded,
+// 0 if the ID had already been applied (the caller must roll back) and -1 on error.
+int record_operation(sqlite3 *db, const char *operation_id, const char *result) {
+    sqlite3_stmt *stmt_insert_applied_operation = statement(db, STMT_INSERT_APPLIED_OPERATION);
+    sqlite3_bind_text(stmt_insert_applied_operation, 1, operation_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt_insert_applied_operation, 2, time(NULL));
+    sqlite3_bind_text(stmt_insert_applied_operation, 3, result, -1, SQLITE_TRANSIENT);
+
+    int rc = sqlite3_step(stmt_insert_applied_operation);
+    sqlite3_reset(stmt_insert_applied_operation);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error recording operation %s: %s\n", operation_id, sqlite3_errmsg(db));
+        return -1;
+    }
+
+    return sqlite3_changes(db) == 1;
+}
+
+// Commits the caller's transaction, recording the operation ID (if any) as part
+// of it. If the ID turns out to be applied already, or anything fails, the
+// transaction is rolled back and -1 returned, or TRANSACTION_BUSY when it was
+// for a lock; for duplicates the original result is printed.
+int commit_operation(sqlite3 *db, const char *operation_id, const char *result) {
+    int has_operation_id = operation_id && operation_id[0];
+
+    if (has_operation_id) {
+        int rc = record_operation(db, operation_id, result);
+        if (rc != 1) {
+            if (rc == -1) return rollback_transaction(db);
+
+            step_transaction_statement(db, statement(db, STMT_ROLLBACK_TRANSACTION));
+            operation_bloom_add(operation_id);
+            lookup_applied_operation(db, operation_id);
+            return -1;
+        }
+    }
+
+    // A COMMIT refused for readers still on the file is rolled back and the
+    // whole transaction retried by the caller
+    if (step_transaction_statement(db, statement(db, STMT_COMMIT_TRANSACTION)) != 0) return rollback_transaction(db);
+
+    if (has_operation_id) operation_bloom_add(operation_id);
+    return 0;
+}
+
+// Records a credit to an expiring currency as a lot, inside the caller's
+// transaction. Credits to other currencies are left alone. Returns 0 or -1.
+int add_currency_lot(sqlite3 *db, int currency_id, sqlite3_int64 amount, time_t now) {
+    sqlite3_stmt *stmt_insert_currency_lot = statement(db, STMT_INSERT_CURRENCY_LOT);
+    sqlite3_bind_int(stmt_insert_currency_lot, 1, currency_id);
+    sqlite3_bind_int64(stmt_insert_currency_lot, 2, now);
+    sqlite3_bind_int64(stmt_insert_currency_lot, 3, amount);
+
+    int rc = sqlite3_step(stmt_insert_currency_lot);
+    sqlite3_reset(stmt_insert_currency_lot);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error recording currency lot: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+// Spends amount from a currency's lots, the one expiring first first, inside
+// the caller's transaction. Only the lots touched are read. Returns 0 or -1.
+int consume_currency_lots(sqlite3 *db, int currency_id, sqlite3_int64 amount) {
+    while (amount > 0) {
+        sqlite3_stmt *stmt_select_oldest_currency_lot = statement(db, STMT_SELECT_OLDEST_CURRENCY_LOT);
+        sqlite3_bind_int(stmt_select_oldest_currency_lot, 1, currency_id);
+        int rc = sqlite3_step(stmt_select_oldest_currency_lot);
+        sqlite3_int64 lot_id = sqlite3_column_int64(stmt_select_oldest_currency_lot, 0);
+        sqlite3_int64 remaining = sqlite3_column_int64(stmt_select_oldest_currency_lot, 1);
+        sqlite3_reset(stmt_select_oldest_currency_lot);
+
+        // Currencies that never expire have no lots
+        if (rc == SQLITE_DONE) return 0;
+        if (rc != SQLITE_ROW) break;
+
+        sqlite3_stmt *stmt;
+        if (remaining <= amount) {
+            stmt = statement(db, STMT_DELETE_CURRENCY_LOT);
+            sqlite3_bind_int64(stmt, 1, lot_id);
+            amount -= remaining;
+        } else {
+            stmt = statement(db, STMT_CONSUME_CURRENCY_LOT);
+            sqlite3_bind_int64(stmt, 1, amount);
+            sqlite3_bind_int64(stmt, 2, lot_id);
+            amount = 0;
+        }
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) break;
+    }
+
+    if (amount > 0) {
+        fprintf(stderr, "Error spending currency lots: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+// Debits the currencies of up to LOT_EXPIRY_BATCH lapsed lots and deletes
+// the lots, inside the caller's transaction. Returns the number retired or -1.
+int retire_lapsed_lots(sqlite3 *db, time_t now) {
+    sqlite3_stmt *batch[] = {
+        statement(db, STMT_DEBIT_LAPSED_LOTS),
+        statement(db, STMT_DELETE_LAPSED_LOTS)
+    };
+
+    for (int i = 0; i < sizeof(batch) / sizeof(batch[0]); i++) {
+        sqlite3_bind_int64(batch[i], 1, now);
+        sqlite3_bind_int(batch[i], 2, LOT_EXPIRY_BATCH);
+
+        int rc = sqlite3_step(batch[i]);
+        sqlite3_reset(batch[i]);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error expiring currency lots: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+    }
+    return sqlite3_changes(db);
+}
+
+// Retires lapsed lots at most once per LOT_EXPIRY_INTERVAL, a batch per
+// transaction so no single sweep holds the write lock for long.
+void expire_currency_lots(sqlite3 *db) {
+    time_t now = time(NULL);
+    if (now - last_lot_expiry < LOT_EXPIRY_INTERVAL) return;
+    last_lot_expiry = now;
+
+    int total = 0;
+    for (int i = 0; i < writer_count(); i++) {
+        sqlite3 *shard = writer(db, i);
+        int retired;
+        do {
+            if (begin_transaction(shard) != 0) break;
+
+            retired = retire_lapsed_lots(shard, now);
+            if (retired == -1) {
+                step_transaction_statement(shard, statement(shard, STMT_ROLLBACK_TRANSACTION));
+                break;
+            }
+
+            if (step_transaction_statement(shard, statement(shard, STMT_COMMIT_TRANSACTION)) != 0) {
+                step_transaction_statement(shard, statement(shard, STMT_ROLLBACK_TRANSACTION));
+                break;
+            }
+            total += retired;
+        } while (retired == LOT_EXPIRY_BATCH);
+    }
+
+    // The debits bypass affordability_set_balance
+    if (total > 0) affordability_invalidate();
+}
+
+// Returns the units of up to HOLD_RELEASE_BATCH lapsed holds to the store and
+// deletes the holds, inside the caller's transaction. Returns the number
+// released or -1.
+int release_lapsed_holds(sqlite3 *db, time_t now) {
+    sqlite3_stmt *batch[] = {
+        statement(db, STMT_RELEASE_LAPSED_HOLDS),
+        statement(db, STMT_DELETE_LAPSED_HOLDS)
+    };
+
+    for (int i = 0; i < sizeof(batch) / sizeof(batch[0]); i++) {
+        sqlite3_bind_int64(batch[i], 1, now);
+        sqlite3_bind_int(batch[i], 2, HOLD_RELEASE_BATCH);
+
+        int rc = sqlite3_step(batch[i]);
+        sqlite3_reset(batch[i]);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error releasing stock holds: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+    }
+    return sqlite3_changes(db);
+}
+
+// Fired by the scheduler when the earliest hold lapses. Releases every lapsed
+// hold, a batch per transaction, then schedules the next expiry.
+void expire_stock_holds(sqlite3 *db) {
+    time_t now = time(NULL);
+    int total = 0;
+    scheduled_hold_expiry = 0;
+
+    for (int i = 0; i < writer_count(); i++) {
+        sqlite3 *shard = writer(db, i);
+        int released;
+        do {
+            if (begin_transaction(shard) != 0) break;
+
+            released = release_lapsed_holds(shard, now);
+            if (released == -1) {
+                step_transaction_statement(shard, statement(shard, STMT_ROLLBACK_TRANSACTION));
+                break;
+            }
+
+            if (step_transaction_statement(shard, statement(shard, STMT_COMMIT_TRANSACTION)) != 0) {
+                step_transaction_statement(shard, statement(shard, STMT_ROLLBACK_TRANSACTION));
+                break;
+            }
+            total += released;
+        } while (released == HOLD_RELEASE_BATCH);
+    }
+
+    // Released units can bring sold-out items back
+    if (total > 0) affordability_invalidate();
+    scheduler_schedule_next_hold_expiry(db);
+}
+
+// Deletes operation IDs older than OPERATION_ID_TTL, at most once per
+// OPERATION_PURGE_INTERVAL and in small batches so no single delete holds the
+// write lock for long.
+void purge_expired_operations(sqlite3 *db) {
+    time_t now = time(NULL);
+    if (now - last_operation_purge < OPERATION_PURGE_INTERVAL) return;
+    last_operation_purge = now;
+
+    for (int i = 0; i < writer_count(); i++) {
+        sqlite3 *shard = writer(db, i);
+        int rc;
+        do {
+            sqlite3_stmt *stmt_purge_expired_operations = statement(shard, STMT_PURGE_EXPIRED_OPERATIONS);
+            sqlite3_bind_int64(stmt_purge_expired_operations, 1, now - OPERATION_ID_TTL);
+            sqlite3_bind_int(stmt_purge_expired_operations, 2, OPERATION_PURGE_BATCH);
+
+            rc = sqlite3_step(stmt_purge_expired_operations);
+            sqlite3_reset(stmt_purge_expired_operations);
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "Error purging expired operations: %s\n", sqlite3_errmsg(shard));
+                break;
+            }
+        } while (sqlite3_changes(shard) == OPERATION_PURGE_BATCH);
+    }
+}
+
+// Moves ended events, with their tasks and store items, to the archive database,
+// ARCHIVE_BATCH events per transaction so no batch holds the write lock for long.
+void archive_inactive_events(sqlite3 *db) {
+    time_t now = time(NULL);
+    if (now - last_archive_run < ARCHIVE_INTERVAL) return;
+    last_archive_run = now;
+
+    for (int i = 0; i < writer_count(); i++) archive_events_of(writer(db, i), now);
+}
+
+// One shard's part of archive_inactive_events; each has the archive attached
+void archive_events_of(sqlite3 *db, time_t now) {
+    sqlite3_stmt *batch[] = {
+        statement(db, STMT_ARCHIVE_EVENTS),
+        statement(db, STMT_ARCHIVE_TASKS),
+        statement(db, STMT_ARCHIVE_STORE),
+        statement(db, STMT_DELETE_ARCHIVED_TASK_DEPENDENCIES),
+        statement(db, STMT_DELETE_ARCHIVED_STOCK_HOLDS),
+        statement(db, STMT_DELETE_ARCHIVED_TASKS),
+        statement(db, STMT_DELETE_ARCHIVED_STORE),
+        statement(db, STMT_DELETE_ARCHIVED_EVENTS)
+    };
+
+    int archived;
+    do {
+        if (begin_transaction(db) != 0) return;
+
+        for (int i = 0; i < sizeof(batch) / sizeof(batch[0]); i++) {
+            sqlite3_bind_int(batch[i], 1, ARCHIVE_BATCH);
+            if (i == 0) sqlite3_bind_int64(batch[i], 2, now);
+
+            int rc = sqlite3_step(batch[i]);
+            sqlite3_reset(batch[i]);
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "Error archiving events: %s\n", sqlite3_errmsg(db));
+                step_transaction_statement(db, statement(db, STMT_ROLLBACK_TRANSACTION));
+                return;
+            }
+        }
+        archived = sqlite3_changes(db);
+
+        if (step_transaction_statement(db, statement(db, STMT_COMMIT_TRANSACTION)) != 0) {
+            step_transaction_statement(db, statement(db, STMT_ROLLBACK_TRANSACTION));
+            return;
+        }
+    } while (archived == ARCHIVE_BATCH);
+}
+
+// Recompiles the reward rules if reward_rules_version changed since the last
+// compile. Returns 0, or -1 if the rules could not be read.
+int reward_rules_load(sqlite3 *db) {
+    int version = select_pragma_int(statement(db, STMT_SELECT_REWARD_RULES_VERSION));
+    if (version == -1) return -1;
+    if (reward_rules.is_compiled && version == reward_rules.version) return 0;
+
+    struct reward_rule *rules = NULL;
+    int count = 0;
+    int capacity = 0;
+    int needs_streak = 0;
+
+    int rc;
+    sqlite3_stmt *stmt_select_reward_rules = statement(db, STMT_SELECT_REWARD_RULES);
+    while ((rc = sqlite3_step(stmt_select_reward_rules)) == SQLITE_ROW) {
+        if (count >= capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            struct reward_rule *new_rules = realloc(rules, capacity * sizeof(struct reward_rule));
+            if (!new_rules) {
+                fprintf(stderr, "Unable to allocate memory for reward rules.\n");
+                sqlite3_reset(stmt_select_reward_rules);
+                free(rules);
+                return -1;
+            }
+            rules = new_rules;
+        }
+
+        struct reward_rule *rule = &rules[count];
+        memset(rule, 0, sizeof(*rule));
+        rule->rule_id = sqlite3_column_int(stmt_select_reward_rules, 0);
+        rule->kind = strcmp((const char *)sqlite3_column_text(stmt_select_reward_rules, 1), "bonus") == 0 ? REWARD_RULE_BONUS : REWARD_RULE_MULTIPLY;
+        rule->value = sqlite3_column_int(stmt_select_reward_rules, 2);
+
+        if (sqlite3_column_type(stmt_select_reward_rules, 3) != SQLITE_NULL) {
+            rule->match |= REWARD_MATCH_EVENT;
+            rule->event_id = sqlite3_column_int(stmt_select_reward_rules, 3);
+        }
+        if (sqlite3_column_type(stmt_select_reward_rules, 4) != SQLITE_NULL) {
+            rule->match |= REWARD_MATCH_CURRENCY;
+            rule->currency_id = sqlite3_column_int(stmt_select_reward_rules, 4);
+        }
+        if (sqlite3_column_type(stmt_select_reward_rules, 5) != SQLITE_NULL) {
+            rule->match |= REWARD_MATCH_WEEKDAYS;
+            rule->weekdays = sqlite3_column_int(stmt_select_reward_rules, 5) & 0x7f;
+        }
+        if (sqlite3_column_type(stmt_select_reward_rules, 6) != SQLITE_NULL) {
+            rule->match |= REWARD_MATCH_START;
+            rule->start_time = sqlite3_column_int64(stmt_select_reward_rules, 6);
+        }
+        if (sqlite3_column_type(stmt_select_reward_rules, 7) != SQLITE_NULL) {
+            rule->match |= REWARD_MATCH_END;
+            rule->end_time = sqlite3_column_int64(stmt_select_reward_rules, 7);
+        }
+        if (sqlite3_column_type(stmt_select_reward_rules, 8) != SQLITE_NULL) {
+            rule->match |= REWARD_MATCH_STREAK;
+            rule->min_streak = sqlite3_column_int(stmt_select_reward_rules, 8);
+            needs_streak = 1;
+        }
+
+        // A negative multiplier would turn a credit into a debit
+        if (rule->kind == REWARD_RULE_MULTIPLY && rule->value < 0) {
+            fprintf(stderr, "Ignoring reward rule %d: negative multiplier.\n", rule->rule_id);
+            continue;
+        }
+        count++;
+    }
+    sqlite3_reset(stmt_select_reward_rules);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error loading reward rules: %s\n", sqlite3_errmsg(db));
+        free(rules);
+        return -1;
+    }
+
+    free(reward_rules.rules);
+    reward_rules.rules = rules;
+    reward_rules.count = count;
+    reward_rules.version = version;
+    reward_rules.needs_streak = needs_streak;
+    reward_rules.is_compiled = 1;
+    return 0;
+}
+
+void reward_rules_free(void) {
+    free(reward_rules.rules);
+    memset(&reward_rules, 0, sizeof(reward_rules));
+}
+
+// Loads the rules and fills the parts of the context shared by every task of
+// an operation; callers set event, task and currency. db must see the rules
+// and the streak counter, which with shards is the main connection.
+int reward_context_init(sqlite3 *db, struct reward_context *context) {
+    if (reward_rules_load(db) != 0) return -1;
+
+    struct tm tm;
+    memset(context, 0, sizeof(*context));
+    context->now = time(NULL);
+    if (timestamp_broken_down(context->now, &tm) != 0) return -1;
+    context->weekday = tm.tm_wday;
+    context->day = days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    if (reward_rules.needs_streak) {
+        sqlite3_stmt *stmt_select_daily_streak = statement(db, STMT_SELECT_DAILY_STREAK);
+        if (sqlite3_step(stmt_select_daily_streak) == SQLITE_ROW) context->streak = sqlite3_column_int(stmt_select_daily_streak, 0);
+        sqlite3_reset(stmt_select_daily_streak);
+    }
+    return 0;
+}
+
+// Runs the compiled rules over a base reward. Writes the IDs of the rules that
+// matched to applied, ending in "..." if they do not all fit, and returns the
+// amount to credit. The running total is kept within what a balance holds
+// after every rule, so a chain of multipliers cannot overflow.
+int reward_rules_apply(const struct reward_context *context, int amount, char *applied, size_t applied_size) {
+    sqlite3_int64 total = amount;
+    size_t length = 0;
+    int truncated = 0;
+    applied[0] = '\0';
+
+    for (int i = 0; i < reward_rules.count; ++i) {
+        const struct reward_rule *rule = &reward_rules.rules[i];
+        if ((rule->match & REWARD_MATCH_EVENT) && rule->event_id != context->event_id) continue;
+        if ((rule->match & REWARD_MATCH_CURRENCY) && rule->currency_id != context->currency_id) continue;
+        if ((rule->match & REWARD_MATCH_WEEKDAYS) && !(rule->weekdays & (1 << context->weekday))) continue;
+        if ((rule->match & REWARD_MATCH_START) && context->now < rule->start_time) continue;
+        if ((rule->match & REWARD_MATCH_END) && context->now >= rule->end_time) continue;
+        if ((rule->match & REWARD_MATCH_STREAK) && context->streak < rule->min_streak) continue;
+
+        if (rule->kind == REWARD_RULE_MULTIPLY) total = total * rule->value / 100;
+        else total += rule->value;
+        if (total < 0) total = 0;
+        if (total > INT32_MAX) total = INT32_MAX;
+
+        // Room is kept for the ",..." marker
+        char id[16];
+        int id_length = snprintf(id, sizeof(id), "%s%d", length ? "," : "", rule->rule_id);
+        if (!truncated && length + id_length + 4 < applied_size) {
+            memcpy(applied + length, id, id_length + 1);
+            length += id_length;
+        } else {
+            truncated = 1;
+        }
+    }
+
+    if (truncated) {
+        snprintf(applied + length, applied_size - length, "%s...", length ? "," : "");
+        fprintf(stderr, "Too many reward rules matched task %d to list them all in the ledger.\n", context->task_id);
+    }
+
+    if (total < 0) total = 0;
+    return (int)total;
+}
+
+// Writes the ledger entry of one credited completion, inside the caller's
+// transaction. Returns 0 or -1.
+int record_reward(sqlite3 *db, const struct reward_context *context, int base_amount, int amount, const char *applied) {
+    sqlite3_stmt *stmt_insert_reward_ledger = statement(db, STMT_INSERT_REWARD_LEDGER);
+    sqlite3_bind_int64(stmt_insert_reward_ledger, 1, context->now);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 2, context->day);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 3, context->event_id);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 4, context->task_id);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 5, context->currency_id);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 6, base_amount);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 7, amount);
+    sqlite3_bind_text(stmt_insert_reward_ledger, 8, applied, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt_insert_reward_ledger, 9, reward_rules.version);
+
+    int rc = sqlite3_step(stmt_insert_reward_ledger);
+    sqlite3_reset(stmt_insert_reward_ledger);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error recording reward: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+int compare_achievements(const void *a, const void *b) {
+    const struct achievement *x = a;
+    const struct achievement *y = b;
+    if (x->metric != y->metric) return x->metric - y->metric;
+    if (x->currency_id != y->currency_id) return x->currency_id < y->currency_id ? -1 : 1;
+    if (x->threshold != y->threshold) return x->threshold < y->threshold ? -1 : 1;
+    return x->achievement_id - y->achievement_id;
+}
+
+// Recompiles the achievements if achievements_version changed since the last
+// compile. db must see every shard's unlocks, which with shards is the main
+// connection. Returns 0, or -1 if they could not be read.
+int achievements_load(sqlite3 *db) {
+    int version = select_pragma_int(statement(db, STMT_SELECT_ACHIEVEMENTS_VERSION));
+    if (version == -1) return -1;
+    if (achievements.is_compiled && version == achievements.version) return 0;
+
+    struct achievement *items = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    int rc;
+    sqlite3_stmt *stmt_select_achievements = statement(db, STMT_SELECT_ACHIEVEMENTS);
+    while ((rc = sqlite3_step(stmt_select_achievements)) == SQLITE_ROW) {
+        if (count >= capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            struct achievement *new_items = realloc(items, capacity * sizeof(struct achievement));
+            if (!new_items) {
+                fprintf(stderr, "Unable to allocate memory for achievements.\n");
+                sqlite3_reset(stmt_select_achievements);
+                free(items);
+                return -1;
+            }
+            items = new_items;
+        }
+
+        struct achievement *item = &items[count];
+        const char *metric = (const char *)sqlite3_column_text(stmt_select_achievements, 2);
+        item->metric = 0;
+        while (item->metric < METRIC_COUNT && strcmp(achievement_metrics[item->metric], metric) != 0) item->metric++;
+        if (item->metric == METRIC_COUNT) continue;
+
+        item->achievement_id = sqlite3_column_int(stmt_select_achievements, 0);
+        snprintf(item->name, sizeof(item->name), "%s", (const char *)sqlite3_column_text(stmt_select_achievements, 1));
+        item->currency_id = sqlite3_column_type(stmt_select_achievements, 3) == SQLITE_NULL || item->metric == METRIC_DAILY_STREAK ? ACHIEVEMENT_ANY_CURRENCY : sqlite3_column_int(stmt_select_achievements, 3);
+        item->threshold = sqlite3_column_int64(stmt_select_achievements, 4);
+        item->is_unlocked = sqlite3_column_int(stmt_select_achievements, 5);
+        count++;
+    }
+    sqlite3_reset(stmt_select_achievements);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error reading achievements: %s\n", sqlite3_errmsg(db));
+        free(items);
+        return -1;
+    }
+
+    if (count > 0) qsort(items, count, sizeof(struct achievement), compare_achievements);
+
+    free(achievements.items);
+    achievements.items = items;
+    achievements.count = count;
+    for (int m = 0, i = 0; m <= METRIC_COUNT; ++m) {
+        while (i < count && items[i].metric < m) i++;
+        achievements.first[m] = i;
+    }
+    achievements.version = version;
+    achievements.is_compiled = 1;
+    achievements.pending_count = 0;
+    achievements.pending_unlisted = 0;
+    return 0;
+}
+
+void achievements_free(void) {
+    free(achievements.items);
+    free(achievements.pending);
+    memset(&achievements, 0, sizeof(achievements));
+}
+
+// Queues an unlock for achievements_announce. One that cannot be queued is
+// still counted, so it is not left out of the announcement silently.
+void achievements_add_pending(int i) {
+    if (achievements.pending_count >= achievements.pending_capacity) {
+        int capacity = achievements.pending_capacity ? achievements.pending_capacity * 2 : 8;
+        int *pending = realloc(achievements.pending, capacity * sizeof(int));
+        if (!pending) {
+            achievements.pending_unlisted++;
+            return;
+        }
+        achievements.pending = pending;
+        achievements.pending_capacity = capacity;
+    }
+    achievements.pending[achievements.pending_count++] = i;
+}
+
+// Records, inside the caller's transaction, the achievements of a counter that
+// its new value reaches. Returns 0 or -1.
+int achievements_unlock(sqlite3 *db, int metric, int currency_id, sqlite3_int64 value, time_t now) {
+    for (int i = achievements.first[metric]; i < achievements.first[metric + 1]; ++i) {
+        struct achievement *item = &achievements.items[i];
+        if (item->is_unlocked) continue;
+        if (item->currency_id == ACHIEVEMENT_ANY_CURRENCY) {
+            if (item->threshold > value) continue;
+        } else {
+            if (item->currency_id < currency_id) continue;
+            if (item->currency_id > currency_id || item->threshold > value) break;
+        }
+
+        sqlite3_stmt *stmt_insert_achievement_unlock = statement(db, STMT_INSERT_ACHIEVEMENT_UNLOCK);
+        sqlite3_bind_int(stmt_insert_achievement_unlock, 1, item->achievement_id);
+        sqlite3_bind_int64(stmt_insert_achievement_unlock, 2, now);
+        if (step_transaction_statement(db, stmt_insert_achievement_unlock) != 0) return -1;
+
+        // Another process may have recorded it first
+        if (sqlite3_changes(db) == 1) achievements_add_pending(i);
+    }
+    return 0;
+}
+
+// Adds amount to a per-currency counter inside the caller's transaction.
+// Returns 0 or -1.
+int count_achievement_progress(sqlite3 *db, int metric, int currency_id, sqlite3_int64 amount, time_t now) {
+    sqlite3_stmt *stmt_add_achievement_counter = statement(db, STMT_ADD_ACHIEVEMENT_COUNTER);
+    sqlite3_bind_text(stmt_add_achievement_counter, 1, achievement_metrics[metric], -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt_add_achievement_counter, 2, currency_id);
+    sqlite3_bind_int64(stmt_add_achievement_counter, 3, amount);
+
+    sqlite3_int64 value = 0;
+    int rc = sqlite3_step(stmt_add_achievement_counter);
+    if (rc == SQLITE_ROW) value = sqlite3_column_int64(stmt_add_achievement_counter, 0);
+    sqlite3_reset(stmt_add_achievement_counter);
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, "Error updating achievement progress: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return achievements_unlock(db, metric, currency_id, value, now);
+}
+
+// Counts the current Daily Missions window towards the streak if the
+// completion that just ran finished its last mission. Returns 0 or -1.
+int extend_daily_streak(sqlite3 *db, time_t now) {
+    int streak;
+    int rc = step_returning_int(statement(db, STMT_EXTEND_DAILY_STREAK), &streak);
+    if (rc == -1) {
+        fprintf(stderr, "Error updating the Daily Missions streak: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    if (rc == 0) return 0;
+    return achievements_unlock(db, METRIC_DAILY_STREAK, 0, streak, now);
+}
+
+// Reports the unlocks of a committed transaction
+void achievements_announce(void) {
+    for (int i = 0; i < achievements.pending_count; ++i) {
+        struct achievement *item = &achievements.items[achievements.pending[i]];
+        item->is_unlocked = 1;
+        printf("Achievement unlocked: %s!\n", item->name);
+    }
+    if (achievements.pending_unlisted) printf("%d more achievements unlocked, see List My Stats.\n", achievements.pending_unlisted);
+    achievements.pending_count = 0;
+    achievements.pending_unlisted = 0;
+}
+
+// The task list shown to the user may be stale if another process is writing
+// too. The completion guard decides, and the reward it returns, run through
+// the reward rules, is what gets credited and logged to the ledger in the same
+// transaction, so a task is never paid twice. Returns 0 with the credited
+// reward and new balance, -1 on failure or TRANSACTION_BUSY.
+int complete_task(sqlite3 *db, const struct reward_context *context, const char *operation_id, int *reward, int *balance) {
+    int rc = begin_transaction(db);
+    if (rc != 0) return rc;
+    achievements.pending_count = 0;
+    achievements.pending_unlisted = 0;
+
+    sqlite3_stmt *stmt_update_task_completion = statement(db, STMT_UPDATE_TASK_COMPLETION);
+    sqlite3_bind_int(stmt_update_task_completion, 1, context->task_id);
+    sqlite3_bind_int(stmt_update_task_completion, 2, context->event_id);
+
+    int base_amount;
+    rc = step_returning_int(stmt_update_task_completion, &base_amount);
+    if (rc != 1) {
+        if (rc == 0) fprintf(stderr, "Task %d has already been completed or is still locked.\n", context->task_id);
+        else fprintf(stderr, "Failure in updating completion: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
+
+    char applied[128];
+    *reward = reward_rules_apply(context, base_amount, applied, sizeof(applied));
+
+    sqlite3_stmt *stmt_update_balance = statement(db, STMT_UPDATE_BALANCE);
+    sqlite3_bind_int(stmt_update_balance, 1, *reward);
+    sqlite3_bind_int(stmt_update_balance, 2, context->currency_id);
+
+    rc = step_returning_int(stmt_update_balance, balance);
+    if (rc != 1) {
+        fprintf(stderr, "Error updating balance: %s\n", rc == 0 ? "currency does not exist" : sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
+
+    if (record_reward(db, context, base_amount, *reward, applied) != 0) return rollback_transaction(db);
+    if (add_currency_lot(db, context->currency_id, *reward, context->now) != 0) return rollback_transaction(db);
+    if (count_achievement_progress(db, METRIC_TASKS_COMPLETED, context->currency_id, 1, context->now) != 0) return rollback_transaction(db);
+    if (count_achievement_progress(db, METRIC_EARNED, context->currency_id, *reward, context->now) != 0) return rollback_transaction(db);
+    if (context->event_id == 1 && extend_daily_streak(db, context->now) != 0) return rollback_transaction(db);
+
+    char result[128];
+    snprintf(result, sizeof(result), "task %d of event %d completed, %d credited to currency %d", context->task_id, context->event_id, *reward, context->currency_id);
+    if ((rc = commit_operation(db, operation_id, result)) == 0) achievements_announce();
+    return rc;
+}
+
+void mark_task_done(sqlite3 *db) {
+    int rc;
+
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
+
+    print_events_table(events, event_count);
+
+    int chosen_event_id = 0;
+    printf("Choose which event the task belongs to: ");
+    if (read_int(&chosen_event_id) == -1) {
+        free(events);
+        return;
+    }
+
+    int chosen_currency_id = -1;
+    for (int i = 0; i < event_count; ++i) {
+        if (events[i].event_id == chosen_event_id) {
+            chosen_currency_id = events[i].currency_id;
+            break;
+        }
+    }
+    free(events);
+    if (chosen_currency_id == -1) {
+        fprintf(stderr, "Could not find currency ID.\n");
+        return;
+    }
+
+    sqlite3_stmt *stmt_select_available_tasks_of_an_event = statement(db, STMT_SELECT_AVAILABLE_TASKS_OF_AN_EVENT);
+    int task_count = print_tasks_table(db, stmt_select_available_tasks_of_an_event, chosen_event_id);
+    if (task_count == -1) return;
+
+    if (task_count == 0) {
+        printf("No tasks left.\n");
+        return;
+    }
+
+    int chosen_task_id = 0;
+    printf("Choose completed task: ");
+    if (read_int(&chosen_task_id) == -1) return;
+
+    struct task_lookup lookup = { chosen_task_id, -1 };
+    visit_tasks(db, stmt_select_available_tasks_of_an_event, chosen_event_id, find_task, &lookup);
+    int currency_amount = lookup.currency_amount;
+    if (currency_amount == -1) {
+        fprintf(stderr, "Could not find currency amount.\n");
+        return;
+    }
+
+    char operation_id[128];
+    int has_operation_id = read_operation_id(operation_id, sizeof(operation_id));
+    if (has_operation_id == -1 || (has_operation_id && operation_already_applied(db, operation_id) != 0)) return;
+
+    struct reward_context context;
+    if (reward_context_init(db, &context) != 0) {
+        fprintf(stderr, "Could not load the reward rules.\n");
+        return;
+    }
+    if (achievements_load(db) != 0) fprintf(stderr, "Could not load the achievements.\n");
+    context.event_id = chosen_event_id;
+    context.task_id = chosen_task_id;
+    context.currency_id = chosen_currency_id;
+
+    int attempt = 0;
+    int new_balance;
+    while ((rc = complete_task(shard_for_id(db, chosen_event_id), &context, operation_id, &currency_amount, &new_balance)) == TRANSACTION_BUSY && transaction_backoff(&attempt));
+    if (rc != 0) return;
+
+    printf("Task %d successfully completed. Keep it up!\n", chosen_task_id);
+    if (currency_amount != lookup.currency_amount) printf("Reward rules turned the %d reward into %d.\n", lookup.currency_amount, currency_amount);
+    affordability_set_balance(chosen_currency_id, new_balance);
+    task_index_set_completed(chosen_event_id, chosen_task_id);
+
+    int currency_count;
+    struct currency *currencies = get_currencies(db, &currency_count);
+
+    int idx_in_array = -1;
+    for (int i = 0; i < currency_count; ++i) {
+        if (chosen_currency_id == currencies[i].currency_id) {
+            idx_in_array = i;
+            break;
+        }
+    }
+    if (idx_in_array == -1) {
+        fprintf(stderr, "Could not find currency index.\n");
+        free(currencies);
+        return;
+    }
+
+    printf("Currency %d has increased by %d %ss. Happy spending!\n", chosen_currency_id, currency_amount, currencies[idx_in_array].symbol);
+
+    printf("Current Balance\n");
+    print_currency_table(currencies, currency_count);
+    free(currencies);
+}
+
+// Completes a set of tasks in one transaction: the given (event, task) pairs, or
+// every remaining task of all_of_event_id when it is non-zero. The tasks are
+// marked by a single set-based UPDATE, each reward goes through the reward rules
+// and the ledger, and each affected currency is credited once with the summed
+// reward. The optional operation ID is recorded in the same transaction. Returns
+// the number of tasks completed, or -1 if nothing was applied and
+// TRANSACTION_BUSY if that was for a lock.
+int complete_tasks_in_bulk(sqlite3 *db, const struct reward_context *context, struct task_ref *refs, int ref_count, int all_of_event_id, const char *operation_id) {
+    struct reward_total {
+        int id;
+        sqlite3_int64 total;
+        int balance;
+        int currency_id;
+        int tasks;
+    };
+
+    int rc;
+    int completed = 0;
+    int event_total_count = 0;
+    int event_total_capacity = 8;
+    int currency_total_count = 0;
+    struct reward_total *event_totals = malloc(event_total_capacity * sizeof(struct reward_total));
+    struct reward_total *currency_totals = NULL;
+    struct task_ref *done = NULL;
+    int done_capacity = 0;
+    if (!event_totals) {
+        fprintf(stderr, "Unable to allocate memory for bulk completion.\n");
+        return -1;
+    }
+
+    if ((rc = begin_transaction(db)) != 0) {
+        free(event_totals);
+        return rc;
+    }
+    achievements.pending_count = 0;
+    achievements.pending_unlisted = 0;
+
+    sqlite3_stmt *stmt;
+    if (all_of_event_id) {
+        stmt = statement(db, STMT_COMPLETE_REMAINING_TASKS_OF_AN_EVENT);
+        sqlite3_bind_int(stmt, 1, all_of_event_id);
+    } else {
+        stmt = statement(db, STMT_COMPLETE_SELECTED_TASKS);
+        if (step_transaction_statement(db, statement(db, STMT_CLEAR_BULK_TASK_SELECTION)) != 0) goto rollback;
+
+        for (int i = 0; i < ref_count; ++i) {
+            sqlite3_stmt *stmt_insert_bulk_task_selection = statement(db, STMT_INSERT_BULK_TASK_SELECTION);
+            sqlite3_bind_int(stmt_insert_bulk_task_selection, 1, refs[i].event_id);
+            sqlite3_bind_int(stmt_insert_bulk_task_selection, 2, refs[i].task_id);
+            if (step_transaction_statement(db, stmt_insert_bulk_task_selection) != 0) goto rollback;
+        }
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int event_id = sqlite3_column_int(stmt, 0);
+        int amount = sqlite3_column_int(stmt, 1);
+
+        int e = 0;
+        while (e < event_total_count && event_totals[e].id != event_id) e++;
+        if (e == event_total_count) {
+            if (event_total_count >= event_total_capacity) {
+                event_total_capacity *= 2;
+                struct reward_total *new_totals = realloc(event_totals, event_total_capacity * sizeof(struct reward_total));
+                if (!new_totals) {
+                    fprintf(stderr, "Unable to reallocate bulk completion totals.\n");
+                    sqlite3_reset(stmt);
+                    goto rollback;
+                }
+                event_totals = new_totals;
+            }
+            event_totals[e].id = event_id;
+            event_totals[e].total = 0;
+            event_totals[e].tasks = 0;
+
+            // Rules may match on the currency, so it is needed per row
+            sqlite3_stmt *stmt_select_event_currency = statement(db, STMT_SELECT_EVENT_CURRENCY);
+            sqlite3_bind_int(stmt_select_event_currency, 1, event_id);
+            int currency_rc = sqlite3_step(stmt_select_event_currency);
+            event_totals[e].currency_id = sqlite3_column_int(stmt_select_event_currency, 0);
+            sqlite3_reset(stmt_select_event_currency);
+            if (currency_rc != SQLITE_ROW) {
+                fprintf(stderr, "Could not find currency of event %d.\n", event_id);
+                sqlite3_reset(stmt);
+                goto rollback;
+            }
+            event_total_count++;
+        }
+
+        // RETURNING rows are produced after the UPDATE has run, so the ledger
+        // can be written while they are read
+        struct reward_context task_context = *context;
+        task_context.event_id = event_id;
+        task_context.task_id = sqlite3_column_int(stmt, 2);
+        task_context.currency_id = event_totals[e].currency_id;
+
+        char applied[128];
+        int reward = reward_rules_apply(&task_context, amount, applied, sizeof(applied));
+        if (record_reward(db, &task_context, amount, reward, applied) != 0) {
+            sqlite3_reset(stmt);
+            goto rollback;
+        }
+        event_totals[e].total += reward;
+        event_totals[e].tasks++;
+
+        if (completed >= done_capacity) {
+            done_capacity = done_capacity ? done_capacity * 2 : 16;
+            struct task_ref *new_done = realloc(done, done_capacity * sizeof(struct task_ref));
+            if (!new_done) {
+                fprintf(stderr, "Unable to reallocate bulk completion totals.\n");
+                sqlite3_reset(stmt);
+                goto rollback;
+            }
+            done = new_done;
+        }
+        done[completed].event_id = event_id;
+        done[completed].task_id = sqlite3_column_int(stmt, 2);
+        completed++;
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Failure in updating completion: %s\n", sqlite3_errmsg(db));
+        goto rollback;
+    }
+
+    currency_totals = malloc((event_total_count > 0 ? event_total_count : 1) * sizeof(struct reward_total));
+    if (!currency_totals) {
+        fprintf(stderr, "Unable to allocate memory for bulk completion.\n");
+        goto rollback;
+    }
+
+    for (int e = 0; e < event_total_count; ++e) {
+        int currency_id = event_totals[e].currency_id;
+
+        int c = 0;
+        while (c < currency_total_count && currency_totals[c].id != currency_id) c++;
+        if (c == currency_total_count) {
+            currency_totals[c].id = currency_id;
+            currency_totals[c].total = 0;
+            currency_totals[c].tasks = 0;
+            currency_total_count++;
+        }
+        currency_totals[c].total += event_totals[e].total;
+        currency_totals[c].tasks += event_totals[e].tasks;
+
+        if (event_totals[e].id == 1 && extend_daily_streak(db, context->now) != 0) goto rollback;
+    }
+
+    for (int c = 0; c < currency_total_count; ++c) {
+        sqlite3_stmt *stmt_update_balance = statement(db, STMT_UPDATE_BALANCE);
+        sqlite3_bind_int64(stmt_update_balance, 1, currency_totals[c].total);
+        sqlite3_bind_int(stmt_update_balance, 2, currency_totals[c].id);
+
+        rc = step_returning_int(stmt_update_balance, &currency_totals[c].balance);
+        if (rc != 1) {
+            fprintf(stderr, "Error updating balance: %s\n", rc == 0 ? "currency does not exist" : sqlite3_errmsg(db));
+            goto rollback;
+        }
+        if (add_currency_lot(db, currency_totals[c].id, currency_totals[c].total, context->now) != 0) goto rollback;
+        if (count_achievement_progress(db, METRIC_TASKS_COMPLETED, currency_totals[c].id, currency_totals[c].tasks, context->now) != 0) goto rollback;
+        if (count_achievement_progress(db, METRIC_EARNED, currency_totals[c].id, currency_totals[c].total, context->now) != 0) goto rollback;
+    }
+
+    char result[64];
+    snprintf(result, sizeof(result), "%d task(s) completed", completed);
+    if ((rc = commit_operation(db, operation_id, result)) != 0) {
+        free(event_totals);
+        free(currency_totals);
+        free(done);
+        return rc;
+    }
+
+    for (int c = 0; c < currency_total_count; ++c) {
+        printf("Currency %d has increased by %lld.\n", currency_totals[c].id, (long long)currency_totals[c].total);
+        affordability_set_balance(currency_totals[c].id, currency_totals[c].balance);
+    }
+    for (int i = 0; i < completed; ++i) {
+        task_index_set_completed(done[i].event_id, done[i].task_id);
+    }
+    achievements_announce();
+
+    free(event_totals);
+    free(currency_totals);
+    free(done);
+    return completed;
+
+rollback:
+    rc = rollback_transaction(db);
+    free(event_totals);
+    free(currency_totals);
+    free(done);
+    return rc;
+}
+
+void mark_tasks_done_in_bulk(sqlite3 *db) {
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
+
+    print_events_table(events, event_count);
+    free(events);
+
+    printf("Enter tasks as EVENT:TASK pairs separated by spaces, or 'all EVENT' for every remaining task of an event: ");
+    char line[1024];
+    if (read_line(line, sizeof(line)) == -1) return;
+
+    struct task_ref *refs = NULL;
+    int ref_count = 0;
+    int ref_capacity = 0;
+    int all_of_event_id = 0;
+
+    if (strncmp(line, "all", 3) == 0) {
+        if (sscanf(line + 3, "%d", &all_of_event_id) != 1 || all_of_event_id <= 0) {
+            fprintf(stderr, "Invalid event ID.\n");
+            return;
+        }
+    } else {
+        char *save_ptr;
+        for (char *token = strtok_r(line, " \t", &save_ptr); token; token = strtok_r(NULL, " \t", &save_ptr)) {
+            struct task_ref ref;
+            if (sscanf(token, "%d:%d", &ref.event_id, &ref.task_id) != 2) {
+                fprintf(stderr, "Invalid task reference '%s'.\n", token);
+                free(refs);
                 return;
             }
 
-            sqlite3_reset(stmt_insert_store);
-            printf("Item %d added successfully\n", i);
+            if (ref_count >= ref_capacity) {
+                ref_capacity = ref_capacity ? ref_capacity * 2 : 16;
+                struct task_ref *new_refs = realloc(refs, ref_capacity * sizeof(struct task_ref));
+                if (!new_refs) {
+                    fprintf(stderr, "Unable to reallocate task references.\n");
+                    free(refs);
+                    return;
+                }
+                refs = new_refs;
+            }
+            refs[ref_count++] = ref;
+        }
+
+        if (ref_count == 0) {
+            printf("No tasks given.\n");
+            return;
+        }
+    }
+
+    // One transaction can only span one shard
+    sqlite3 *shard = shard_for_id(db, all_of_event_id ? all_of_event_id : refs[0].event_id);
+    for (int i = 1; i < ref_count; ++i) {
+        if (shard_for_id(db, refs[i].event_id) != shard) {
+            fprintf(stderr, "Events %d and %d are kept in different shards, complete their tasks separately.\n", refs[0].event_id, refs[i].event_id);
+            free(refs);
+            return;
+        }
+    }
+
+    char operation_id[128];
+    int has_operation_id = read_operation_id(operation_id, sizeof(operation_id));
+    if (has_operation_id == -1 || (has_operation_id && operation_already_applied(db, operation_id) != 0)) {
+        free(refs);
+        return;
+    }
+
+    struct reward_context context;
+    if (reward_context_init(db, &context) != 0) {
+        fprintf(stderr, "Could not load the reward rules.\n");
+        free(refs);
+        return;
+    }
+    if (achievements_load(db) != 0) fprintf(stderr, "Could not load the achievements.\n");
+
+    int attempt = 0;
+    int completed;
+    while ((completed = complete_tasks_in_bulk(shard, &context, refs, ref_count, all_of_event_id, operation_id)) == TRANSACTION_BUSY && transaction_backoff(&attempt));
+    free(refs);
+    if (completed < 0) {
+        fprintf(stderr, "Bulk completion failed, no task was completed.\n");
+        return;
+    }
+
+    printf("%d task(s) successfully completed. Keep it up!\n", completed);
+
+    int currency_count;
+    struct currency *currencies = get_currencies(db, &currency_count);
+
+    printf("Current Balance\n");
+    print_currency_table(currencies, currency_count);
+    free(currencies);
+}
+
+// Store counterpart of visit_tasks.
+int visit_store_items(sqlite3 *db, sqlite3_stmt *stmt, int event_id, store_item_visitor visit, void *context) {
+    int rc;
+    int visited = 0;
+
+    sqlite3_bind_int(stmt, 1, event_id);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct store_item_row row = {
+            .item_id = sqlite3_column_int(stmt, 0),
+            .item_description = (const char *)sqlite3_column_text(stmt, 1),
+            .item_description_length = sqlite3_column_bytes(stmt, 1),
+            .cost = sqlite3_column_int(stmt, 2),
+            .event_id = sqlite3_column_int(stmt, 3),
+            .stock = sqlite3_column_int(stmt, 4),
+            .category = (const char *)sqlite3_column_text(stmt, 5),
+            .category_length = sqlite3_column_bytes(stmt, 5),
+        };
+
+        visited++;
+        if (visit && visit(&row, context)) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error in fetching store items: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    return visited;
+}
+
+char * copy_text(const char *text, int length) {
+    char *copy = malloc(length + 1);
+    if (!copy) return NULL;
+
+    if (text) memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+struct store_item_list {
+    struct store_item *items;
+    int count;
+    int capacity;
+    int failed;
+};
+
+// Appends an owned copy of each visited row; context is a store_item_list
+int retain_store_item(const struct store_item_row *row, void *context) {
+    struct store_item_list *list = context;
+
+    if (list->count >= list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 10;
+        struct store_item *items = realloc(list->items, capacity * sizeof(struct store_item));
+        if (!items) {
+            fprintf(stderr, "Failed to reallocate store items.\n");
+            list->failed = 1;
+            return 1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    struct store_item *item = &list->items[list->count];
+    item->item_id = row->item_id;
+    item->cost = row->cost;
+    item->event_id = row->event_id;
+    item->stock = row->stock;
+    item->item_description = copy_text(row->item_description, row->item_description_length);
+    item->category = copy_text(row->category, row->category_length);
+    list->count++;
+
+    if (!item->item_description || !item->category) {
+        fprintf(stderr, "Unable to allocate memory for store items.\n");
+        list->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+void free_store_items(struct store_item *items, int count) {
+    if (!items) return;
+
+    for (int i = 0; i < count; ++i) {
+        free(items[i].item_description);
+        free(items[i].category);
+    }
+    free(items);
+}
+
+// Returns owned copies of the rows stmt yields, for callers that keep them
+// past the scan. Free with free_store_items.
+struct store_item * fetch_store_items(sqlite3 *db, sqlite3_stmt *stmt, int *store_item_count, int chosen_event_id) {
+    struct store_item_list list = { 0 };
+    *store_item_count = 0;
+
+    int visited = visit_store_items(db, stmt, chosen_event_id, retain_store_item, &list);
+    if (visited < 0 || list.failed) {
+        free_store_items(list.items, list.count);
+        return NULL;
+    }
+
+    // Callers treat NULL as an error, so an empty result still allocates
+    if (!list.items) list.items = malloc(sizeof(struct store_item));
+    *store_item_count = list.count;
+    return list.items;
+}
+
+struct store_item * get_store_items_by_event(sqlite3 *db, int *store_item_count, int chosen_event_id) {
+    return fetch_store_items(db, statement(db, STMT_SELECT_STORE_ITEMS_OF_AN_EVENT), store_item_count, chosen_event_id);
+}
+
+void task_index_invalidate() {
+    free(task_idx.event_ids);
+    free(task_idx.task_ids);
+    free(task_idx.currency_amounts);
+    free(task_idx.completed);
+    free(task_idx.description_offsets);
+    free(task_idx.descriptions);
+    free(task_idx.range_event_ids);
+    free(task_idx.range_starts);
+    memset(&task_idx, 0, sizeof(task_idx));
+}
+
+// Loads the index, or reloads it if another connection committed since
+int task_index_load(sqlite3 *db) {
+    int data_version = writers_data_version(db);
+    if (task_idx.is_loaded && data_version == task_idx.data_version) return 0;
+    task_index_invalidate();
+
+    sqlite3_stmt *stmt_count_tasks = statement(db, STMT_COUNT_TASKS);
+    int rc = sqlite3_step(stmt_count_tasks);
+    int task_count = sqlite3_column_int(stmt_count_tasks, 0);
+    sqlite3_int64 description_bytes = sqlite3_column_int64(stmt_count_tasks, 1);
+    int event_count = sqlite3_column_int(stmt_count_tasks, 2);
+    sqlite3_reset(stmt_count_tasks);
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, "Error counting tasks: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    int n = task_count > 0 ? task_count : 1;
+    task_idx.event_ids = malloc(n * sizeof(int));
+    task_idx.task_ids = malloc(n * sizeof(int));
+    task_idx.currency_amounts = malloc(n * sizeof(int));
+    task_idx.completed = malloc(n);
+    task_idx.description_offsets = malloc(n * sizeof(uint32_t));
+    task_idx.descriptions = malloc(description_bytes + n);
+    task_idx.range_event_ids = malloc((event_count + 1) * sizeof(int));
+    task_idx.range_starts = malloc((event_count + 1) * sizeof(int));
+    if (!task_idx.event_ids || !task_idx.task_ids || !task_idx.currency_amounts || !task_idx.completed ||
+        !task_idx.description_offsets || !task_idx.descriptions || !task_idx.range_event_ids || !task_idx.range_starts) {
+        fprintf(stderr, "Unable to allocate memory for task index.\n");
+        task_index_invalidate();
+        return -1;
+    }
+
+    // Rows added between the count and the scan are left for the next load
+    sqlite3_stmt *stmt_select_task_columns = statement(db, STMT_SELECT_TASK_COLUMNS);
+    size_t pool_length = 0;
+    int i = 0;
+    while (i < task_count && (rc = sqlite3_step(stmt_select_task_columns)) == SQLITE_ROW) {
+        int event_id = sqlite3_column_int(stmt_select_task_columns, 0);
+        const char *description = (const char *)sqlite3_column_text(stmt_select_task_columns, 4);
+        int description_length = sqlite3_column_bytes(stmt_select_task_columns, 4);
+        if (pool_length + description_length + 1 > description_bytes + task_count) break;
+
+        if (task_idx.range_count == 0 || task_idx.range_event_ids[task_idx.range_count - 1] != event_id) {
+            if (task_idx.range_count == event_count) break;
+            task_idx.range_event_ids[task_idx.range_count] = event_id;
+            task_idx.range_starts[task_idx.range_count] = i;
+            task_idx.range_count++;
+        }
+
+        task_idx.event_ids[i] = event_id;
+        task_idx.task_ids[i] = sqlite3_column_int(stmt_select_task_columns, 1);
+        task_idx.currency_amounts[i] = sqlite3_column_int(stmt_select_task_columns, 2);
+        task_idx.completed[i] = sqlite3_column_int(stmt_select_task_columns, 3) != 0;
+        task_idx.description_offsets[i] = pool_length;
+        if (description) memcpy(task_idx.descriptions + pool_length, description, description_length);
+        task_idx.descriptions[pool_length + description_length] = '\0';
+        pool_length += description_length + 1;
+        i++;
+    }
+    sqlite3_reset(stmt_select_task_columns);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, "Error loading task index: %s\n", sqlite3_errmsg(db));
+        task_index_invalidate();
+        return -1;
+    }
+
+    task_idx.task_count = i;
+    task_idx.range_starts[task_idx.range_count] = i;
+    task_idx.data_version = data_version;
+    task_idx.is_loaded = 1;
+    return 0;
+}
+
+// Completions are applied by task_index_set_completed; added and removed tasks
+// drop the index. Bulk resets, which cannot be told apart from completions
+// here, invalidate it themselves.
+void task_index_on_changes(const struct row_change *changes, int count) {
+    if (!task_idx.is_loaded) return;
+
+    for (int i = 0; changes && i < count; ++i) {
+        if (changes[i].table == CHANGE_TASKS && changes[i].op != SQLITE_UPDATE) {
+            task_index_invalidate();
+            return;
+        }
+    }
+    if (!changes) task_index_invalidate();
+}
+
+// Returns the range slot of event_id, or -1.
+int task_index_find_event(int event_id) {
+    int lo = 0, hi = task_idx.range_count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (task_idx.range_event_ids[mid] == event_id) return mid;
+        if (task_idx.range_event_ids[mid] < event_id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+// Keeps a loaded index in step with a committed completion.
+void task_index_set_completed(int event_id, int task_id) {
+    if (!task_idx.is_loaded) return;
+
+    int e = task_index_find_event(event_id);
+    if (e == -1) {
+        task_index_invalidate();
+        return;
+    }
+
+    int lo = task_idx.range_starts[e], hi = task_idx.range_starts[e + 1] - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (task_idx.task_ids[mid] == task_id) {
+            task_idx.completed[mid] = 1;
+            return;
+        }
+        if (task_idx.task_ids[mid] < task_id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    task_index_invalidate();
+}
+
+// Sums one event's range. The loop has no branches or cross-iteration
+// dependencies besides the accumulators. GCC vectorizes it at -O3 or with
+// -fvect-cost-model=dynamic; the very cheap cost model of plain -O2 leaves it
+// scalar, as the trip count is not known.
+struct task_totals task_index_aggregate(int start, int end) {
+    const int *restrict amounts = task_idx.currency_amounts;
+    const uint8_t *restrict completed = task_idx.completed;
+
+    int64_t total_reward = 0;
+    int64_t earned_reward = 0;
+    int completed_count = 0;
+
+    // Masking instead of multiplying avoids 64-bit vector multiplies
+    for (int i = start; i < end; ++i) {
+        total_reward += amounts[i];
+        earned_reward += amounts[i] & -(int)completed[i];
+        completed_count += completed[i];
+    }
+
+    struct task_totals totals = { end - start, completed_count, total_reward, earned_reward };
+    return totals;
+}
+
+const char * task_index_description(int i) {
+    return task_idx.descriptions + task_idx.description_offsets[i];
+}
+
+void print_task_progress(sqlite3 *db) {
+    if (task_index_load(db) != 0) return;
+
+    int id_width = 10;
+    int count_width = 8;
+    int ratio_width = 8;
+    int reward_width = 12;
+    int next_width = 40;
+
+    printf("Task progress\n");
+    print_top_border(6, id_width, count_width, count_width, ratio_width, reward_width, next_width);
+    print_table_row(6, "Event", id_width, "Tasks", count_width, "Done", count_width, "Done %", ratio_width, "Pending", reward_width, "Next task", next_width);
+    print_row_separator(6, id_width, count_width, count_width, ratio_width, reward_width, next_width);
+
+    for (int e = 0; e < task_idx.range_count; ++e) {
+        int start = task_idx.range_starts[e];
+        int end = task_idx.range_starts[e + 1];
+        struct task_totals totals = task_index_aggregate(start, end);
+
+        const char *next_task = "-";
+        for (int i = start; i < end; ++i) {
+            if (!task_idx.completed[i]) {
+                next_task = task_index_description(i);
+                break;
+            }
+        }
+
+        char id_str[12], tasks_str[12], done_str[12], ratio_str[12], pending_str[24];
+        snprintf(id_str, sizeof(id_str), "%d", task_idx.range_event_ids[e]);
+        snprintf(tasks_str, sizeof(tasks_str), "%d", totals.task_count);
+        snprintf(done_str, sizeof(done_str), "%d", totals.completed_count);
+        snprintf(ratio_str, sizeof(ratio_str), "%.0f%%", totals.task_count ? 100.0 * totals.completed_count / totals.task_count : 0);
+        snprintf(pending_str, sizeof(pending_str), "%lld", (long long)(totals.total_reward - totals.earned_reward));
+
+        print_table_row(6, id_str, id_width, tasks_str, count_width, done_str, count_width, ratio_str, ratio_width, pending_str, reward_width, next_task, next_width);
+    }
+
+    print_bottom_border(6, id_width, count_width, count_width, ratio_width, reward_width, next_width);
+}
+
+// Maps the view for publishing. Returns 0, 1 if another process already
+// publishes it, or -1 on error.
+int balance_view_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    // Held until balance_view_close; the kernel drops it if the process dies
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "Another process publishes the balance view at %s, not publishing it from this one.\n", path);
+            close(fd);
+            return 1;
         }
+        perror("flock");
+        close(fd);
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(struct balance_view)) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, sizeof(struct balance_view), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+    balance_view_fd = fd;
+
+    // A previous owner that died mid-update leaves the sequence odd
+    balance_view = map;
+    uint64_t sequence = atomic_load_explicit(&balance_view->sequence, memory_order_relaxed);
+    atomic_store_explicit(&balance_view->sequence, (sequence + 1) & ~1ull, memory_order_release);
+    balance_view->magic = BALANCE_VIEW_MAGIC;
+    balance_view->size = sizeof(struct balance_view);
+    balance_view->owner_pid = getpid();
+    return 0;
+}
+
+void balance_view_on_changes(const struct row_change *changes, int count) {
+    for (int i = 0; changes && i < count; ++i) {
+        if (changes[i].table != CHANGE_STORE) {
+            balance_view_dirty = 1;
+            return;
+        }
+    }
+    if (!changes) balance_view_dirty = 1;
+}
+
+// Publishes a new snapshot after commits that touched balances, events or
+// tasks, from this process or, going by data_version, any other. It is
+// assembled off to the side so the odd-sequence window only covers a memcpy.
+void balance_view_update(sqlite3 *db) {
+    if (!balance_view) return;
+
+    int data_version = writers_data_version(db);
+    if (data_version != balance_view_data_version) balance_view_dirty = 1;
+    if (!balance_view_dirty) return;
+
+    static struct balance_snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    int currency_count;
+    struct currency *currencies = get_currencies(db, &currency_count);
+    if (!currencies) return;
+
+    for (int i = 0; i < currency_count && snapshot.currency_count < BALANCE_VIEW_MAX_CURRENCIES; ++i) {
+        struct balance_view_currency *c = &snapshot.currencies[snapshot.currency_count++];
+        c->currency_id = currencies[i].currency_id;
+        c->balance = currencies[i].balance;
+        memcpy(c->currency_name, currencies[i].currency_name, sizeof(c->currency_name));
+        memcpy(c->symbol, currencies[i].symbol, sizeof(c->symbol));
+    }
+    snapshot.currencies_omitted = currency_count - snapshot.currency_count;
+    free(currencies);
+
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
+    if (!events) return;
+
+    int have_tasks = task_index_load(db) == 0;
+    for (int i = 0; i < event_count && snapshot.event_count < BALANCE_VIEW_MAX_EVENTS; ++i) {
+        struct balance_view_event *e = &snapshot.events[snapshot.event_count++];
+        e->event_id = events[i].event_id;
+        e->currency_id = events[i].currency_id;
+        e->end_time = events[i].is_time_limited ? events[i].end_time : 0;
+        memcpy(e->event_name, events[i].event_name, sizeof(e->event_name));
+
+        int range = have_tasks ? task_index_find_event(events[i].event_id) : -1;
+        if (range != -1) {
+            struct task_totals totals = task_index_aggregate(task_idx.range_starts[range], task_idx.range_starts[range + 1]);
+            e->task_count = totals.task_count;
+            e->completed_count = totals.completed_count;
+        }
+    }
+    snapshot.events_omitted = event_count - snapshot.event_count;
+    free(events);
+
+    // Said once per change, not on every publish
+    static int32_t currencies_omitted, events_omitted;
+    if (snapshot.currencies_omitted != currencies_omitted || snapshot.events_omitted != events_omitted) {
+        if (snapshot.currencies_omitted) fprintf(stderr, "Balance view is limited to %d currencies, %d left out.\n", BALANCE_VIEW_MAX_CURRENCIES, snapshot.currencies_omitted);
+        if (snapshot.events_omitted) fprintf(stderr, "Balance view is limited to %d events, %d left out.\n", BALANCE_VIEW_MAX_EVENTS, snapshot.events_omitted);
+        currencies_omitted = snapshot.currencies_omitted;
+        events_omitted = snapshot.events_omitted;
+    }
+
+    uint64_t sequence = atomic_load_explicit(&balance_view->sequence, memory_order_relaxed);
+    snapshot.version = sequence / 2 + 1;
+    snapshot.published_at = time(NULL);
+
+    atomic_store_explicit(&balance_view->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&balance_view->snapshot, &snapshot, sizeof(snapshot));
+    atomic_store_explicit(&balance_view->sequence, sequence + 2, memory_order_release);
+
+    balance_view_dirty = 0;
+    balance_view_data_version = data_version;
+}
+
+void balance_view_close(void) {
+    if (!balance_view) return;
+
+    balance_view->owner_pid = 0;
+    munmap(balance_view, sizeof(struct balance_view));
+    balance_view = NULL;
+    close(balance_view_fd);
+    balance_view_fd = -1;
+}
+
+// Copies a consistent snapshot out of a view mapped by another process. Returns
+// -1 if the writer kept it busy for every attempt.
+int balance_view_read(const struct balance_view *view, struct balance_snapshot *snapshot) {
+    for (int attempt = 0; attempt < BALANCE_VIEW_READ_ATTEMPTS; ++attempt) {
+        uint64_t before = atomic_load_explicit((_Atomic uint64_t *)&view->sequence, memory_order_acquire);
+        if (before & 1) continue;
+
+        memcpy(snapshot, &view->snapshot, sizeof(*snapshot));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit((_Atomic uint64_t *)&view->sequence, memory_order_relaxed) == before) return 0;
+    }
+    return -1;
+}
+
+// --show-balances: prints the published view without opening the database.
+int balance_view_show(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "No balance view at %s; is the reward system running?\n", path);
+        return 1;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(struct balance_view)) {
+        map = mmap(NULL, sizeof(struct balance_view), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED || ((struct balance_view *)map)->magic != BALANCE_VIEW_MAGIC) {
+        fprintf(stderr, "%s is not a balance view of this version.\n", path);
+        if (map != MAP_FAILED) munmap(map, sizeof(struct balance_view));
+        return 1;
+    }
+
+    struct balance_view *view = map;
+    static struct balance_snapshot snapshot;
+    int rc = balance_view_read(view, &snapshot);
+    int owner_pid = view->owner_pid;
+    munmap(map, sizeof(struct balance_view));
+    if (rc != 0) {
+        fprintf(stderr, "Balance view is being rewritten continuously, try again.\n");
+        return 1;
+    }
+
+    char published[TIMESTAMP_SIZE];
+    printf("Balance view version %llu, published %s%s\n", (unsigned long long)snapshot.version,
+        format_timestamp(snapshot.published_at, published, sizeof(published)), owner_pid ? "" : " (owner exited)");
+
+    struct currency currencies[BALANCE_VIEW_MAX_CURRENCIES];
+    for (int i = 0; i < snapshot.currency_count; ++i) {
+        currencies[i].currency_id = snapshot.currencies[i].currency_id;
+        currencies[i].balance = snapshot.currencies[i].balance;
+        memcpy(currencies[i].currency_name, snapshot.currencies[i].currency_name, sizeof(currencies[i].currency_name));
+        memcpy(currencies[i].symbol, snapshot.currencies[i].symbol, sizeof(currencies[i].symbol));
+    }
+    print_currency_table(currencies, snapshot.currency_count);
+    if (snapshot.currencies_omitted) printf("%d more currencies not shown\n", snapshot.currencies_omitted);
+
+    int id_width = 10;
+    int name_width = 30;
+    int count_width = 8;
+    int end_width = 25;
+
+    print_top_border(5, id_width, name_width, count_width, count_width, end_width);
+    print_table_row(5, "Event", id_width, "Name", name_width, "Tasks", count_width, "Done", count_width, "Ends", end_width);
+    print_row_separator(5, id_width, name_width, count_width, count_width, end_width);
+
+    for (int i = 0; i < snapshot.event_count; ++i) {
+        struct balance_view_event *e = &snapshot.events[i];
+
+        char id_str[12], tasks_str[12], done_str[12], end_str[TIMESTAMP_SIZE];
+        snprintf(id_str, sizeof(id_str), "%d", e->event_id);
+        snprintf(tasks_str, sizeof(tasks_str), "%d", e->task_count);
+        snprintf(done_str, sizeof(done_str), "%d", e->completed_count);
+        if (e->end_time) format_timestamp(e->end_time, end_str, sizeof(end_str));
+        else snprintf(end_str, sizeof(end_str), "-");
+
+        print_table_row(5, id_str, id_width, e->event_name, name_width, tasks_str, count_width, done_str, count_width, end_str, end_width);
+    }
+
+    print_bottom_border(5, id_width, name_width, count_width, count_width, end_width);
+    if (snapshot.events_omitted) printf("%d more events not shown\n", snapshot.events_omitted);
+    return 0;
+}
 
-        sqlite3_reset(stmt_daily_missions);
+void affordability_invalidate() {
+    for (int i = 0; i < afford_index.event_count; ++i) {
+        free_store_items(afford_index.events[i].items, afford_index.events[i].item_count);
     }
+    free(afford_index.events);
+    free(afford_index.currencies);
+    memset(&afford_index, 0, sizeof(afford_index));
 }
 
-int create_new_currency(sqlite3 *db) {
-    struct currency new_currency;
-
-    printf("Enter currency name: ");
-    fgets(new_currency.currency_name, sizeof(new_currency.currency_name), stdin);
-    new_currency.currency_name[strcspn(new_currency.currency_name, "\n")] = 0;
-
-    printf("Enter currency symbol: ");
-    fgets(new_currency.symbol, sizeof(new_currency.symbol), stdin);
-    new_currency.symbol[strcspn(new_currency.symbol, "\n")] = 0;
+// Loads the index, or reloads it if another connection committed since
+int affordability_load(sqlite3 *db) {
+    int data_version = writers_data_version(db);
+    if (afford_index.is_loaded && data_version == afford_index.data_version) return 0;
+    affordability_invalidate();
 
-    new_currency.balance = 0;
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
+    if (!events) return -1;
 
-    sqlite3_bind_text(stmt_insert_currency, 1, new_currency.currency_name, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt_insert_currency, 2, new_currency.symbol, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt_insert_currency, 3, new_currency.balance);
+    afford_index.currencies = get_currencies(db, &afford_index.currency_count);
+    if (!afford_index.currencies) {
+        free(events);
+        return -1;
+    }
 
-    int rc = sqlite3_step(stmt_insert_currency);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to insert currency: %s\n", sqlite3_errmsg(db));
-        sqlite3_reset(stmt_insert_currency);
+    afford_index.events = calloc(event_count > 0 ? event_count : 1, sizeof(struct afford_event));
+    if (!afford_index.events) {
+        fprintf(stderr, "Unable to allocate memory for affordability index.\n");
+        free(events);
+        affordability_invalidate();
         return -1;
     }
 
-    sqlite3_reset(stmt_insert_currency);
+    for (int i = 0; i < event_count; ++i) {
+        struct afford_event *ae = &afford_index.events[i];
+        ae->event_id = events[i].event_id;
+        ae->currency_id = events[i].currency_id;
+        ae->items = fetch_store_items(db, statement(db, STMT_SELECT_PURCHASABLE_ITEMS_BY_COST), &ae->item_count, ae->event_id);
+        afford_index.event_count++;
+        if (!ae->items) {
+            free(events);
+            affordability_invalidate();
+            return -1;
+        }
+    }
 
-    return sqlite3_last_insert_rowid(db);
+    free(events);
+    afford_index.data_version = data_version;
+    afford_index.is_loaded = 1;
+    return 0;
 }
 
-void add_event(sqlite3 *db) {
-    struct event new_event;
-    int rc;
+struct currency * affordability_find_currency(int currency_id) {
+    for (int i = 0; i < afford_index.currency_count; ++i) {
+        if (afford_index.currencies[i].currency_id == currency_id) return &afford_index.currencies[i];
+    }
+    return NULL;
+}
 
-    // Event name
-    printf("Enter event name: ");
-    fgets(new_event.event_name, sizeof(new_event.event_name), stdin);
-    new_event.event_name[strcspn(new_event.event_name, "\n")] = 0;
+struct afford_event * affordability_find_event(int event_id) {
+    for (int i = 0; i < afford_index.event_count; ++i) {
+        if (afford_index.events[i].event_id == event_id) return &afford_index.events[i];
+    }
+    return NULL;
+}
 
-    printf("Existing currencies\n");
-    int id_width = 10;
-    int name_width = 20;
-    int symbol_width = 10;
-    print_top_border(3, id_width, name_width, symbol_width);
-    print_table_row(3, "ID", id_width, "Name", name_width, "Symbol", symbol_width);
-    print_row_separator(3, id_width, name_width, symbol_width);
-    
-    // Currency ID
-    int currency_count = 0;
-    while ((rc = sqlite3_step(stmt_select_currency)) == SQLITE_ROW) {
-        int currency_id = sqlite3_column_int(stmt_select_currency, 0);
-        const char *currency_name = (const char *)sqlite3_column_text(stmt_select_currency, 1);
-        const char *symbol = (const char *)sqlite3_column_text(stmt_select_currency, 2);
-        int balance = sqlite3_column_int(stmt_select_currency, 3);
+// Balance and stock updates arrive through affordability_set_balance and
+// affordability_set_stock with the values the writers read back; any other
+// committed change to the indexed tables drops the index.
+void affordability_on_changes(const struct row_change *changes, int count) {
+    if (!afford_index.is_loaded) return;
 
-        char id_str[10];
-        snprintf(id_str, sizeof(id_str), "%d", currency_id);
+    for (int i = 0; changes && i < count; ++i) {
+        if (changes[i].table == CHANGE_EVENTS || (changes[i].table != CHANGE_TASKS && changes[i].op != SQLITE_UPDATE)) {
+            affordability_invalidate();
+            return;
+        }
+    }
+    if (!changes) affordability_invalidate();
+}
 
-        print_table_row(3, id_str, id_width, currency_name, name_width, symbol, symbol_width);
-        currency_count++;
+// Takes the balance a guarded UPDATE ... RETURNING reported, so the cache stays
+// exact even when other processes write to the same currency.
+void affordability_set_balance(int currency_id, int balance) {
+    if (!afford_index.is_loaded) return;
+
+    struct currency *currency = affordability_find_currency(currency_id);
+    if (currency) {
+        currency->balance = balance;
+    } else {
+        affordability_invalidate();
     }
+}
 
-    print_bottom_border(3, id_width, name_width, symbol_width);
+// Takes the stock left available after a sale or a hold; sold-out items leave
+// the index.
+void affordability_set_stock(int event_id, int item_id, int stock) {
+    if (!afford_index.is_loaded) return;
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to fetch currencies: %s\n", sqlite3_errmsg(db));
+    struct afford_event *ae = affordability_find_event(event_id);
+    if (!ae) return;
+
+    for (int i = 0; i < ae->item_count; ++i) {
+        if (ae->items[i].item_id != item_id) continue;
+        ae->items[i].stock = stock;
+        if (ae->items[i].stock == 0) {
+            memmove(&ae->items[i], &ae->items[i + 1], (ae->item_count - i - 1) * sizeof(struct store_item));
+            ae->item_count--;
+        }
         return;
     }
-    
-    sqlite3_reset(stmt_select_currency);
 
-    if (currency_count == 0) {
-        printf("There are no currencies available, make one.\n");
-        new_event.currency_id = create_new_currency(db);
-        if (new_event.currency_id == -1) {
-            fprintf(stderr, "Failed to create new currency.\n");
-            return;
-        }
-        printf("New currency created with ID: %d\n", new_event.currency_id);
-    } else {
-        printf("\nChoose an existing currency or create a new one(0): ");
-        scanf("%d", &new_event.currency_id);
-        flush_input_buffer();
+    // A released hold brought a sold-out item back
+    if (stock != 0) affordability_invalidate();
+}
 
-        if (new_event.currency_id == 0) {
-            new_event.currency_id = create_new_currency(db);
-            if (new_event.currency_id == -1) {
-                fprintf(stderr, "Failed to create new currency.\n");
-                return;
+// Returns the event's in-stock items sorted by cost and sets *affordable_count to
+// the length of the prefix the current balance can pay for.
+struct store_item * get_affordable_items(sqlite3 *db, int event_id, int *affordable_count, struct currency **currency) {
+    *affordable_count = 0;
+    if (affordability_load(db) != 0) return NULL;
+
+    struct afford_event *ae = affordability_find_event(event_id);
+    if (!ae) return NULL;
+
+    struct currency *c = affordability_find_currency(ae->currency_id);
+    if (!c) return NULL;
+    if (currency) *currency = c;
+
+    int lo = 0;
+    int hi = ae->item_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ae->items[mid].cost <= c->balance) lo = mid + 1;
+        else hi = mid;
+    }
+
+    *affordable_count = lo;
+    return ae->items;
+}
+
+// Merges the per-event cost-ordered arrays to find the n cheapest in-stock items
+// across every currency, without touching the store table. The returned pointers
+// stay valid until the index is invalidated.
+struct store_item ** get_cheapest_items(sqlite3 *db, int n, int *item_count) {
+    *item_count = 0;
+    if (affordability_load(db) != 0) return NULL;
+
+    struct store_item **cheapest = malloc((n > 0 ? n : 1) * sizeof(struct store_item *));
+    int *cursors = calloc(afford_index.event_count > 0 ? afford_index.event_count : 1, sizeof(int));
+    if (!cheapest || !cursors) {
+        fprintf(stderr, "Unable to allocate memory for cheapest items.\n");
+        free(cheapest);
+        free(cursors);
+        return NULL;
+    }
+
+    while (*item_count < n) {
+        int best = -1;
+        for (int i = 0; i < afford_index.event_count; ++i) {
+            struct afford_event *ae = &afford_index.events[i];
+            if (cursors[i] >= ae->item_count) continue;
+            if (best == -1 || ae->items[cursors[i]].cost < afford_index.events[best].items[cursors[best]].cost) {
+                best = i;
             }
-            printf("New currency created with ID: %d\n", new_event.currency_id);
         }
+        if (best == -1) break;
+
+        cheapest[(*item_count)++] = &afford_index.events[best].items[cursors[best]++];
     }
 
-    // Is time limited
-    printf("Is this event time-limited? (1 for Yes, 0 for No): ");
-    scanf("%d", &new_event.is_time_limited);
-    flush_input_buffer();
+    free(cursors);
+    return cheapest;
+}
 
-    if (new_event.is_time_limited) {
-        printf("Enter start time (YYYY-MM-DD HH:MM:SS): ");
-        char start_time_str[21];
-        fgets(start_time_str, sizeof(start_time_str), stdin);
-        start_time_str[strcspn(start_time_str, "\n")] = 0;
+// Reserves quantity units of an item until expires_at. Lapsed holds are
+// released first so they never block a reservation. Returns 0 with the hold
+// and the units left available, -1 or TRANSACTION_BUSY.
+int reserve_stock(sqlite3 *db, int event_id, int item_id, int quantity, time_t now, time_t expires_at, int *hold_id, int *available) {
+    int rc = begin_transaction(db);
+    if (rc != 0) return rc;
+
+    int released;
+    while ((released = release_lapsed_holds(db, now)) == HOLD_RELEASE_BATCH);
+    if (released == -1) return rollback_transaction(db);
+
+    sqlite3_stmt *stmt_reserve_stock = statement(db, STMT_RESERVE_STOCK);
+    sqlite3_bind_int(stmt_reserve_stock, 1, quantity);
+    sqlite3_bind_int(stmt_reserve_stock, 2, item_id);
+    sqlite3_bind_int(stmt_reserve_stock, 3, event_id);
+
+    rc = step_returning_int(stmt_reserve_stock, available);
+    if (rc != 1) {
+        if (rc == 0) fprintf(stderr, "Not enough stock of item %d in event %d for %d unit(s).\n", item_id, event_id, quantity);
+        else fprintf(stderr, "Error in reserving stock: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
 
+    sqlite3_stmt *stmt_insert_stock_hold = statement(db, STMT_INSERT_STOCK_HOLD);
+    sqlite3_bind_int(stmt_insert_stock_hold, 1, event_id);
+    sqlite3_bind_int(stmt_insert_stock_hold, 2, item_id);
+    sqlite3_bind_int(stmt_insert_stock_hold, 3, quantity);
+    sqlite3_bind_int64(stmt_insert_stock_hold, 4, expires_at);
 
-        printf("Enter end time (YYYY-MM-DD HH:MM:SS): ");
-        char end_time_str[21];
-        fgets(end_time_str, sizeof(end_time_str), stdin);
-        end_time_str[strcspn(end_time_str, "\n")] = 0;
+    if (step_returning_int(stmt_insert_stock_hold, hold_id) != 1) {
+        fprintf(stderr, "Error in recording stock hold: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
 
-        struct tm tm = {0};
-        
-        strptime(start_time_str, "%Y-%m-%d %H:%M:%S", &tm);
-        new_event.start_time = mktime(&tm);
+    return commit_operation(db, NULL, NULL);
+}
 
-        strptime(end_time_str, "%Y-%m-%d %H:%M:%S", &tm);
-        new_event.end_time = mktime(&tm);
-    } else {
-        new_event.start_time = 0;
-        new_event.end_time = 0;
+// Deletes a hold and gives its units back to the store. A hold the sweep has
+// already released is not an error. Returns 0, -1 or TRANSACTION_BUSY.
+int release_stock_hold(sqlite3 *db, int hold_id) {
+    int rc = begin_transaction(db);
+    if (rc != 0) return rc;
+
+    sqlite3_stmt *stmt_delete_stock_hold = statement(db, STMT_DELETE_STOCK_HOLD);
+    sqlite3_bind_int(stmt_delete_stock_hold, 1, hold_id);
+
+    rc = sqlite3_step(stmt_delete_stock_hold);
+    int event_id = sqlite3_column_int(stmt_delete_stock_hold, 0);
+    int item_id = sqlite3_column_int(stmt_delete_stock_hold, 1);
+    int quantity = sqlite3_column_int(stmt_delete_stock_hold, 2);
+    sqlite3_reset(stmt_delete_stock_hold);
+    if (rc == SQLITE_DONE) {
+        step_transaction_statement(db, statement(db, STMT_ROLLBACK_TRANSACTION));
+        return 0;
+    }
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, "Error in releasing stock hold: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
     }
 
-    sqlite3_bind_text(stmt_insert_events, 1, new_event.event_name, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt_insert_events, 2, new_event.currency_id);
-    sqlite3_bind_int(stmt_insert_events, 3, new_event.is_time_limited);
-    if (new_event.is_time_limited) {
-        sqlite3_bind_int64(stmt_insert_events, 4, new_event.start_time);
-        sqlite3_bind_int64(stmt_insert_events, 5, new_event.end_time);
-    } else {
-        sqlite3_bind_null(stmt_insert_events, 4);
-        sqlite3_bind_null(stmt_insert_events, 5);
+    sqlite3_stmt *stmt_release_stock = statement(db, STMT_RELEASE_STOCK);
+    sqlite3_bind_int(stmt_release_stock, 1, quantity);
+    sqlite3_bind_int(stmt_release_stock, 2, item_id);
+    sqlite3_bind_int(stmt_release_stock, 3, event_id);
+
+    int available;
+    int found = step_returning_int(stmt_release_stock, &available);
+    if (found == -1) {
+        fprintf(stderr, "Error in releasing stock: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
     }
-    sqlite3_bind_int(stmt_insert_events, 6, 1);
 
-    rc = sqlite3_step(stmt_insert_events);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error adding event: %s\n", sqlite3_errmsg(db));
-        sqlite3_reset(stmt_insert_events);
-        return;
+    if ((rc = commit_operation(db, NULL, NULL)) != 0) return rc;
+    if (found) affordability_set_stock(event_id, item_id, available);
+    return 0;
+}
+
+// Gives back the stock of a cart that is not going to be checked out
+void release_cart_holds(sqlite3 *db, struct cart_line *cart, int cart_count) {
+    for (int i = 0; i < cart_count; ++i) {
+        int attempt = 0;
+        while (release_stock_hold(shard_for_id(db, cart[i].event_id), cart[i].hold_id) == TRANSACTION_BUSY && transaction_backoff(&attempt));
     }
+}
 
-    sqlite3_reset(stmt_insert_events);
-    printf("Event added successfully\n");
-    new_event.event_id = sqlite3_last_insert_rowid(db);
+// Each pick is its own line, with the hold that reserved it
+int add_to_cart(struct cart_line **cart, int *cart_count, int *cart_capacity, int event_id, int item_id, int quantity, int hold_id) {
+    if (*cart_count >= *cart_capacity) {
+        int new_capacity = *cart_capacity ? *cart_capacity * 2 : 4;
+        struct cart_line *new_cart = realloc(*cart, new_capacity * sizeof(struct cart_line));
+        if (!new_cart) {
+            fprintf(stderr, "Unable to reallocate cart.\n");
+            return -1;
+        }
+        *cart = new_cart;
+        *cart_capacity = new_capacity;
+    }
 
-    printf("Enter the number of tasks for Event %s: ", new_event.event_name);
-    int num_tasks;
-    scanf("%d", &num_tasks);
-    flush_input_buffer();
+    (*cart)[*cart_count].event_id = event_id;
+    (*cart)[*cart_count].item_id = item_id;
+    (*cart)[*cart_count].quantity = quantity;
+    (*cart)[*cart_count].hold_id = hold_id;
+    (*cart_count)++;
+    return 0;
+}
 
-    for (int i = 1; i <= num_tasks; ++i) {
-        struct task new_task;
+// Buys every cart line in one transaction. Each line's stock was reserved when
+// it was added; its hold is claimed, and so must not have lapsed, and its
+// units move from held to sold. Each currency is debited once by its total
+// cost. Every check is fused with its write in a guarded statement, so
+// concurrent writers can neither oversell stock nor overdraw a balance between
+// a check and the write. Any failed guard rolls the whole cart back. The
+// optional operation ID is recorded in the same transaction. Returns 0, -1 or
+// TRANSACTION_BUSY.
+int checkout_cart(sqlite3 *db, struct cart_line *cart, int cart_count, const char *operation_id) {
+    struct currency_total {
+        int currency_id;
+        sqlite3_int64 total;
+        int balance;
+        int units;
+    };
 
-        new_task.event_id = new_event.event_id;
-        new_task.task_id = i;
+    int rc;
+    int total_count = 0;
+    struct currency_total *totals = malloc((cart_count > 0 ? cart_count : 1) * sizeof(struct currency_total));
+    int *stocks = malloc((cart_count > 0 ? cart_count : 1) * sizeof(int));
+    if (!totals || !stocks) {
+        fprintf(stderr, "Unable to allocate memory for checkout.\n");
+        free(totals);
+        free(stocks);
+        return -1;
+    }
 
-        printf("Enter task description: ");
-        fgets(new_task.task_description, sizeof(new_task.task_description), stdin);
-        new_task.task_description[strcspn(new_task.task_description, "\n")] = 0;
+    if ((rc = begin_transaction(db)) != 0) {
+        free(totals);
+        free(stocks);
+        return rc;
+    }
+    achievements.pending_count = 0;
+    achievements.pending_unlisted = 0;
+
+    // Lapsed points must not be spent before the sweep gets to them
+    time_t now = time(NULL);
+    int retired;
+    int lots_retired = 0;
+    while ((retired = retire_lapsed_lots(db, now)) == LOT_EXPIRY_BATCH) lots_retired += retired;
+    if (retired == -1) goto rollback;
+    lots_retired += retired;
+
+    for (int i = 0; i < cart_count; ++i) {
+        sqlite3_stmt *stmt_select_store_item_price = statement(db, STMT_SELECT_STORE_ITEM_PRICE);
+        sqlite3_bind_int(stmt_select_store_item_price, 1, cart[i].event_id);
+        sqlite3_bind_int(stmt_select_store_item_price, 2, cart[i].item_id);
+
+        rc = sqlite3_step(stmt_select_store_item_price);
+        if (rc != SQLITE_ROW) {
+            if (rc == SQLITE_DONE) fprintf(stderr, "Item %d of event %d is not available.\n", cart[i].item_id, cart[i].event_id);
+            else fprintf(stderr, "Error fetching item price: %s\n", sqlite3_errmsg(db));
+            sqlite3_reset(stmt_select_store_item_price);
+            goto rollback;
+        }
 
-        printf("Enter the currency amount rewarded upon completion: ");
-        scanf("%d", &new_task.currency_amount);
-        flush_input_buffer();
+        sqlite3_int64 line_cost = (sqlite3_int64)sqlite3_column_int(stmt_select_store_item_price, 0) * cart[i].quantity;
+        int currency_id = sqlite3_column_int(stmt_select_store_item_price, 1);
+        sqlite3_reset(stmt_select_store_item_price);
+
+        int t = 0;
+        while (t < total_count && totals[t].currency_id != currency_id) t++;
+        if (t == total_count) {
+            totals[t].currency_id = currency_id;
+            totals[t].total = 0;
+            totals[t].units = 0;
+            total_count++;
+        }
+        totals[t].total += line_cost;
+        totals[t].units += cart[i].quantity;
+
+        sqlite3_stmt *stmt_claim_stock_hold = statement(db, STMT_CLAIM_STOCK_HOLD);
+        sqlite3_bind_int(stmt_claim_stock_hold, 1, cart[i].hold_id);
+        sqlite3_bind_int(stmt_claim_stock_hold, 2, cart[i].event_id);
+        sqlite3_bind_int(stmt_claim_stock_hold, 3, cart[i].item_id);
+        sqlite3_bind_int64(stmt_claim_stock_hold, 4, now);
+
+        int held;
+        rc = step_returning_int(stmt_claim_stock_hold, &held);
+        if (rc == -1) {
+            fprintf(stderr, "Error in claiming stock hold: %s\n", sqlite3_errmsg(db));
+            goto rollback;
+        }
+        if (rc == 0 || held != cart[i].quantity) {
+            fprintf(stderr, "The reservation of item %d in event %d has expired.\n", cart[i].item_id, cart[i].event_id);
+            goto rollback;
+        }
 
-        new_task.is_completed = 0;
+        sqlite3_stmt *stmt_confirm_stock = statement(db, STMT_CONFIRM_STOCK);
+        sqlite3_bind_int(stmt_confirm_stock, 1, held);
+        sqlite3_bind_int(stmt_confirm_stock, 2, cart[i].item_id);
+        sqlite3_bind_int(stmt_confirm_stock, 3, cart[i].event_id);
 
-        sqlite3_bind_int(stmt_insert_tasks, 1, new_task.event_id);
-        sqlite3_bind_int(stmt_insert_tasks, 2, new_task.task_id);
-        sqlite3_bind_text(stmt_insert_tasks, 3, new_task.task_description, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt_insert_tasks, 4, new_task.currency_amount);
-        sqlite3_bind_int(stmt_insert_tasks, 5, new_task.is_completed);
+        rc = step_returning_int(stmt_confirm_stock, &stocks[i]);
+        if (rc != 1) {
+            fprintf(stderr, "Error in updating stock: %s\n", rc == 0 ? "held units are missing" : sqlite3_errmsg(db));
+            goto rollback;
+        }
+    }
 
-        rc = sqlite3_step(stmt_insert_tasks);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Error adding task: %s\n", sqlite3_errmsg(db));
-            sqlite3_reset(stmt_insert_tasks);
-            return;
+    for (int t = 0; t < total_count; ++t) {
+        sqlite3_stmt *stmt_debit_balance = statement(db, STMT_DEBIT_BALANCE);
+        sqlite3_bind_int64(stmt_debit_balance, 1, totals[t].total);
+        sqlite3_bind_int(stmt_debit_balance, 2, totals[t].currency_id);
+
+        rc = step_returning_int(stmt_debit_balance, &totals[t].balance);
+        if (rc == -1) {
+            fprintf(stderr, "Error in updating balance: %s\n", sqlite3_errmsg(db));
+            goto rollback;
+        }
+        if (rc == 0) {
+            fprintf(stderr, "Insufficient balance in currency %d for %lld.\n", totals[t].currency_id, (long long)totals[t].total);
+            goto rollback;
         }
+        if (consume_currency_lots(db, totals[t].currency_id, totals[t].total) != 0) goto rollback;
+        if (count_achievement_progress(db, METRIC_SPENT, totals[t].currency_id, totals[t].total, now) != 0) goto rollback;
+        if (count_achievement_progress(db, METRIC_ITEMS_BOUGHT, totals[t].currency_id, totals[t].units, now) != 0) goto rollback;
+    }
 
-        sqlite3_reset(stmt_insert_tasks);
-        printf("Task %d added successfully\n", i);
+    int unit_count = 0;
+    for (int i = 0; i < cart_count; ++i) unit_count += cart[i].quantity;
+
+    char result[64];
+    snprintf(result, sizeof(result), "bought %d unit(s) in %d line(s)", unit_count, cart_count);
+    if ((rc = commit_operation(db, operation_id, result)) != 0) {
+        free(totals);
+        free(stocks);
+        return rc;
     }
 
-    printf("Enter the number of store items associated with this event: ");
-    int num_items;
-    scanf("%d", &num_items);
-    flush_input_buffer();
+    for (int i = 0; i < cart_count; ++i) {
+        affordability_set_stock(cart[i].event_id, cart[i].item_id, stocks[i]);
+    }
+    for (int t = 0; t < total_count; ++t) {
+        affordability_set_balance(totals[t].currency_id, totals[t].balance);
+    }
+    // Lots of other currencies may have lapsed too
+    if (lots_retired > 0) affordability_invalidate();
+    achievements_announce();
 
-    for (int i = 1; i <= num_items; ++i) {
-        struct store_item new_store_item;
+    free(totals);
+    free(stocks);
+    return 0;
 
-        new_store_item.item_id = i;
+rollback:
+    rc = rollback_transaction(db);
+    free(totals);
+    free(stocks);
+    return rc;
+}
 
-        printf("Enter item description: ");
-        fgets(new_store_item.item_description, sizeof(new_store_item.item_description), stdin);
-        new_store_item.item_description[strcspn(new_store_item.item_description, "\n")] = 0;
+void buy_item(sqlite3 *db) {
+    int currency_count;
+    struct currency *currencies = get_currencies(db, &currency_count);
 
-        printf("Enter cost of the item: ");
-        scanf("%d", &new_store_item.cost);
-        flush_input_buffer();
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
 
-        new_store_item.event_id = new_event.event_id;
+    int e_id_width = 10;
+    int e_name_width = 30;
+    int time_width = 30;
+    int c_name_width = 30;
+    int bal_width = 20;
 
-        printf("Enter item stock(-1 for infinity): ");
-        scanf("%d", &new_store_item.stock);
-        flush_input_buffer();
+    print_top_border(6, e_id_width, e_name_width, time_width, time_width, c_name_width, bal_width);
+    print_table_row(6, "ID", e_id_width, "Event Name", e_name_width, "Start Time", time_width, "End Time", time_width, "Currency", c_name_width, "Balance", bal_width);
+    print_row_separator(6, e_id_width, e_name_width, time_width, time_width, c_name_width, bal_width);
 
-        printf("Enter category: ");
-        fgets(new_store_item.category, sizeof(new_store_item.category), stdin);
-        new_store_item.category[strcspn(new_store_item.category, "\n")] = 0;
+    for (int i = 0; i < event_count; ++i) {
+        char id_str[10];
+        snprintf(id_str, sizeof(id_str), "%d", events[i].event_id);
 
-        sqlite3_bind_int(stmt_insert_store, 1, new_store_item.item_id);
-        sqlite3_bind_text(stmt_insert_store, 2, new_store_item.item_description, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt_insert_store, 3, new_store_item.cost);
-        sqlite3_bind_int(stmt_insert_store, 4, new_store_item.event_id);
-        sqlite3_bind_int(stmt_insert_store, 5, new_store_item.stock);
-        sqlite3_bind_text(stmt_insert_store, 6, new_store_item.category, -1, SQLITE_TRANSIENT);
+        char start_time_str[TIMESTAMP_SIZE] = "N/A";
+        char end_time_str[TIMESTAMP_SIZE] = "N/A";
 
-        rc = sqlite3_step(stmt_insert_store);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Error adding item: %s\n", sqlite3_errmsg(db));
-            sqlite3_reset(stmt_insert_store);
-            return;
+        if (events[i].start_time != -1 && events[i].end_time != -1) {
+            format_timestamp(events[i].start_time, start_time_str, sizeof(start_time_str));
+            format_timestamp(events[i].end_time, end_time_str, sizeof(end_time_str));
         }
 
-        sqlite3_reset(stmt_insert_store);
-        printf("Item %d added successfully\n", i);
+        for (int j = 0; j < currency_count; ++j) {
+            if (currencies[j].currency_id == events[i].currency_id) {
+                char bal_str[20];
+                snprintf(bal_str, sizeof(bal_str), "%d %ss", currencies[j].balance, currencies[j].symbol);
+
+                print_table_row(6, id_str, e_id_width, events[i].event_name, e_name_width, start_time_str, time_width, end_time_str, time_width, currencies[j].currency_name, c_name_width, bal_str, bal_width);
+                break;
+            }
+        }
     }
-}
+    print_bottom_border(6, e_id_width, e_name_width, time_width, time_width, c_name_width, bal_width);
 
-void print_events_table(struct event *events, int event_count) {
-    int id_width = 10;
-    int name_width = 30;
-    int time_width = 30;
+    struct cart_line *cart = NULL;
+    int cart_count = 0;
+    int cart_capacity = 0;
+    int interrupted = 0;
 
-    print_top_border(4, id_width, name_width, time_width, time_width);
-    print_table_row(4, "ID", id_width, "Name", name_width, "Start Time", time_width, "End Time", time_width);
-    print_row_separator(4, id_width, name_width, time_width, time_width);
+    while (1) {
+        printf("Enter event associated with the store (0 to checkout): ");
+        int chosen_event_id = 0;
+        if (read_int(&chosen_event_id) == -1) {
+            interrupted = 1;
+            break;
+        }
 
-    for (int i = 0; i < event_count; ++i) {
-        char start_time_str[21] = "N/A";
-        char end_time_str[21] = "N/A";
+        if (chosen_event_id == 0) break;
 
-        if (events[i].start_time != -1 && events[i].end_time != -1) {
-            struct tm *start_tm = localtime(&events[i].start_time);
-            struct tm *end_tm = localtime(&events[i].end_time);
+        int chosen_currency_id = -1;
+        for (int i = 0; i < event_count; ++i) {
+            if (events[i].event_id == chosen_event_id) {
+                chosen_currency_id = events[i].currency_id;
+                break;
+            }
+        }
+        if (chosen_currency_id == -1) {
+            fprintf(stderr, "Could not find currency ID.\n");
+            continue;
+        }
+
+        int currency_idx = -1;
+        for (int i = 0; i < currency_count; ++i) {
+            if (currencies[i].currency_id == chosen_currency_id) {
+                currency_idx = i;
+                break;
+            }
+        }
+        if (currency_idx == -1) {
+            fprintf(stderr, "Could not find currency index.\n");
+            continue;
+        }
 
-            strftime(start_time_str, sizeof(start_time_str), "%Y-%m-%d %H:%M:%S", start_tm);
-            strftime(end_time_str, sizeof(end_time_str), "%Y-%m-%d %H:%M:%S", end_tm);
+        // Only list what the balance can pay for; the affordability index keeps
+        // in-stock items sorted by cost, so this is the prefix up to the balance.
+        int store_item_count;
+        struct store_item *store_items = get_affordable_items(db, chosen_event_id, &store_item_count, NULL);
+        if (store_item_count == 0) {
+            printf("Nothing in this store is affordable with your current balance.\n");
+            continue;
         }
 
-        char id_str[10];
-        snprintf(id_str, sizeof(id_str), "%d", events[i].event_id);
+        int s_id_width = 10;
+        int desc_width = 80;
+        int cost_width = 20;
+        int stock_width = 10;
+        int category_width = 20;
+
+        print_top_border(5, s_id_width, desc_width, cost_width, stock_width, category_width);
+        print_table_row(5, "ID", s_id_width, "Description", desc_width, "Cost", cost_width, "Stock", stock_width, "Category", category_width);
+        print_row_separator(5, s_id_width, desc_width, cost_width, stock_width, category_width);
+
+        for (int i = 0; i < store_item_count; ++i) {
+            char id_str[10];
+            snprintf(id_str, sizeof(id_str), "%d", store_items[i].item_id);
 
-        print_table_row(4, id_str, id_width, events[i].event_name, name_width, start_time_str, time_width, end_time_str, time_width);
+            char cost_str[20];
+            snprintf(cost_str, sizeof(cost_str), "%d %s", store_items[i].cost, currencies[currency_idx].symbol);
 
-        // if (i < event_count - 1) {
-        //     print_row_separator(4, id_width, name_width, time_width, time_width);
-        // }
-    }
+            char stock_str[10];
+            if (store_items[i].stock == -1) {
+                snprintf(stock_str, sizeof(stock_str), "INF");
+            }
+            else snprintf(stock_str, sizeof(stock_str), "%d", store_items[i].stock);
 
-    print_bottom_border(4, id_width, name_width, time_width, time_width);
-}
+            print_table_row(5, id_str, s_id_width, store_items[i].item_description, desc_width, cost_str, cost_width, stock_str, stock_width, store_items[i].category, category_width);
+        }
+        print_bottom_border(5, s_id_width, desc_width, cost_width, stock_width, category_width);
 
-struct event * get_active_events(sqlite3 *db, int *event_count) {
-    int rc;
-    struct event *events = NULL;
-    *event_count = 0;
-    int event_capacity = 10;
-    events = malloc(event_capacity * sizeof(struct event));
-    if (!events) {
-        fprintf(stderr, "Unable to allocate memory for events.\n");
-        return NULL;
-    }
+        printf("Enter item to buy: ");
+        int chosen_item_id = 0;
+        if (read_int(&chosen_item_id) == -1) {
+            interrupted = 1;
+            break;
+        }
 
-    while ((rc = sqlite3_step(stmt_select_active_events)) == SQLITE_ROW) {
-        if (*event_count >= event_capacity) {
-            event_capacity *= 2;
-            struct event *new_events = realloc(events, event_capacity * sizeof(struct event));
-            if (!new_events) {
-                fprintf(stderr, "Unable to reallocate events.\n");
-                free(events);
-                return NULL;
+        int item_idx = -1;
+        for (int i = 0; i < store_item_count; ++i) {
+            if (chosen_item_id == store_items[i].item_id) {
+                item_idx = i;
+                break;
             }
-            events = new_events;
+        }
+        if (item_idx == -1) {
+            fprintf(stderr, "Item is out of stock, unaffordable or does not exist.\n");
+            continue;
         }
 
-        events[*event_count].event_id = sqlite3_column_int(stmt_select_active_events, 0);
-        const char *event_name = (const char *)sqlite3_column_text(stmt_select_active_events, 1);
-        strncpy(events[*event_count].event_name, event_name, sizeof(events[*event_count].event_name) - 1);
-        events[*event_count].event_name[sizeof(events[*event_count].event_name) - 1] = '\0';
-        events[*event_count].currency_id = sqlite3_column_int(stmt_select_active_events, 2);
-        events[*event_count].is_time_limited = sqlite3_column_int(stmt_select_active_events, 3);
+        printf("Enter quantity: ");
+        int quantity = 0;
+        if (read_int(&quantity) == -1) {
+            interrupted = 1;
+            break;
+        }
 
-        if (sqlite3_column_type(stmt_select_active_events, 4) == SQLITE_NULL) {
-            events[*event_count].start_time = -1;
-        } else {
-            events[*event_count].start_time = sqlite3_column_int64(stmt_select_active_events, 4);
+        if (quantity <= 0) {
+            fprintf(stderr, "Quantity must be positive.\n");
+            continue;
         }
 
-        if (sqlite3_column_type(stmt_select_active_events, 5) == SQLITE_NULL) {
-            events[*event_count].end_time = -1;
-        } else {
-            events[*event_count].end_time = sqlite3_column_int64(stmt_select_active_events, 5);
+        // One transaction can only span one shard, so refuse the line before
+        // holding any of its stock
+        if (cart_count > 0 && shard_for_id(db, chosen_event_id) != shard_for_id(db, cart[0].event_id)) {
+            fprintf(stderr, "The stores of events %d and %d are kept in different shards, check them out separately.\n", cart[0].event_id, chosen_event_id);
+            continue;
         }
-        
-        events[*event_count].is_active = sqlite3_column_int(stmt_select_active_events, 6);
 
-        (*event_count)++;
+        // The units are held from now on, so nobody can buy them from under
+        // the cart before checkout
+        time_t now = time(NULL);
+        int hold_id;
+        int available;
+        int attempt = 0;
+        int rc;
+        while ((rc = reserve_stock(shard_for_id(db, chosen_event_id), chosen_event_id, chosen_item_id, quantity, now, now + STOCK_HOLD_TTL, &hold_id, &available)) == TRANSACTION_BUSY && transaction_backoff(&attempt));
+        if (rc != 0) continue;
+        affordability_set_stock(chosen_event_id, chosen_item_id, available);
+        scheduler_add_hold(now + STOCK_HOLD_TTL);
+
+        if (add_to_cart(&cart, &cart_count, &cart_capacity, chosen_event_id, chosen_item_id, quantity, hold_id) != 0) {
+            struct cart_line line = { chosen_event_id, chosen_item_id, quantity, hold_id };
+            release_cart_holds(db, &line, 1);
+            release_cart_holds(db, cart, cart_count);
+            free(cart);
+            free(currencies);
+            free(events);
+            return;
+        }
+        printf("Added %d x item %d to the cart, reserved for %d minutes.\n", quantity, chosen_item_id, STOCK_HOLD_TTL / 60);
     }
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error fetching active rows: %s\n", sqlite3_errmsg(db));
+    // An interrupted prompt abandons the cart; only an explicit 0 checks out
+    if (interrupted) {
+        release_cart_holds(db, cart, cart_count);
+        free(cart);
+        free(currencies);
         free(events);
-        sqlite3_reset(stmt_select_active_events);
-        return NULL;
+        return;
     }
 
-    sqlite3_reset(stmt_select_active_events);
-    return events;
-}
-
-struct task * get_incomplete_tasks_of_an_event(sqlite3 *db, int *task_count, int event_id) {
-    int rc;
-    struct task *tasks = NULL;
-    *task_count = 0;
-    int task_capacity = 10;
-    tasks = malloc(task_capacity * sizeof(struct task));
-    if (!tasks) {
-        fprintf(stderr, "Unable to allocate memory for tasks.\n");
-        return NULL;
+    if (cart_count == 0) {
+        printf("Cart is empty.\n");
+        free(currencies);
+        free(events);
+        return;
     }
 
-    sqlite3_bind_int(stmt_select_incomplete_tasks_of_an_event, 1, event_id);
+    // Every line is in the first one's shard, see above
+    sqlite3 *shard = shard_for_id(db, cart[0].event_id);
 
-    while ((rc = sqlite3_step(stmt_select_incomplete_tasks_of_an_event)) == SQLITE_ROW) {
-        if (*task_count >= task_capacity) {
-            task_capacity *= 2;
-            struct task *new_tasks = realloc(tasks, task_capacity * sizeof(struct task));
-            if (!new_tasks) {
-                fprintf(stderr, "Unable to reallocate tasks.\n");
-                sqlite3_reset(stmt_select_incomplete_tasks_of_an_event);
-                free(tasks);
-                return NULL;
-            }
-            tasks = new_tasks;
-        }
+    char operation_id[128];
+    int has_operation_id = read_operation_id(operation_id, sizeof(operation_id));
+    if (has_operation_id == -1 || (has_operation_id && operation_already_applied(db, operation_id) != 0)) {
+        release_cart_holds(db, cart, cart_count);
+        free(cart);
+        free(currencies);
+        free(events);
+        return;
+    }
 
-        tasks[*task_count].event_id = sqlite3_column_int(stmt_select_incomplete_tasks_of_an_event, 0);
-        tasks[*task_count].task_id = sqlite3_column_int(stmt_select_incomplete_tasks_of_an_event, 1);
-        const char *task_name = (const char *)sqlite3_column_text(stmt_select_incomplete_tasks_of_an_event, 2);
-        strncpy(tasks[*task_count].task_description, task_name, sizeof(tasks[*task_count].task_description) - 1);
-        tasks[*task_count].task_description[sizeof(tasks[*task_count].task_description) - 1] = '\0';
-        tasks[*task_count].currency_amount = sqlite3_column_int(stmt_select_incomplete_tasks_of_an_event, 3);
-        tasks[*task_count].is_completed = sqlite3_column_int(stmt_select_incomplete_tasks_of_an_event, 4);
+    if (achievements_load(db) != 0) fprintf(stderr, "Could not load the achievements.\n");
 
-        (*task_count)++;
+    int attempt = 0;
+    int rc;
+    while ((rc = checkout_cart(shard, cart, cart_count, operation_id)) == TRANSACTION_BUSY && transaction_backoff(&attempt));
+    if (rc != 0) {
+        fprintf(stderr, "Checkout failed, nothing was bought.\n");
+        release_cart_holds(db, cart, cart_count);
+        free(cart);
+        free(currencies);
+        free(events);
+        return;
     }
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error fetching tasks: %s\n", sqlite3_errmsg(db));
-        free(tasks);
-        sqlite3_reset(stmt_select_incomplete_tasks_of_an_event);
-        return NULL;
-    }
+    printf("Checkout complete.\n");
+    printf("Current balance\n");
+    free(currencies);
+    currencies = get_currencies(db, &currency_count);
+    print_currency_table(currencies, currency_count);
 
-    sqlite3_reset(stmt_select_incomplete_tasks_of_an_event);
-    return tasks;
+    free(cart);
+    free(currencies);
+    free(events);
 }
 
-void print_tasks_table(struct task *tasks, int task_count) {
+// Task line of the events and tasks listing; context is the currency symbol
+int print_event_task_row(const struct task_row *row, void *context) {
+    const char *symbol = context;
     int id_width = 10;
-    int desc_width = 100;
-    int amount_width = 20;
+    int name_desc_width = 80;
+    int time_width = 20;
 
-    print_top_border(3, id_width, desc_width, amount_width);
-    print_table_row(3, "ID", id_width, "Task Description", desc_width, "Amount", amount_width);
-    print_row_separator(3, id_width, desc_width, amount_width);
+    char t_id_str[10];
+    snprintf(t_id_str, sizeof(t_id_str), "%d", row->task_id);
 
-    for (int i = 0; i < task_count; ++i) {
-        char id_str[10];
-        snprintf(id_str, sizeof(id_str), "%d", tasks[i].task_id);
+    char curr_str[20];
+    snprintf(curr_str, sizeof(curr_str), "%d %s", row->currency_amount, symbol);
+
+    char completed[32];
+    if (row->is_completed) {
+        snprintf(completed, sizeof(completed), "Yes");
+    } else if (row->remaining_prereqs > 0) {
+        snprintf(completed, sizeof(completed), "Locked (%d left)", row->remaining_prereqs);
+    } else snprintf(completed, sizeof(completed), "No");
 
-        char amount_str[10];
-        snprintf(amount_str, sizeof(amount_str), "%d", tasks[i].currency_amount);
+    print_table_row(4, t_id_str, id_width, row->task_description, name_desc_width, curr_str, time_width, completed, time_width);
+    return 0;
+}
+
+// The machine-readable form of list_events_and_tasks: the events, then the
+// tasks of all of them as one record set, then the pending events
+void write_events_and_tasks(sqlite3 *db, struct event *events, int event_count) {
+    print_events_table(events, event_count);
 
-        print_table_row(3, id_str, id_width, tasks[i].task_description, desc_width, amount_str, amount_width);
+    output_begin("tasks", task_columns, TASK_COLUMN_COUNT);
+    for (int i = 0; i < event_count; ++i) {
+        if (visit_tasks(db, statement(db, STMT_SELECT_ALL_TASKS_OF_AN_EVENT), events[i].event_id, write_task_row, NULL) < 0) break;
     }
+    output_end();
 
-    print_bottom_border(3, id_width, desc_width, amount_width);
+    int pending_count;
+    struct event *pending = get_pending_events(db, &pending_count);
+    if (pending) print_events_table(pending, pending_count);
+    free(pending);
 }
 
-struct currency * get_currencies(sqlite3 *db, int *currency_count) {
-    int rc;
-    struct currency *currencies;
-    *currency_count = 0;
-    int currency_capacity = 10;
-    currencies = malloc(currency_capacity * sizeof(struct currency));
-    if (!currencies) {
-        fprintf(stderr, "Failed to allocated memory for currencies.\n");
-        return NULL;
+void list_events_and_tasks(sqlite3 *db) {
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
+
+    if (output.format != OUTPUT_TABLE) {
+        write_events_and_tasks(db, events, event_count);
+        free(events);
+        return;
     }
 
-    while ((rc = sqlite3_step(stmt_select_currency)) == SQLITE_ROW) {
-        if (*currency_count >= currency_capacity) {
-            currency_capacity *= 2;
-            struct currency *new_currencies = realloc(currencies, currency_capacity * sizeof(struct currency));
-            if (!new_currencies) {
-                fprintf(stderr, "Failed to reallocate currencies.\n");
-                sqlite3_reset(stmt_select_currency);
-                free(currencies);
-                return NULL;
+    int currency_count;
+    struct currency *currencies = get_currencies(db, &currency_count);
+
+    int id_width = 10;
+    int name_desc_width = 80;
+    int time_width = 20;
+
+    print_top_border(4, id_width, name_desc_width, time_width, time_width);
+    print_table_row(4, "EID/TID", id_width, "Name/Description", name_desc_width, "Start Time/Currency", time_width, "End Time/Completed", time_width);
+    print_row_separator(4, id_width, name_desc_width, time_width, time_width);
+
+    for (int i = 0; i < event_count; ++i) {
+
+        int currency_idx = -1;
+        for (int j = 0; j < currency_count; ++j) {
+            if (currencies[j].currency_id == events[i].currency_id) {
+                currency_idx = j;
+                break;
             }
-            currencies = new_currencies;
+        }
+        if (currency_idx == -1) {
+            fprintf(stderr, "Could not find currency index.\n");
+            free(events);
+            free(currencies);
+            return;
         }
 
-        currencies[*currency_count].currency_id = sqlite3_column_int(stmt_select_currency, 0);
-        const char *currency_name = (const char *)sqlite3_column_text(stmt_select_currency, 1);
-        strncpy(currencies[*currency_count].currency_name, currency_name, sizeof(currencies[*currency_count].currency_name) - 1);
-        currencies[*currency_count].currency_name[sizeof(currencies[*currency_count]) - 1] = '\0';
-        const char *symbol = (const char *)sqlite3_column_text(stmt_select_currency, 2);
-        strncpy(currencies[*currency_count].symbol, symbol, sizeof(currencies[*currency_count].symbol) - 1);
-        currencies[*currency_count].symbol[sizeof(currencies[*currency_count].symbol) - 1] = '\0';
-        currencies[*currency_count].balance = sqlite3_column_int(stmt_select_currency, 3);
+        char e_id_str[10];
+        snprintf(e_id_str, sizeof(e_id_str), "%d", events[i].event_id);
 
-        (*currency_count)++;
+        char start_time_str[TIMESTAMP_SIZE] = "N/A";
+        char end_time_str[TIMESTAMP_SIZE] = "N/A";
+
+        if (events[i].start_time != -1 && events[i].end_time != -1) {
+            format_timestamp(events[i].start_time, start_time_str, sizeof(start_time_str));
+            format_timestamp(events[i].end_time, end_time_str, sizeof(end_time_str));
+        }
+
+        print_table_row(4, e_id_str, id_width, events[i].event_name, name_desc_width, start_time_str, time_width, end_time_str, time_width);
+        print_row_separator(4, id_width, name_desc_width, time_width, time_width);
+
+        visit_tasks(db, statement(db, STMT_SELECT_ALL_TASKS_OF_AN_EVENT), events[i].event_id, print_event_task_row, currencies[currency_idx].symbol);
+
+        if (i < event_count - 1)
+            print_row_separator(4, id_width, name_desc_width, time_width, time_width);
     }
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error fetching currencies: %s\n", sqlite3_errmsg(db));
-        free(currencies);
-        sqlite3_reset(stmt_select_incomplete_tasks_of_an_event);
-        return NULL;
+    print_bottom_border(4, id_width, name_desc_width, time_width, time_width);
+
+    free(events);
+    free(currencies);
+
+    int pending_count;
+    struct event *pending = get_pending_events(db, &pending_count);
+    if (pending && pending_count > 0) {
+        printf("Upcoming events\n");
+        print_events_table(pending, pending_count);
     }
+    free(pending);
+}
 
-    sqlite3_reset(stmt_select_currency);
-    return currencies;
+// Returns the single integer a PRAGMA yields, or -1 on error.
+int select_pragma_int(sqlite3_stmt *stmt) {
+    int value = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int(stmt, 0);
+    sqlite3_reset(stmt);
+    return value;
 }
 
-void print_currency_table(struct currency *currencies, int currency_count) {
-    int id_width = 10;
-    int name_width = 20;
-    int symbol_width = 10;
-    int balance_width = 20;
+// Reclaims at most VACUUM_STEP_PAGES free pages from main and, if with_archive,
+// the archive, each in its own short write transaction. Returns the number of
+// free pages left.
+int vacuum_step(sqlite3 *db, int with_archive) {
+    sqlite3_stmt *freelist[] = { statement(db, STMT_SELECT_MAIN_FREELIST_COUNT), statement(db, STMT_SELECT_ARCHIVE_FREELIST_COUNT) };
+    sqlite3_stmt *vacuum[] = { statement(db, STMT_MAIN_INCREMENTAL_VACUUM), statement(db, STMT_ARCHIVE_INCREMENTAL_VACUUM) };
 
-    print_top_border(4, id_width, name_width, symbol_width, balance_width);
-    print_table_row(4, "ID", id_width, "Name", name_width, "Symbol", symbol_width, "Balance", balance_width);
-    print_row_separator(4, id_width, name_width, symbol_width, balance_width);
+    int remaining = 0;
+    int schema_count = with_archive ? 2 : 1;
+    for (int i = 0; i < schema_count; i++) {
+        int free_pages = select_pragma_int(freelist[i]);
+        if (free_pages <= 0) continue;
 
-    for (int i = 0; i < currency_count; ++i) {
-        char id_str[10];
-        snprintf(id_str, sizeof(id_str), "%d", currencies[i].currency_id);
+        int rc;
+        while ((rc = sqlite3_step(vacuum[i])) == SQLITE_ROW);
+        sqlite3_reset(vacuum[i]);
+        if (rc != SQLITE_DONE) {
+            // Busy or failed; try again on the next idle tick
+            fprintf(stderr, "Incremental vacuum failed: %s\n", sqlite3_errmsg(db));
+            return 0;
+        }
 
-        char bal_str[10];
-        snprintf(bal_str, sizeof(bal_str), "%d", currencies[i].balance);
+        free_pages = select_pragma_int(freelist[i]);
+        if (free_pages > 0) remaining += free_pages;
+    }
 
-        print_table_row(4, id_str, id_width, currencies[i].currency_name, name_width, currencies[i].symbol, symbol_width, bal_str, balance_width);
+    return remaining;
+}
+
+// Fragmentation is the share of b-tree leaf pages that do not directly follow
+// their predecessor on disk. It needs the dbstat virtual table, so it is
+// reported as n/a on SQLite builds without it.
+double leaf_fragmentation(sqlite3 *db, const char *schema) {
+    const char *sql =
+        "SELECT count(*), total(pageno != prev + 1) FROM ("
+        "SELECT pageno, lag(pageno) OVER (PARTITION BY name ORDER BY path) AS prev "
+        "FROM dbstat(?1) WHERE pagetype = 'leaf'"
+        ") WHERE prev IS NOT NULL;";
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+
+    double fragmentation = -1;
+    sqlite3_bind_text(stmt, 1, schema, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        int transitions = sqlite3_column_int(stmt, 0);
+        fragmentation = transitions > 0 ? 100.0 * sqlite3_column_double(stmt, 1) / transitions : 0;
     }
+    sqlite3_finalize(stmt);
 
-    print_bottom_border(4, id_width, name_width, symbol_width, balance_width);
+    return fragmentation;
 }
 
-void mark_task_done(sqlite3 *db) {
-    int rc;
+void print_storage_stats(sqlite3 *db) {
+    const char *schemas[] = { "main", "archive" };
+    sqlite3_stmt *page_count[] = { statement(db, STMT_SELECT_MAIN_PAGE_COUNT), statement(db, STMT_SELECT_ARCHIVE_PAGE_COUNT) };
+    sqlite3_stmt *freelist[] = { statement(db, STMT_SELECT_MAIN_FREELIST_COUNT), statement(db, STMT_SELECT_ARCHIVE_FREELIST_COUNT) };
 
-    int event_count;
-    struct event *events = get_active_events(db, &event_count);
+    int name_width = 10;
+    int pages_width = 12;
+    int free_width = 12;
+    int free_pct_width = 10;
+    int frag_width = 14;
 
-    print_events_table(events, event_count);
+    printf("Storage\n");
+    print_top_border(5, name_width, pages_width, free_width, free_pct_width, frag_width);
+    print_table_row(5, "Database", name_width, "Pages", pages_width, "Free pages", free_width, "Free", free_pct_width, "Fragmentation", frag_width);
+    print_row_separator(5, name_width, pages_width, free_width, free_pct_width, frag_width);
 
-    int chosen_event_id;
-    printf("Choose which event the task belongs to: ");
-    scanf("%d", &chosen_event_id);
-    flush_input_buffer();
+    for (int i = 0; i < sizeof(schemas) / sizeof(schemas[0]); i++) {
+        int pages = select_pragma_int(page_count[i]);
+        int free_pages = select_pragma_int(freelist[i]);
+        double fragmentation = leaf_fragmentation(db, schemas[i]);
 
-    int chosen_currency_id = -1;
-    for (int i = 0; i < event_count; ++i) {
-        if (events[i].event_id == chosen_event_id) {
-            chosen_currency_id = events[i].currency_id;
-            break;
-        }
-    }
-    free(events);
-    if (chosen_currency_id == -1) {
-        fprintf(stderr, "Could not find currency ID.\n");
-        return;
-    }
+        char pages_str[12];
+        snprintf(pages_str, sizeof(pages_str), "%d", pages);
 
-    int task_count;
-    struct task *tasks = get_incomplete_tasks_of_an_event(db, &task_count, chosen_event_id);
+        char free_str[12];
+        snprintf(free_str, sizeof(free_str), "%d", free_pages);
 
-    if (task_count == 0) {
-        printf("No tasks left.\n");
-        return;
+        char free_pct_str[10];
+        snprintf(free_pct_str, sizeof(free_pct_str), "%.1f%%", pages > 0 ? 100.0 * free_pages / pages : 0);
+
+        char frag_str[14];
+        if (fragmentation < 0) snprintf(frag_str, sizeof(frag_str), "n/a");
+        else snprintf(frag_str, sizeof(frag_str), "%.1f%%", fragmentation);
+
+        print_table_row(5, schemas[i], name_width, pages_str, pages_width, free_str, free_width, free_pct_str, free_pct_width, frag_str, frag_width);
     }
 
-    print_tasks_table(tasks, task_count);
+    print_bottom_border(5, name_width, pages_width, free_width, free_pct_width, frag_width);
+}
 
-    int chosen_task_id;
-    printf("Choose completed task: ");
-    scanf("%d", &chosen_task_id);
-    flush_input_buffer();
+void list_event_history(sqlite3 *db) {
+    int event_count;
+    struct event *events = fetch_events(db, statement(db, STMT_SELECT_ENDED_EVENTS), &event_count);
+    if (!events) return;
 
-    int currency_amount = -1;
-    for (int i = 0; i < task_count; ++i) {
-        if (tasks[i].task_id == chosen_task_id) {
-            currency_amount = tasks[i].currency_amount;
-            break;
-        }
-    }
-    free(tasks);
-    if (currency_amount == -1) {
-        fprintf(stderr, "Could not find currency amount.\n");
+    if (event_count == 0) {
+        printf("No ended events yet.\n");
+        free(events);
         return;
     }
-    
-    sqlite3_bind_int(stmt_update_task_completion, 1, chosen_task_id);
-    sqlite3_bind_int(stmt_update_task_completion, 2, chosen_event_id);
 
-    rc = sqlite3_step(stmt_update_task_completion);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failure in updating completion: %s\n", sqlite3_errmsg(db));
-        sqlite3_reset(stmt_update_task_completion);
-        return;
-    }
+    printf("Ended events\n");
+    print_events_table(events, event_count);
+    free(events);
 
-    sqlite3_reset(stmt_update_task_completion);
-    printf("Task %d successfully completed. Keep it up!\n", chosen_task_id);
+    printf("Enter event to see its tasks (0 to skip): ");
+    int chosen_event_id = 0;
+    if (read_int(&chosen_event_id) == -1 || chosen_event_id <= 0) return;
+
+    print_tasks_table(db, statement(db, STMT_SELECT_ALL_TASKS_OF_AN_EVENT_HISTORY), chosen_event_id);
+}
 
-    sqlite3_bind_int(stmt_update_balance, 1, currency_amount);
-    sqlite3_bind_int(stmt_update_balance, 2, chosen_currency_id);
+void print_reward_rules(sqlite3 *db) {
+    if (reward_rules_load(db) != 0 || reward_rules.count == 0) return;
 
-    rc = sqlite3_step(stmt_update_balance);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error updating balance: %s\n", sqlite3_errmsg(db));
-        sqlite3_reset(stmt_update_balance);
-        return;
+    static const char *weekday_names[] = { "Su", "Mo", "Tu", "We", "Th", "Fr", "Sa" };
+    int id_width = 10;
+    int rule_width = 12;
+    int condition_width = 80;
+
+    printf("Reward rules (version %d)\n", reward_rules.version);
+    print_top_border(3, id_width, rule_width, condition_width);
+    print_table_row(3, "ID", id_width, "Rule", rule_width, "Applies to", condition_width);
+    print_row_separator(3, id_width, rule_width, condition_width);
+
+    for (int i = 0; i < reward_rules.count; ++i) {
+        const struct reward_rule *rule = &reward_rules.rules[i];
+
+        char id_str[12];
+        snprintf(id_str, sizeof(id_str), "%d", rule->rule_id);
+
+        char rule_str[24];
+        if (rule->kind == REWARD_RULE_MULTIPLY) snprintf(rule_str, sizeof(rule_str), "x %d%%", rule->value);
+        else snprintf(rule_str, sizeof(rule_str), "+ %d", rule->value);
+
+        char conditions[256] = "every completion";
+        int length = 0;
+        if (rule->match & REWARD_MATCH_EVENT) length += snprintf(conditions + length, sizeof(conditions) - length, "event %d ", rule->event_id);
+        if (rule->match & REWARD_MATCH_CURRENCY) length += snprintf(conditions + length, sizeof(conditions) - length, "currency %d ", rule->currency_id);
+        if (rule->match & REWARD_MATCH_WEEKDAYS) {
+            for (int d = 0; d < 7; d++) {
+                if (rule->weekdays & (1 << d)) length += snprintf(conditions + length, sizeof(conditions) - length, "%s ", weekday_names[d]);
+            }
+        }
+        if (rule->match & REWARD_MATCH_START) {
+            char time_str[TIMESTAMP_SIZE];
+            format_timestamp(rule->start_time, time_str, sizeof(time_str));
+            length += snprintf(conditions + length, sizeof(conditions) - length, "from %s ", time_str);
+        }
+        if (rule->match & REWARD_MATCH_END) {
+            char time_str[TIMESTAMP_SIZE];
+            format_timestamp(rule->end_time, time_str, sizeof(time_str));
+            length += snprintf(conditions + length, sizeof(conditions) - length, "until %s ", time_str);
+        }
+        if (rule->match & REWARD_MATCH_STREAK) length += snprintf(conditions + length, sizeof(conditions) - length, "streak >= %d ", rule->min_streak);
+        if (length > 0 && length < sizeof(conditions)) conditions[length - 1] = '\0';
+
+        print_table_row(3, id_str, id_width, rule_str, rule_width, conditions, condition_width);
     }
 
-    sqlite3_reset(stmt_update_balance);
+    print_bottom_border(3, id_width, rule_width, condition_width);
+}
+
+// The next lapse of each expiring currency
+void print_lot_expiries(sqlite3 *db) {
+    int id_width = 10;
+    int time_width = 30;
+    int amount_width = 20;
+    int rows = 0;
+
+    sqlite3_stmt *stmt_select_next_lot_expiries = statement(db, STMT_SELECT_NEXT_LOT_EXPIRIES);
+    while (sqlite3_step(stmt_select_next_lot_expiries) == SQLITE_ROW) {
+        if (rows++ == 0) {
+            printf("Expiring points\n");
+            print_top_border(3, id_width, time_width, amount_width);
+            print_table_row(3, "Currency", id_width, "Next expiry", time_width, "Amount", amount_width);
+            print_row_separator(3, id_width, time_width, amount_width);
+        }
+
+        char id_str[12];
+        snprintf(id_str, sizeof(id_str), "%d", sqlite3_column_int(stmt_select_next_lot_expiries, 0));
 
-    int currency_count;
-    struct currency *currencies = get_currencies(db, &currency_count);
+        char time_str[TIMESTAMP_SIZE];
+        format_timestamp(sqlite3_column_int64(stmt_select_next_lot_expiries, 1), time_str, sizeof(time_str));
 
-    int idx_in_array = -1;
-    for (int i = 0; i < currency_count; ++i) {
-        if (chosen_currency_id == currencies[i].currency_id) {
-            idx_in_array = i;
-            break;
-        }
-    }
-    if (idx_in_array == -1) {
-        fprintf(stderr, "Could not find currency index.\n");
-        free(currencies);
-        return;
-    }
+        char amount_str[24];
+        snprintf(amount_str, sizeof(amount_str), "%lld", (long long)sqlite3_column_int64(stmt_select_next_lot_expiries, 2));
 
-    printf("Currency %d has increased by %d %ss. Happy spending!\n", chosen_currency_id, currency_amount, currencies[idx_in_array].symbol);
+        print_table_row(3, id_str, id_width, time_str, time_width, amount_str, amount_width);
+    }
+    sqlite3_reset(stmt_select_next_lot_expiries);
 
-    printf("Current Balance\n");
-    print_currency_table(currencies, currency_count);
-    free(currencies);
+    if (rows > 0) print_bottom_border(3, id_width, time_width, amount_width);
 }
 
-struct store_item * get_store_items_by_event(sqlite3 *db, int *store_item_count, int chosen_event_id) {
-    int rc;
-    struct store_item *store_items;
-    *store_item_count = 0;
-    int store_item_capacity = 10;
-    store_items = malloc(store_item_capacity * sizeof(struct store_item));
-    if (!store_items) {
-        fprintf(stderr, "Unable to allocate memory for store items.\n");
-        return NULL;
+// Progress towards every achievement, and the Daily Missions streak
+void print_achievements(sqlite3 *db) {
+    sqlite3_stmt *stmt_select_daily_streak = statement(db, STMT_SELECT_DAILY_STREAK);
+    if (sqlite3_step(stmt_select_daily_streak) == SQLITE_ROW) {
+        printf("Daily Missions streak: %d (best %d)\n", sqlite3_column_int(stmt_select_daily_streak, 0), sqlite3_column_int(stmt_select_daily_streak, 1));
     }
+    sqlite3_reset(stmt_select_daily_streak);
 
-    sqlite3_bind_int(stmt_select_store_items_of_an_event, 1, chosen_event_id);
-
-    while ((rc = sqlite3_step(stmt_select_store_items_of_an_event)) == SQLITE_ROW) {
-        if (*store_item_count >= store_item_capacity) {
-            store_item_capacity *= 2;
-            struct store_item *new_store_items = realloc(store_items, store_item_capacity * sizeof(struct store_item));
-            if (!new_store_items) {
-                fprintf(stderr, "Failed to reallocate store items.\n");
-                sqlite3_reset(stmt_select_store_items_of_an_event);
-                free(store_items);
-                return NULL;
-            }
-            store_items = new_store_items;
+    int id_width = 10;
+    int name_width = 30;
+    int goal_width = 34;
+    int progress_width = 20;
+    int time_width = 30;
+    int rows = 0;
+
+    sqlite3_stmt *stmt_select_achievement_progress = statement(db, STMT_SELECT_ACHIEVEMENT_PROGRESS);
+    while (sqlite3_step(stmt_select_achievement_progress) == SQLITE_ROW) {
+        if (rows++ == 0) {
+            printf("Achievements\n");
+            print_top_border(5, id_width, name_width, goal_width, progress_width, time_width);
+            print_table_row(5, "ID", id_width, "Name", name_width, "Goal", goal_width, "Progress", progress_width, "Unlocked", time_width);
+            print_row_separator(5, id_width, name_width, goal_width, progress_width, time_width);
         }
 
-        store_items[*store_item_count].item_id = sqlite3_column_int(stmt_select_store_items_of_an_event, 0);
-        const char *item_description = (const char *)sqlite3_column_text(stmt_select_store_items_of_an_event, 1);
-        strncpy(store_items[*store_item_count].item_description, item_description, sizeof(store_items[*store_item_count].item_description) - 1);
-        store_items[*store_item_count].item_description[sizeof(store_items[*store_item_count].item_description) - 1] = '\0';
-        store_items[*store_item_count].cost = sqlite3_column_int(stmt_select_store_items_of_an_event, 2);
-        store_items[*store_item_count].event_id = sqlite3_column_int(stmt_select_store_items_of_an_event, 3);
-        store_items[*store_item_count].stock = sqlite3_column_int(stmt_select_store_items_of_an_event, 4);
-        const char *category = (const char *)sqlite3_column_text(stmt_select_store_items_of_an_event, 5);
-        strncpy(store_items[*store_item_count].category, category, sizeof(store_items[*store_item_count].category) - 1);
-        store_items[*store_item_count].category[sizeof(store_items[*store_item_count].category) - 1];
+        char id_str[12];
+        snprintf(id_str, sizeof(id_str), "%d", sqlite3_column_int(stmt_select_achievement_progress, 0));
 
-        (*store_item_count)++;
+        const char *metric = (const char *)sqlite3_column_text(stmt_select_achievement_progress, 2);
+        int any_currency = sqlite3_column_type(stmt_select_achievement_progress, 3) == SQLITE_NULL;
+        int currency_id = sqlite3_column_int(stmt_select_achievement_progress, 3);
+        long long threshold = sqlite3_column_int64(stmt_select_achievement_progress, 4);
+        long long value = sqlite3_column_int64(stmt_select_achievement_progress, 5);
 
-    }
+        char goal[64];
+        if (strcmp(metric, "daily_streak") == 0) snprintf(goal, sizeof(goal), "%lld-day streak", threshold);
+        else if (any_currency) snprintf(goal, sizeof(goal), "%s %lld (any currency)", metric, threshold);
+        else snprintf(goal, sizeof(goal), "%s %lld (currency %d)", metric, threshold, currency_id);
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error in fetching store items: %s\n", sqlite3_errmsg(db));
-        free(store_items);
-        sqlite3_reset(stmt_select_store_items_of_an_event);
-        return NULL;
+        char progress[48];
+        snprintf(progress, sizeof(progress), "%lld/%lld", value < threshold ? value : threshold, threshold);
+
+        char time_str[TIMESTAMP_SIZE] = "-";
+        if (sqlite3_column_type(stmt_select_achievement_progress, 6) != SQLITE_NULL) {
+            format_timestamp(sqlite3_column_int64(stmt_select_achievement_progress, 6), time_str, sizeof(time_str));
+        }
+
+        print_table_row(5, id_str, id_width, (const char *)sqlite3_column_text(stmt_select_achievement_progress, 1), name_width, goal, goal_width, progress, progress_width, time_str, time_width);
     }
+    sqlite3_reset(stmt_select_achievement_progress);
 
-    sqlite3_reset(stmt_select_store_items_of_an_event);
-    return store_items;
+    if (rows > 0) print_bottom_border(5, id_width, name_width, goal_width, progress_width, time_width);
 }
 
-void buy_item(sqlite3 *db) {
-    int rc;
-
+void list_stats(sqlite3 *db) {
     int currency_count;
     struct currency *currencies = get_currencies(db, &currency_count);
 
-    int event_count;
-    struct event *events = get_active_events(db, &event_count);
+    printf("Current balance\n");
+    print_currency_table(currencies, currency_count);
 
-    int e_id_width = 10;
-    int e_name_width = 30;
-    int time_width = 30;
-    int c_name_width = 30;
-    int bal_width = 20;
+    free(currencies);
 
-    print_top_border(6, e_id_width, e_name_width, time_width, time_width, c_name_width, bal_width);
-    print_table_row(6, "ID", e_id_width, "Event Name", e_name_width, "Start Time", time_width, "End Time", time_width, "Currency", c_name_width, "Balance", bal_width);
-    print_row_separator(6, e_id_width, e_name_width, time_width, time_width, c_name_width, bal_width);
+    print_lot_expiries(db);
+    print_task_progress(db);
+    print_reward_rules(db);
+    print_achievements(db);
+    print_storage_stats(db);
+    print_statement_stats();
+    print_change_feed_stats();
+    print_contention_stats();
+}
 
-    for (int i = 0; i < event_count; ++i) {
-        char id_str[10];
-        snprintf(id_str, sizeof(id_str), "%d", events[i].event_id);
+void list_affordable_items(sqlite3 *db) {
+    if (affordability_load(db) != 0) {
+        fprintf(stderr, "Failed to load affordability index.\n");
+        return;
+    }
+
+    int id_width = 10;
+    int desc_width = 80;
+    int cost_width = 20;
+    int stock_width = 10;
 
-        char start_time_str[21] = "N/A";
-        char end_time_str[21] = "N/A";
+    for (int i = 0; i < afford_index.event_count; ++i) {
+        int event_id = afford_index.events[i].event_id;
+        struct currency *currency = NULL;
+        int affordable_count;
+        struct store_item *items = get_affordable_items(db, event_id, &affordable_count, &currency);
+        if (!items || !currency) continue;
 
-        if (events[i].start_time != -1 && events[i].end_time != -1) {
-            struct tm start_tm, end_tm; // Declare separate struct instances
-            localtime_r(&events[i].start_time, &start_tm);
-            localtime_r(&events[i].end_time, &end_tm);
+        printf("Event %d: %d affordable item(s) with %d %ss\n", event_id, affordable_count, currency->balance, currency->symbol);
+        if (affordable_count == 0) continue;
 
-            strftime(start_time_str, sizeof(start_time_str), "%Y-%m-%d %H:%M:%S", &start_tm);
-            strftime(end_time_str, sizeof(end_time_str), "%Y-%m-%d %H:%M:%S", &end_tm);
-        }
+        print_top_border(4, id_width, desc_width, cost_width, stock_width);
+        print_table_row(4, "ID", id_width, "Description", desc_width, "Cost", cost_width, "Stock", stock_width);
+        print_row_separator(4, id_width, desc_width, cost_width, stock_width);
 
-        for (int j = 0; j < currency_count; ++j) {
-            if (currencies[j].currency_id == events[i].currency_id) {
-                char bal_str[20];
-                snprintf(bal_str, sizeof(bal_str), "%d %ss", currencies[j].balance, currencies[j].symbol);
+        for (int j = 0; j < affordable_count; ++j) {
+            char id_str[10];
+            snprintf(id_str, sizeof(id_str), "%d", items[j].item_id);
 
-                print_table_row(6, id_str, e_id_width, events[i].event_name, e_name_width, start_time_str, time_width, end_time_str, time_width, currencies[j].currency_name, c_name_width, bal_str, bal_width);
-                break;
+            char cost_str[20];
+            snprintf(cost_str, sizeof(cost_str), "%d %s", items[j].cost, currency->symbol);
+
+            char stock_str[10];
+            if (items[j].stock == -1) {
+                snprintf(stock_str, sizeof(stock_str), "INF");
             }
-        }
-    }
-    print_bottom_border(6, e_id_width, e_name_width, time_width, time_width, c_name_width, bal_width);
-    
-    printf("Enter event associated with the store: ");
-    int chosen_event_id;
-    scanf("%d", &chosen_event_id);
-    flush_input_buffer();
+            else snprintf(stock_str, sizeof(stock_str), "%d", items[j].stock);
 
-    int chosen_currency_id = -1;
-    for (int i = 0; i < event_count; ++i) {
-        if (events[i].event_id == chosen_event_id) {
-            chosen_currency_id = events[i].currency_id;
-            break;
+            print_table_row(4, id_str, id_width, items[j].item_description, desc_width, cost_str, cost_width, stock_str, stock_width);
         }
-    }
-    if (chosen_currency_id == -1) {
-        fprintf(stderr, "Could not find currency ID.\n");
-        free(currencies);
-        free(events);
-        return;
+        print_bottom_border(4, id_width, desc_width, cost_width, stock_width);
     }
 
-    int currency_idx = -1;
-    for (int i = 0; i < currency_count; ++i) {
-        if (currencies[i].currency_id == chosen_currency_id) {
-            currency_idx = i;
-            break;
-        }
-    }
-    if (currency_idx == -1) {
-        fprintf(stderr, "Could not find currency index.\n");
-        free(currencies);
-        free(events);
-        return;
-    }
+    printf("How many of the cheapest items across all currencies to show: ");
+    int n;
+    if (read_int(&n) != 1 || n <= 0) return;
 
-    int store_item_count;
-    struct store_item *store_items = get_store_items_by_event(db, &store_item_count, chosen_event_id);
+    int cheapest_count;
+    struct store_item **cheapest = get_cheapest_items(db, n, &cheapest_count);
+    if (!cheapest) return;
 
-    int s_id_width = 10;
-    int desc_width = 80;
-    int cost_width = 20;
-    int stock_width = 10;
-    int category_width = 20;
+    int eid_width = 10;
+
+    print_top_border(4, eid_width, id_width, desc_width, cost_width);
+    print_table_row(4, "Event ID", eid_width, "Item ID", id_width, "Description", desc_width, "Cost", cost_width);
+    print_row_separator(4, eid_width, id_width, desc_width, cost_width);
+
+    for (int i = 0; i < cheapest_count; ++i) {
+        struct afford_event *ae = affordability_find_event(cheapest[i]->event_id);
+        struct currency *currency = ae ? affordability_find_currency(ae->currency_id) : NULL;
 
-    print_top_border(5, s_id_width, desc_width, cost_width, stock_width, category_width);
-    print_table_row(5, "ID", s_id_width, "Description", desc_width, "Cost", cost_width, "Stock", stock_width, "Category", category_width);
-    print_row_separator(5, s_id_width, desc_width, cost_width, stock_width, category_width);
+        char eid_str[10];
+        snprintf(eid_str, sizeof(eid_str), "%d", cheapest[i]->event_id);
 
-    for (int i = 0; i < store_item_count; ++i) {
         char id_str[10];
-        snprintf(id_str, sizeof(id_str), "%d", store_items[i].item_id);
+        snprintf(id_str, sizeof(id_str), "%d", cheapest[i]->item_id);
 
         char cost_str[20];
-        snprintf(cost_str, sizeof(cost_str), "%d %s", store_items[i].cost, currencies[currency_idx].symbol);
+        snprintf(cost_str, sizeof(cost_str), "%d %s", cheapest[i]->cost, currency ? currency->symbol : "");
 
-        char stock_str[10];
-        if (store_items[i].stock == -1) {
-            snprintf(stock_str, sizeof(stock_str), "INF");
-        }
-        else snprintf(stock_str, sizeof(stock_str), "%d", store_items[i].stock);
-
-        print_table_row(5, id_str, s_id_width, store_items[i].item_description, desc_width, cost_str, cost_width, stock_str, stock_width, store_items[i].category, category_width);
+        print_table_row(4, eid_str, eid_width, id_str, id_width, cheapest[i]->item_description, desc_width, cost_str, cost_width);
     }
-    print_bottom_border(5, s_id_width, desc_width, cost_width, stock_width, category_width);
+    print_bottom_border(4, eid_width, id_width, desc_width, cost_width);
 
-    printf("Enter item to buy: ");
-    int chosen_item_id;
-    scanf("%d", &chosen_item_id);
-    flush_input_buffer();
+    free(cheapest);
+}
 
-    int item_idx = -1;
-    for (int i = 0; i < store_item_count; ++i) {
-        if (chosen_item_id == store_items[i].item_id) {
-            item_idx = i;
-            break;
+void deadline_heap_push(struct deadline_heap *heap, struct deadline entry) {
+    if (heap->count >= heap->capacity) {
+        int new_capacity = heap->capacity ? heap->capacity * 2 : 16;
+        struct deadline *new_entries = realloc(heap->entries, new_capacity * sizeof(struct deadline));
+        if (!new_entries) {
+            fprintf(stderr, "Unable to reallocate deadlines.\n");
+            return;
         }
-    }
-    if (item_idx == -1) {
-        fprintf(stderr, "Could not find item index.\n");
-        free(currencies);
-        free(events);
-        free(store_items);
-        return;
+        heap->entries = new_entries;
+        heap->capacity = new_capacity;
     }
 
-    if (store_items[item_idx].stock == 0) {
-        fprintf(stderr, "Item out of stock.\n");
-        free(currencies);
-        free(events);
-        free(store_items);
-        return; 
+    int i = heap->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->entries[parent].when <= entry.when) break;
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
     }
+    heap->entries[i] = entry;
+}
 
-    if (currencies[currency_idx].balance < store_items[item_idx].cost) {
-        fprintf(stderr, "Insufficient balance.\n");
-        free(currencies);
-        free(events);
-        free(store_items);
-        return;
+struct deadline deadline_heap_pop(struct deadline_heap *heap) {
+    struct deadline top = heap->entries[0];
+    struct deadline last = heap->entries[--heap->count];
+
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && heap->entries[child + 1].when < heap->entries[child].when) child++;
+        if (last.when <= heap->entries[child].when) break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
     }
+    if (heap->count > 0) heap->entries[i] = last;
 
-    sqlite3_bind_int(stmt_update_store_stock, 1, chosen_item_id);
-    sqlite3_bind_int(stmt_update_store_stock, 2, chosen_event_id);
+    return top;
+}
 
-    rc = sqlite3_step(stmt_update_store_stock);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error in updating stock: %s\n", sqlite3_errmsg(db));
-        sqlite3_reset(stmt_update_store_stock);
-        free(currencies);
-        free(events);
-        free(store_items);
-        return;
+// Points the timerfd at the earliest deadline, or disarms it when there is none.
+void scheduler_arm() {
+    if (scheduler_timer_fd == -1) return;
+
+    // A deadline is due once the clock is past it, hence the extra second. A zero
+    // it_value would disarm the timer, so very old deadlines use 1ns past the epoch.
+    struct itimerspec spec = {0};
+    if (deadlines.count > 0) {
+        spec.it_value.tv_sec = deadlines.entries[0].when > 0 ? deadlines.entries[0].when + 1 : 0;
+        if (spec.it_value.tv_sec == 0) spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(scheduler_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        perror("timerfd_settime");
     }
+}
 
-    sqlite3_reset(stmt_update_store_stock);
+void scheduler_schedule_activation(time_t start_time) {
+    if (scheduled_activation && scheduled_activation <= start_time) return;
 
-    sqlite3_bind_int(stmt_update_balance, 1, -store_items[item_idx].cost);
-    sqlite3_bind_int(stmt_update_balance, 2, chosen_currency_id);
+    struct deadline activation = { start_time, 0, DEADLINE_EVENT_ACTIVATION };
+    deadline_heap_push(&deadlines, activation);
+    scheduled_activation = start_time;
+}
 
-    rc = sqlite3_step(stmt_update_balance);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error in updating balance: %s\n", sqlite3_errmsg(db));
-        sqlite3_reset(stmt_update_balance);
-        free(currencies);
-        free(events);
-        free(store_items);
-        return;
+// Seeks the earliest pending start time and schedules it.
+int scheduler_schedule_next_activation(sqlite3 *db) {
+    sqlite3_stmt *stmt_select_next_activation = statement(db, STMT_SELECT_NEXT_ACTIVATION);
+    int rc = sqlite3_step(stmt_select_next_activation);
+    if (rc == SQLITE_ROW) {
+        scheduler_schedule_activation(sqlite3_column_int64(stmt_select_next_activation, 0));
     }
+    sqlite3_reset(stmt_select_next_activation);
 
-    sqlite3_reset(stmt_update_balance);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, "Error finding next event activation: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
 
-    printf("Current balance\n");
-    currencies = NULL;
-    currencies = get_currencies(db, &currency_count);
-    print_currency_table(currencies, currency_count);
+void scheduler_schedule_hold_expiry(time_t expires_at) {
+    if (scheduled_hold_expiry && scheduled_hold_expiry <= expires_at) return;
 
-    free(currencies);
-    free(events);
-    free(store_items);
+    struct deadline expiry = { expires_at, 0, DEADLINE_HOLD_EXPIRY };
+    deadline_heap_push(&deadlines, expiry);
+    scheduled_hold_expiry = expires_at;
 }
 
-struct task * get_all_tasks_of_an_event(sqlite3 *db, int *task_count, int event_id) {
-    int rc;
-    struct task *tasks = NULL;
-    *task_count = 0;
-    int task_capacity = 10;
-    tasks = malloc(task_capacity * sizeof(struct task));
-    if (!tasks) {
-        fprintf(stderr, "Unable to allocate memory for tasks.\n");
-        return NULL;
+// Seeks the earliest stock hold expiry and schedules it.
+int scheduler_schedule_next_hold_expiry(sqlite3 *db) {
+    sqlite3_stmt *stmt_select_next_hold_expiry = statement(db, STMT_SELECT_NEXT_HOLD_EXPIRY);
+    int rc = sqlite3_step(stmt_select_next_hold_expiry);
+    if (rc == SQLITE_ROW && sqlite3_column_type(stmt_select_next_hold_expiry, 0) != SQLITE_NULL) {
+        scheduler_schedule_hold_expiry(sqlite3_column_int64(stmt_select_next_hold_expiry, 0));
     }
+    sqlite3_reset(stmt_select_next_hold_expiry);
 
-    sqlite3_bind_int(stmt_select_all_tasks_of_an_event, 1, event_id);
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, "Error finding next stock hold expiry: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
 
-    while ((rc = sqlite3_step(stmt_select_all_tasks_of_an_event)) == SQLITE_ROW) {
-        if (*task_count >= task_capacity) {
-            task_capacity *= 2;
-            struct task *new_tasks = realloc(tasks, task_capacity * sizeof(struct task));
-            if (!new_tasks) {
-                fprintf(stderr, "Unable to reallocate tasks.\n");
-                sqlite3_reset(stmt_select_all_tasks_of_an_event);
-                free(tasks);
-                return NULL;
-            }
-            tasks = new_tasks;
-        }
+// Called for every new stock hold
+void scheduler_add_hold(time_t expires_at) {
+    scheduler_schedule_hold_expiry(expires_at);
+    scheduler_arm();
+}
+
+// Called for new or rescheduled time-limited events. Pending events only
+// compete for the activation slot; their end time is queued once they start.
+void scheduler_add_event(int event_id, time_t start_time, time_t end_time) {
+    if (start_time > time(NULL)) {
+        scheduler_schedule_activation(start_time);
+    } else {
+        struct deadline end = { end_time, event_id, DEADLINE_EVENT_END };
+        deadline_heap_push(&deadlines, end);
+    }
 
-        tasks[*task_count].event_id = sqlite3_column_int(stmt_select_all_tasks_of_an_event, 0);
-        tasks[*task_count].task_id = sqlite3_column_int(stmt_select_all_tasks_of_an_event, 1);
-        const char *task_name = (const char *)sqlite3_column_text(stmt_select_all_tasks_of_an_event, 2);
-        strncpy(tasks[*task_count].task_description, task_name, sizeof(tasks[*task_count].task_description) - 1);
-        tasks[*task_count].task_description[sizeof(tasks[*task_count].task_description) - 1] = '\0';
-        tasks[*task_count].currency_amount = sqlite3_column_int(stmt_select_all_tasks_of_an_event, 3);
-        tasks[*task_count].is_completed = sqlite3_column_int(stmt_select_all_tasks_of_an_event, 4);
+    scheduler_arm();
+}
 
-        (*task_count)++;
+int scheduler_init(sqlite3 *db) {
+    int rc;
+    sqlite3_stmt *stmt_select_event_deadlines = statement(db, STMT_SELECT_EVENT_DEADLINES);
+    while ((rc = sqlite3_step(stmt_select_event_deadlines)) == SQLITE_ROW) {
+        struct deadline end = {
+            sqlite3_column_int64(stmt_select_event_deadlines, 1),
+            sqlite3_column_int(stmt_select_event_deadlines, 0),
+            DEADLINE_EVENT_END
+        };
+        deadline_heap_push(&deadlines, end);
     }
+    sqlite3_reset(stmt_select_event_deadlines);
 
     if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Error fetching tasks: %s\n", sqlite3_errmsg(db));
-        free(tasks);
-        sqlite3_reset(stmt_select_all_tasks_of_an_event);
-        return NULL;
+        fprintf(stderr, "Error loading event deadlines: %s\n", sqlite3_errmsg(db));
+        return -1;
     }
 
-    sqlite3_reset(stmt_select_all_tasks_of_an_event);
-    return tasks;
-}
-
-void list_events_and_tasks(sqlite3 *db) {
-    int event_count;
-    struct event *events = get_active_events(db, &event_count);
+    if (scheduler_schedule_next_activation(db) != 0) return -1;
+    if (scheduler_schedule_next_hold_expiry(db) != 0) return -1;
 
-    int currency_count;
-    struct currency *currencies = get_currencies(db, &currency_count);
+    scheduler_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (scheduler_timer_fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
 
-    int id_width = 10;
-    int name_desc_width = 80;
-    int time_width = 20;
+    scheduler_arm();
+    return 0;
+}
 
-    print_top_border(4, id_width, name_desc_width, time_width, time_width);
-    print_table_row(4, "EID/TID", id_width, "Name/Description", name_desc_width, "Start Time/Currency", time_width, "End Time/Completed", time_width);
-    print_row_separator(4, id_width, name_desc_width, time_width, time_width);
+void scheduler_shutdown() {
+    if (scheduler_timer_fd != -1) close(scheduler_timer_fd);
+    scheduler_timer_fd = -1;
+    free(deadlines.entries);
+    memset(&deadlines, 0, sizeof(deadlines));
+    scheduled_activation = 0;
+    scheduled_hold_expiry = 0;
+}
 
-    for (int i = 0; i < event_count; ++i) {
+// Activates every pending event whose start time has passed, queues their end
+// times and schedules the following activation.
+void scheduler_activate_due(sqlite3 *db) {
+    scheduled_activation = 0;
 
-        int currency_idx = -1;
-        for (int j = 0; j < currency_count; ++j) {
-            if (currencies[j].currency_id == events[i].currency_id) {
-                currency_idx = j;
-                break;
-            }
+    int rc;
+    for (int i = 0; i < writer_count(); i++) {
+        sqlite3 *shard = writer(db, i);
+        sqlite3_stmt *stmt_activate_due_events = statement(shard, STMT_ACTIVATE_DUE_EVENTS);
+        sqlite3_bind_int64(stmt_activate_due_events, 1, time(NULL));
+        while ((rc = sqlite3_step(stmt_activate_due_events)) == SQLITE_ROW) {
+            struct deadline end = {
+                sqlite3_column_int64(stmt_activate_due_events, 2),
+                sqlite3_column_int(stmt_activate_due_events, 0),
+                DEADLINE_EVENT_END
+            };
+            deadline_heap_push(&deadlines, end);
+            printf("\nEvent %s has started.\n", (const char *)sqlite3_column_text(stmt_activate_due_events, 1));
         }
-        if (currency_idx == -1) {
-            fprintf(stderr, "Could not find currency index.\n");
-            free(events);
-            free(currencies);
-            return;
+        sqlite3_reset(stmt_activate_due_events);
+
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Error activating events: %s\n", sqlite3_errmsg(shard));
         }
+    }
 
-        int task_count;
-        struct task *tasks = get_all_tasks_of_an_event(db, &task_count, events[i].event_id);
+    scheduler_schedule_next_activation(db);
+}
 
-        char e_id_str[10];
-        snprintf(e_id_str, sizeof(e_id_str), "%d", events[i].event_id);
+// The event window, the streak and the tasks roll over together. Returns 0, -1
+// or TRANSACTION_BUSY.
+int reinitialize_daily_missions(sqlite3 *db, time_t new_start) {
+    time_t new_end = new_start + 24 * 3600;
 
-        char start_time_str[21] = "N/A";
-        char end_time_str[21] = "N/A";
+    int rc = begin_transaction(db);
+    if (rc != 0) return rc;
 
-        if (events[i].start_time != -1 && events[i].end_time != -1) {
-            struct tm start_tm, end_tm; // Declare separate struct instances
-            localtime_r(&events[i].start_time, &start_tm);
-            localtime_r(&events[i].end_time, &end_tm);
+    sqlite3_stmt *stmt_reinitialize_daily_missions_event = statement(db, STMT_REINITIALIZE_DAILY_MISSIONS_EVENT);
+    sqlite3_bind_int64(stmt_reinitialize_daily_missions_event, 1, new_start);
+    sqlite3_bind_int64(stmt_reinitialize_daily_missions_event, 2, new_end);
 
-            strftime(start_time_str, sizeof(start_time_str), "%Y-%m-%d %H:%M:%S", &start_tm);
-            strftime(end_time_str, sizeof(end_time_str), "%Y-%m-%d %H:%M:%S", &end_tm);
-        }
+    rc = sqlite3_step(stmt_reinitialize_daily_missions_event);
+    sqlite3_reset(stmt_reinitialize_daily_missions_event);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error reinitializing event 1 as active: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
 
-        print_table_row(4, e_id_str, id_width, events[i].event_name, name_desc_width, start_time_str, time_width, end_time_str, time_width);
-        print_row_separator(4, id_width, name_desc_width, time_width, time_width);
+    // Checked before the tasks reopen, against the window that just ended
+    sqlite3_stmt *stmt_break_daily_streak = statement(db, STMT_BREAK_DAILY_STREAK);
+    sqlite3_bind_int64(stmt_break_daily_streak, 1, new_start);
+    rc = sqlite3_step(stmt_break_daily_streak);
+    sqlite3_reset(stmt_break_daily_streak);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error updating the Daily Missions streak: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
+    int streak_broken = sqlite3_changes(db) > 0;
 
-        for (int j = 0; j < task_count; ++j) {
-            char t_id_str[10];
-            snprintf(t_id_str, sizeof(t_id_str), "%d", tasks[j].task_id);
+    sqlite3_stmt *stmt_reinitialize_daily_missions_tasks = statement(db, STMT_REINITIALIZE_DAILY_MISSIONS_TASKS);
+    rc = sqlite3_step(stmt_reinitialize_daily_missions_tasks);
+    sqlite3_reset(stmt_reinitialize_daily_missions_tasks);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error resetting Daily Missions tasks: %s\n", sqlite3_errmsg(db));
+        return rollback_transaction(db);
+    }
 
-            char curr_str[20];
-            snprintf(curr_str, sizeof(curr_str), "%d %s", tasks[j].currency_amount, currencies[currency_idx].symbol);
+    if ((rc = commit_operation(db, NULL, NULL)) != 0) return rc;
 
-            char completed[20];
-            if (tasks[j].is_completed == 0) {
-                snprintf(completed, sizeof(completed), "No");
-            } else snprintf(completed, sizeof(completed), "Yes");
+    if (streak_broken) printf("Daily Missions streak broken.\n");
+    task_index_invalidate();
+    scheduler_add_event(1, new_start, new_end);
+    return 0;
+}
 
-            print_table_row(4, t_id_str, id_width, tasks[j].task_description, name_desc_width, curr_str, time_width, completed, time_width);
-        }
-        
-        if (i < event_count - 1)
-            print_row_separator(4, id_width, name_desc_width, time_width, time_width);
+// Applies one popped deadline if it still matches the events table.
+void scheduler_fire(sqlite3 *db, struct deadline due) {
+    if (due.kind == DEADLINE_EVENT_ACTIVATION) {
+        if (due.when == scheduled_activation) scheduler_activate_due(db);
+        return;
+    }
+    if (due.kind == DEADLINE_HOLD_EXPIRY) {
+        if (due.when == scheduled_hold_expiry) expire_stock_holds(db);
+        return;
     }
 
-    print_bottom_border(4, id_width, name_desc_width, time_width, time_width);
-}
+    // Read and written in the event's shard
+    db = shard_for_id(db, due.event_id);
 
-void list_stats(sqlite3 *db) {
-    int currency_count;
-    struct currency *currencies = get_currencies(db, &currency_count);
+    sqlite3_stmt *stmt_select_event_schedule = statement(db, STMT_SELECT_EVENT_SCHEDULE);
+    sqlite3_bind_int(stmt_select_event_schedule, 1, due.event_id);
+    if (sqlite3_step(stmt_select_event_schedule) != SQLITE_ROW) {
+        sqlite3_reset(stmt_select_event_schedule);
+        return;
+    }
 
-    printf("Current balance\n");
-    print_currency_table(currencies, currency_count);
+    char event_name[100];
+    strncpy(event_name, (const char *)sqlite3_column_text(stmt_select_event_schedule, 0), sizeof(event_name) - 1);
+    event_name[sizeof(event_name) - 1] = '\0';
+    time_t end_time = sqlite3_column_int64(stmt_select_event_schedule, 1);
+    int is_active = sqlite3_column_int(stmt_select_event_schedule, 2);
+    sqlite3_reset(stmt_select_event_schedule);
+
+    if (is_active != EVENT_ACTIVE || end_time != due.when) return;
+
+    sqlite3_stmt *stmt_update_event_completion = statement(db, STMT_UPDATE_EVENT_COMPLETION);
+    sqlite3_bind_int(stmt_update_event_completion, 1, due.event_id);
+    int rc = sqlite3_step(stmt_update_event_completion);
+    sqlite3_reset(stmt_update_event_completion);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Error marking event %d as inactive: %s\n", due.event_id, sqlite3_errmsg(db));
+        return;
+    }
 
-    free(currencies);
+    printf("\nEvent %s has ended.\n", event_name);
+
+    if (due.event_id == 1) {
+        int attempt = 0;
+        while (reinitialize_daily_missions(db, end_time) == TRANSACTION_BUSY && transaction_backoff(&attempt));
+    }
 }
 
-void handle_inactive_or_complete_events(sqlite3 *db) {
-    int event_count;
-    struct event *events = get_active_events(db, &event_count);
-    int rc;
+// Fires every transition whose deadline has passed, then re-arms the timer.
+// Only due entries are touched, whatever the number of active events.
+void scheduler_run_due(sqlite3 *db) {
+    if (scheduler_timer_fd != -1) {
+        uint64_t expirations;
+        while (read(scheduler_timer_fd, &expirations, sizeof(expirations)) > 0);
+    }
 
-    for (int i = 0; i < event_count; ++i) {
-        if (events[i].is_time_limited) {
-            time_t current_time = time(NULL);
-            if (current_time > events[i].end_time) {
-                sqlite3_bind_int(stmt_update_event_completion, 1, events[i].event_id);
-
-                rc = sqlite3_step(stmt_update_event_completion);
-                if (rc != SQLITE_DONE) {
-                    fprintf(stderr, "Error marking event %d as inactive: %s\n", events[i].event_id, sqlite3_errmsg(db));
-                    sqlite3_reset(stmt_update_event_completion); 
-                    return;
-                }
+    // Same clock the timerfd uses; time() can lag it by a tick and would re-arm
+    // an already expired timer.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    while (deadlines.count > 0 && deadlines.entries[0].when < now.tv_sec) {
+        scheduler_fire(db, deadline_heap_pop(&deadlines));
+    }
 
-                sqlite3_reset(stmt_update_event_completion);
-                printf("Event %s has ended.\n", events[i].event_name);
+    scheduler_arm();
+}
 
-                if (events[i].event_id == 1) {
-                    time_t new_start = events[i].end_time;
-                    time_t new_end = new_start + 24 * 3600;
+// Blocks until stdin has input, firing event transitions that fall due while
+// the process is idle at the menu prompt.
+void wait_for_input(sqlite3 *db) {
+    fflush(stdout);
 
-                    sqlite3_bind_int64(stmt_reinitialize_daily_missions_event, 1, new_start);
-                    sqlite3_bind_int64(stmt_reinitialize_daily_missions_event, 2, new_end);
+    struct pollfd fds[3] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = shutdown_pipe[0], .events = POLLIN },
+        { .fd = scheduler_timer_fd, .events = POLLIN },
+    };
+    int nfds = scheduler_timer_fd == -1 ? 2 : 3;
 
-                    rc = sqlite3_step(stmt_reinitialize_daily_missions_event);
-                    if (rc != SQLITE_DONE) {
-                        fprintf(stderr, "Error reinitializing event %d as active: %s\n", events[i].event_id, sqlite3_errmsg(db));
-                        sqlite3_reset(stmt_reinitialize_daily_missions_event); 
-                        return;
-                    }
+    // Vacuum only while there is something to reclaim, then block indefinitely
+    int vacuum_pending = 1;
 
-                    sqlite3_reset(stmt_reinitialize_daily_missions_event);
-                    sqlite3_exec(db, sql_reinitialize_daily_missions_tasks, NULL, NULL, NULL);
-                }
+    while (1) {
+        int timeout = vacuum_pending ? VACUUM_IDLE_MS : -1;
+        if (disk_db && (timeout == -1 || timeout > memory_checkpoint_interval * 1000)) {
+            timeout = memory_checkpoint_interval * 1000;
+        }
 
-                continue;
+        int ready = poll(fds, nfds, timeout);
+        if (ready == -1 || shutdown_requested) return;
+        if (ready == 0) {
+            if (vacuum_pending) {
+                int remaining = 0;
+                // Every shard attaches the same archive; vacuum it through writer 0 only
+                for (int i = 0; i < writer_count(); i++) remaining += vacuum_step(writer(db, i), i == 0);
+                vacuum_pending = remaining > 0;
             }
+            memory_checkpoint_if_due(db);
+            continue;
+        }
+        if (fds[0].revents || fds[1].revents) return;
+
+        if (fds[2].revents & POLLIN) {
+            scheduler_run_due(db);
+            balance_view_update(db);
+            fprintf(menu_stream(), "Enter your choice: ");
+            fflush(menu_stream());
         }
+    }
+}
 
+void handle_inactive_or_complete_events(sqlite3 *db) {
+    int event_count;
+    struct event *events = get_active_events(db, &event_count);
 
-        int task_count;
-        struct task *tasks = get_incomplete_tasks_of_an_event(db, &task_count, events[i].event_id);
+    // Time-limited events are ended by the scheduler; this only retires events
+    // whose tasks are all done. Daily Missions stays open until its rollover,
+    // which reopens the tasks and settles the streak.
+    for (int i = 0; i < event_count; ++i) {
+        if (events[i].event_id == 1) continue;
+        int task_count = visit_tasks(db, statement(db, STMT_SELECT_INCOMPLETE_TASKS_OF_AN_EVENT), events[i].event_id, stop_at_first_task, NULL);
 
         if (task_count == 0) {
+            sqlite3 *shard = shard_for_id(db, events[i].event_id);
+            sqlite3_stmt *stmt_update_event_completion = statement(shard, STMT_UPDATE_EVENT_COMPLETION);
             sqlite3_bind_int(stmt_update_event_completion, 1, events[i].event_id);
 
             int rc = sqlite3_step(stmt_update_event_completion);
             if (rc != SQLITE_DONE) {
-                fprintf(stderr, "Error marking event %d as inactive: %s\n", events[i].event_id, sqlite3_errmsg(db));
+                fprintf(stderr, "Error marking event %d as inactive: %s\n", events[i].event_id, sqlite3_errmsg(shard));
                 sqlite3_reset(stmt_update_event_completion); 
                 return;
             }
@@ -1752,9 +6845,7 @@ void handle_inactive_or_complete_events(sqlite3 *db) {
             sqlite3_reset(stmt_update_event_completion);
             printf("Event %s has been completed.\n", events[i].event_name);
         }
-
-        free(tasks);
     }
 
     free(events);
-}
\ No newline at end of file
+}